@@ -74,6 +74,8 @@ typedef struct bitstream
 	BITSTREAM_WORD_TYPE wBuffer;			// Current word bit buffer
 	BITSTREAM_WORD_TYPE bits_per_src_word;	// Bitused in the source word. e.g. 's' = 16-bits
 	BITSTREAM_WORD_TYPE bitsFree;			// Number of bits available in the current word
+	uint64_t wAccumulator;		// 64-bit bit buffer, the encoder writes its 16-bit words in pairs
+	int32_t accumulatorBits;	// Number of valid bits in wAccumulator
 } BITSTREAM;
 
 
@@ -134,6 +136,17 @@ static RLVTABLE enczerorunstable = {
 	}
 };	
 
+// Adaptive coding, only within GPMF_TYPE_COMPRESSED_ADAPTIVE ('$') KLVs, so parsers without it reject them rather than
+// decoding '#' Huffman channels from a Rice bitstream: a channel's quantization field with the top bit set is followed by a 16-bit coding word
+// (predictor << 8) | k, and the channel is Rice coded rather than using the Huffman tables. There is no end code, 
+// all repeat-1 values are stored as zigzag values, <q ones>'0'<k bits> for q < RICE_ESCAPE_ONES, else 
+// <RICE_ESCAPE_ONES ones><bits_per_src_word + 2 bits>.
+#define COMPRESS_CODING_FLAG16	0x8000
+#define COMPRESS_CODING_FLAG8	0x80
+#define COMPRESS_PREDICT_DELTA			0	// value minus the previous value
+#define COMPRESS_PREDICT_DELTA_DELTA	1	// delta minus the previous delta, for smooth signals
+#define RICE_ESCAPE_ONES		16
+
 #define HUFF_ESC_CODE_ENTRY		0	
 #define HUFF_END_CODE_ENTRY		1	
 static RLVTABLE enccontrolcodestable = {
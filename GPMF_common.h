@@ -64,6 +64,10 @@ typedef enum
 
 	GPMF_TYPE_COMPLEX = '?', //for sample with complex data structures, base size in bytes.  Data is either opaque, or the stream has a TYPE structure field for the sample.
 	GPMF_TYPE_COMPRESSED = '#', //Huffman compression STRM payloads.  4-CC <type><size><rpt> <data ...> is compressed as 4-CC '#'<new size/rpt> <type><size><rpt> <compressed data ...>
+	GPMF_TYPE_COMPRESSED_ADAPTIVE = '$', //Same layout as '#', where channels may be Rice coded, flagged by the top bit of their quantization field.  Older parsers, which only know '#', don't decode it.
+	GPMF_TYPE_COMPRESSED_FLOAT = '%', //XOR compression of float STRM payloads.  4-CC 'f'<size><rpt> <data ...> is compressed as 4-CC '%'<4><new rpt> 'f'<size><rpt> <compressed data ...>
+	GPMF_TYPE_COMPRESSED_WIDE = '&', //Delta compression of 32/64-bit integer STRM payloads.  4-CC 'l','L','j' or 'J'<size><rpt> <data ...> is compressed as 4-CC '&'<4><new rpt> <type><size><rpt> <compressed data ...>
+	GPMF_TYPE_COMPRESSED_SEGMENTS = '*', //Consecutive compressed blocks of one stream.  4-CC '*'<4><new rpt> <type><size><total rpt> then for each block the block's KLV without its 4-CC, '#'/'%'/'&'<size><rpt> <type><size><rpt> <compressed data ...> or <type><size><rpt> <data ...>
 
 	GPMF_TYPE_NEST = 0, // used to nest more GPMF formatted metadata 
 
@@ -89,10 +93,14 @@ typedef enum
 #define GPMF_MAKE_TYPE_SIZE_COUNT(t,s,c)		((t)&0xff)|(((s)&0xff)<<8)|(((c)&0xff)<<24)|(((c)&0xff00)<<8)
 #define GPMF_DATA_SIZE(a)		((GPMF_SAMPLE_SIZE(a)*GPMF_SAMPLES(a)+3)&~0x3)
 #define GPMF_DATA_PACKEDSIZE(a)	((GPMF_SAMPLE_SIZE(a)*GPMF_SAMPLES(a)))
-#define GPMF_VALID_FOURCC(a)	(((((a>>24)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>24)&0xff)>='A'&&((a>>24)&0xff)<='Z') || (((a>>24)&0xff)>='0'&&((a>>24)&0xff)<='9') || (((a>>24)&0xff)==' ') ) && \
-								( (((a>>16)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>16)&0xff)>='A'&&((a>>16)&0xff)<='Z') || (((a>>16)&0xff)>='0'&&((a>>16)&0xff)<='9') || (((a>>16)&0xff)==' ') ) && \
-								( (((a>>8)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>8)&0xff)>='A'&&((a>>8)&0xff)<='Z') || (((a>>8)&0xff)>='0'&&((a>>8)&0xff)<='9') || (((a>>8)&0xff)==' ') ) && \
-								( (((a>>0)&0xff)>='a'&&((a>>24)&0xff)<='z') || (((a>>0)&0xff)>='A'&&((a>>0)&0xff)<='Z') || (((a>>0)&0xff)>='0'&&((a>>0)&0xff)<='9') || (((a>>0)&0xff)==' ') )) 
+// SWAR FourCC check: each byte is 0-9, A-Z, a-z or space. A byte without its high bit set can't carry into its neighbour,
+// so (a + (0x80-lo)) sets the byte's high bit where it's >= lo, and (a + (0x7f-hi)) where it's > hi.
+#define GPMF_FOURCC_BYTES_IN(a,lo,hi)	((((uint32_t)(a) + 0x01010101u*(0x80-(lo))) & ~((uint32_t)(a) + 0x01010101u*(0x7f-(hi)))) & 0x80808080u)
+#define GPMF_VALID_FOURCC(a)	((((uint32_t)(a) & 0x80808080u) == 0) & \
+								((GPMF_FOURCC_BYTES_IN(a,'0','9') | GPMF_FOURCC_BYTES_IN(a,'A','Z') | GPMF_FOURCC_BYTES_IN(a,'a','z') | GPMF_FOURCC_BYTES_IN(a,' ',' ')) == 0x80808080u))
+
+#define GPMF_IS_COMPRESSED(t)	((t) == GPMF_TYPE_COMPRESSED || (t) == GPMF_TYPE_COMPRESSED_ADAPTIVE || (t) == GPMF_TYPE_COMPRESSED_FLOAT || (t) == GPMF_TYPE_COMPRESSED_WIDE || (t) == GPMF_TYPE_COMPRESSED_SEGMENTS) // <type><size><rpt> of the uncompressed data follows the '#', '$', '%', '&' or '*' type-size-repeat
+
 
 #define PRINTF_4CC(k)			((k) >> 0) & 0xff, ((k) >> 8) & 0xff, ((k) >> 16) & 0xff, ((k) >> 24) & 0xff
 
@@ -132,6 +140,130 @@ typedef enum GPMFKey // TAG in all caps are GoPro preserved (are defined by GoPr
 
 
 
+// Structure validation shared by the writer and the parser. Iterative, with the open nests on a fixed stack, so hostile
+// input can't exhaust the call stack and nothing is allocated.
+#define GPMF_NEST_LIMIT 16
+
+#define GPMF_VALIDATE_RECURSE		(1<<0)	// check the contents of each nest
+#define GPMF_VALIDATE_DEVC			(1<<1)	// every top level KLV must be a DEVC
+#define GPMF_VALIDATE_DEVC_FIRST	(1<<2)	// the first top level KLV must be a DEVC
+#define GPMF_VALIDATE_EXACT			(1<<3)	// KLVs must fill every level exactly, no null padding
+#define GPMF_VALIDATE_TRAILING		(1<<4)	// a lone last long, or anything that isn't a KLV after a counted top level nest, ends the buffer
+
+typedef enum GPMF_INVALID
+{
+	GPMF_INVALID_NONE = 0,
+	GPMF_INVALID_FOURCC,		// key isn't four of 0-9, A-Z, a-z or space
+	GPMF_INVALID_SIZE,			// KLV runs past the end of its nest or the buffer
+	GPMF_INVALID_DEPTH,			// nests deeper than GPMF_NEST_LIMIT
+	GPMF_INVALID_NOT_DEVC,		// top level KLV that must be a DEVC
+	GPMF_INVALID_TRUNCATED		// a lone long at the end of a level, too short for a KLV header
+} GPMF_INVALID;
+
+typedef struct GPMF_validation
+{
+	uint32_t reason;			// GPMF_INVALID
+	uint32_t pos;				// offset in longs of the KLV that failed, or where a valid buffer ended
+	uint32_t level;				// its nest level, 0 is the top
+	uint32_t key;				// its FourCC
+	uint32_t nest_key;			// FourCC of the nest holding it, 0 at the top level
+	uint32_t devices;			// top level nests, counted when recursing
+} GPMF_validation;
+
+#ifdef _WINDOWS
+#define GPMF_INLINE static __inline
+#else
+#define GPMF_INLINE static inline
+#endif
+
+GPMF_INLINE uint32_t GPMF_ValidateBuffer(uint32_t *buffer, uint32_t size_longs, uint32_t flags, GPMF_validation *report) // GPMF_OK or GPMF_ERROR_BAD_STRUCTURE, report may be NULL
+{
+	GPMF_validation local;
+	uint32_t end[GPMF_NEST_LIMIT], nest_key[GPMF_NEST_LIMIT];
+	uint32_t pos = 0, level = 0, reason = GPMF_INVALID_NONE;
+
+	if (report == NULL)
+		report = &local;
+	report->devices = 0;
+	end[0] = size_longs;
+	nest_key[0] = 0;
+
+	while (1)
+	{
+		uint32_t key, tsr, size;
+
+		if (pos == end[level])
+		{
+			if (level == 0)
+				break;
+			level--;
+			continue;
+		}
+
+		key = buffer[pos];
+		if (level == 0 && key != GPMF_KEY_DEVICE && ((flags & GPMF_VALIDATE_DEVC) || ((flags & GPMF_VALIDATE_DEVC_FIRST) && pos == 0)) &&
+			!(pos + 1 == end[0] && (flags & GPMF_VALIDATE_TRAILING)))
+		{
+			reason = GPMF_INVALID_NOT_DEVC;
+			break;
+		}
+		if (key == GPMF_KEY_END && !(flags & GPMF_VALIDATE_EXACT))
+		{
+			pos++; // null padding
+			continue;
+		}
+		if (pos + 1 == end[level])
+		{
+			if (level == 0 && (flags & GPMF_VALIDATE_TRAILING))
+				break;
+			reason = GPMF_INVALID_TRUNCATED;
+			break;
+		}
+		if (!GPMF_VALID_FOURCC(key))
+		{
+			if (level == 0 && (flags & GPMF_VALIDATE_TRAILING) && report->devices > 0)
+				break;
+			reason = GPMF_INVALID_FOURCC;
+			break;
+		}
+
+		tsr = buffer[pos + 1];
+		size = GPMF_DATA_SIZE(tsr) >> 2;
+		if (size + 2 > end[level] - pos)
+		{
+			reason = GPMF_INVALID_SIZE;
+			break;
+		}
+
+		if (GPMF_SAMPLE_TYPE(tsr) == GPMF_TYPE_NEST && (flags & GPMF_VALIDATE_RECURSE))
+		{
+			if (level + 1 >= GPMF_NEST_LIMIT)
+			{
+				reason = GPMF_INVALID_DEPTH;
+				break;
+			}
+			if (level == 0)
+				report->devices++;
+			level++;
+			end[level] = pos + 2 + size;
+			nest_key[level] = key;
+			pos += 2;
+			continue;
+		}
+		pos += 2 + size;
+	}
+
+	report->reason = reason;
+	report->pos = pos;
+	report->level = level;
+	report->key = pos < size_longs ? buffer[pos] : 0;
+	report->nest_key = nest_key[level];
+
+	return reason == GPMF_INVALID_NONE ? GPMF_OK : GPMF_ERROR_BAD_STRUCTURE;
+}
+
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,43 @@
+/*! @file GPMF_compress.h
+ *
+ *	@brief GPMFCompress(), internal to the writer library, shared with GPMF_writer.c and the compressor benchmark
+ *	
+ *	@version 1.0.0
+ *	
+ *	(C) Copyright 2017 GoPro Inc (http://gopro.com/).
+ *
+ *  Licensed under either:
+ *  - Apache License, Version 2.0, http://www.apache.org/licenses/LICENSE-2.0
+ *  - MIT license, http://opensource.org/licenses/MIT
+ *  at your option.
+ *  
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _GPMF_COMPRESS_H
+#define _GPMF_COMPRESS_H
+
+#include "GPMF_writer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STREAM_CODING_ADAPTIVE		1		// device_metadata.coding options, see GPMFWriteStreamSetAdaptiveCompression()
+#define STREAM_CODING_WIDE_DELTA	2		// see GPMFWriteStreamSetWideCompression()
+#define STREAM_CODING_FLOAT_XOR		4		// see GPMFWriteStreamSetFloatCompression()
+
+// Compress the KLV src_gpmf of payloadAddition bytes with QUAN quantize into dst_gpmf, which needs room for 4 bytes 
+// more than the source.  coding is a mask of STREAM_CODING_* options, stats accumulates the KLV's statistics unless 
+// NULL.  Returns the bytes written.
+uint32_t GPMFCompress(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition, uint32_t quantize, uint32_t coding, GPMFStreamStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 #include <string.h>
 #include "threadlock.h"
 #include "GPMF_writer.h"
+#include "GPMF_compress.h"
 
 #ifdef DBG
  #if _WINDOWS
@@ -43,6 +44,15 @@
 #endif
 
 #define SCAN_GPMF_FOR_STATE		1		// use existing GPMF size fields rather then mirroring variables -- improves thread re-entrancy 
+#define FLOAT_XOR_COMPRESSION		0		// default for new streams, see GPMFWriteStreamSetFloatCompression(). QUAN enabled 'f' streams are losslessly XOR compressed as GPMF_TYPE_COMPRESSED_FLOAT
+#define WIDE_DELTA_COMPRESSION		0		// default for new streams, see GPMFWriteStreamSetWideCompression(). QUAN enabled 'l','L','j','J' streams are delta coded 
+											// at full width as GPMF_TYPE_COMPRESSED_WIDE, otherwise 32-bit values are compressed as two 16-bit channels and 64-bit values are stored as is
+#define BLOCK_COMPRESSION			1		// streams with GPMFWriteStreamSetBlockCompression() compress completed blocks within the stream buffer at store time
+#if defined(THREADLOCK_WORKERS)
+#define PARALLEL_COMPRESSION_THREADS	8		// most worker threads GPMFWriteSetCompressionThreads() can start for QUAN streams, 0 compresses inline
+#else
+#define PARALLEL_COMPRESSION_THREADS	0
+#endif
 
 typedef struct GPMFWriterWorkspace
 {
@@ -58,8 +68,62 @@ typedef struct GPMFWriterWorkspace
 
 	uint32_t *extrn_buffer[GPMF_CHANNEL_MAX][GPMF_EXT_PERFORMATTED_STREAMS];
 	uint32_t extrn_buffer_size[GPMF_CHANNEL_MAX];
+
+#if PARALLEL_COMPRESSION_THREADS
+	struct compress_pool *pool;
+#endif
 } GPMFWriterWorkspace;
 
+#define COMPRESS_DST_SLACK		4		// GPMFCompress() output can exceed the source by the uncompressed type-size-repeat, it falls back to a raw copy before going further
+#define COMPRESS_CHANNEL_HEADER	4		// most bytes ahead of a '#' channel's bitstream: quantization and coding word, or 16-bit alignment
+
+#if PARALLEL_COMPRESSION_THREADS
+#define COMPRESS_MAX_JOBS		64
+
+typedef struct compress_job
+{
+	uint32_t src_offset;		// scratch copy of the KLV exactly as the payload loop will pass it to GPMFCompress()
+	uint32_t dst_offset;
+	uint32_t srcsize;
+	uint32_t dstsize;
+	uint32_t quantize;
+	uint32_t coding;
+	GPMFStreamStats stats;		// added to the stream's statistics when the payload loop uses the result
+} compress_job;
+
+typedef struct compress_pool
+{
+	LOCK lock;
+	CONDITION wake;				// workers wait here for jobs
+	CONDITION done;				// the extracting thread waits here for the last job
+	WORKER workers[PARALLEL_COMPRESSION_THREADS];
+	uint32_t workercount;
+	uint32_t threads;			// from GPMFWriteSetCompressionThreads(), including the extracting thread
+	uint32_t shutdown;
+	uint32_t busy;				// owned by one GPMFWriteGetPayload() at a time, others compress inline
+
+	compress_job jobs[COMPRESS_MAX_JOBS];
+	uint32_t queued;			// jobs prepared by the owner, published to the workers as jobcount
+	uint32_t jobcount;
+	uint32_t nextjob;
+	uint32_t completed;
+	uint32_t matched;			// jobs before this have been consumed by the payload loop
+
+	uint8_t *scratch;
+	uint32_t scratch_size;
+	uint32_t scratch_used;
+} compress_pool;
+#endif
+
+static void GPMF_BuildFusedCodeTables(void);
+#if PARALLEL_COMPRESSION_THREADS
+static compress_pool *CreateCompressPool(uint32_t threads);
+static void DestroyCompressPool(compress_pool *pool);
+#endif
+#if BLOCK_COMPRESSION
+static uint32_t CopyStoredBlocks(uint32_t *dst, uint32_t **src, uint32_t *samples);
+#endif
+
 
 int32_t GPMFWriteTypeSize(int type)
 {
@@ -91,6 +155,10 @@ int32_t GPMFWriteTypeSize(int type)
 	case GPMF_TYPE_UTC_DATE_TIME:		ssize = 16; break;
 	
 	case GPMF_TYPE_COMPRESSED:			ssize = 1; break;  
+	case GPMF_TYPE_COMPRESSED_ADAPTIVE:	ssize = 1; break;
+	case GPMF_TYPE_COMPRESSED_FLOAT:	ssize = 4; break;
+	case GPMF_TYPE_COMPRESSED_WIDE:	ssize = 4; break;
+	case GPMF_TYPE_COMPRESSED_SEGMENTS:	ssize = 4; break;
 	case GPMF_TYPE_COMPLEX:				ssize = -1; break;	// unsupported for structsize type
 	case GPMF_TYPE_NEST:				ssize = -1; break;	// unsupported for structsize type
 	default:							ssize = -1;  		// unsupported for structsize type
@@ -164,6 +232,36 @@ uint32_t GPMFWriteSetScratchBuffer( size_t ws_handle, uint32_t *buf, uint32_t bu
 }
 
 
+uint32_t GPMFWriteSetCompressionThreads(size_t ws_handle, uint32_t threads)
+{
+	GPMFWriterWorkspace *ws = (GPMFWriterWorkspace *)ws_handle;
+
+	if (ws == NULL) return GPMF_ERROR_MEMORY;
+
+#if PARALLEL_COMPRESSION_THREADS
+	{
+		int i;
+
+		for (i = 0; i < GPMF_CHANNEL_MAX; i++) // no payload is being extracted while the pool is replaced
+			Lock(&ws->metadata_device_list[i]);
+
+		if (ws->pool == NULL || ws->pool->threads != threads)
+		{
+			DestroyCompressPool(ws->pool);
+			ws->pool = threads > 1 ? CreateCompressPool(threads) : NULL; // workers are started on first use
+		}
+
+		for (i = GPMF_CHANNEL_MAX - 1; i >= 0; i--)
+			Unlock(&ws->metadata_device_list[i]);
+	}
+#else
+	(void)threads;
+#endif
+
+	return GPMF_ERROR_OK;
+}
+
+
 size_t GPMFWriteStreamOpen(size_t ws_handle, uint32_t channel, uint32_t device_id, char *device_name, char *buffer, uint32_t buffer_size)
 {
 	device_metadata *dm, *prevdm, *nextdm;
@@ -218,6 +316,12 @@ size_t GPMFWriteStreamOpen(size_t ws_handle, uint32_t channel, uint32_t device_i
 	dm->channel = channel;
 	dm->ws_handle = ws_handle;
 	dm->memory_allocated = memory_allocated;
+#if FLOAT_XOR_COMPRESSION
+	dm->coding |= STREAM_CODING_FLOAT_XOR;
+#endif
+#if WIDE_DELTA_COMPRESSION
+	dm->coding |= STREAM_CODING_WIDE_DELTA;
+#endif
 
 	if (channel == GPMF_CHANNEL_SETTINGS) // more sticky data is used for global settings and there is likely no aperoidic
 	{
@@ -572,9 +676,176 @@ static uint32_t SeekEndGPMF(uint32_t *payload_buf, uint32_t alloc_size)
 	return 0;
 }
 
+
+// Rebuild the (sample, time) index from timestamp entry 'from' onwards. Both columns are monotonic, so they can be binary searched.
+static void TimeIndexUpdate(device_metadata *dm, uint32_t from)
+{
+	uint32_t pos;
+
+	if (from == 0)
+	{
+		dm->indexTimeStamp[0] = 0;
+		dm->indexSample[0] = 0;
+	}
+	for (pos = from; pos < dm->payloadTimeStampCount; pos++)
+	{
+		dm->indexTimeStamp[pos + 1] = dm->indexTimeStamp[pos] + dm->deltaTimeStamp[pos];
+		dm->indexSample[pos + 1] = dm->indexSample[pos] + dm->sampleCount[pos];
+	}
+}
+
+// Number of samples with a timestamp before latestTimeStamp, extrapolating within the timestamp entry that straddles it.
+static uint32_t TimeIndexSamplesBefore(device_metadata *dm, uint64_t firstTimeStamp, uint64_t latestTimeStamp)
+{
+	uint32_t lo = 0, hi, smps, delta;
+	uint64_t next_first_ts;
+
+	if (dm->payloadTimeStampCount == 0 || latestTimeStamp <= firstTimeStamp)
+		return 0;
+
+	// last entry whose first sample is before latestTimeStamp (the newest entry is always a candidate)
+	hi = dm->payloadTimeStampCount - 1;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi + 1) >> 1;
+		if (firstTimeStamp + dm->indexTimeStamp[mid] < latestTimeStamp)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	smps = dm->indexSample[lo];
+	next_first_ts = firstTimeStamp + dm->indexTimeStamp[lo];
+
+	delta = dm->deltaTimeStamp[lo];
+	if (delta == 0 && lo > 0) delta = dm->deltaTimeStamp[lo - 1];
+	if (delta && dm->sampleCount[lo] > 0)
+	{
+		delta /= dm->sampleCount[lo];
+		if (delta)
+			smps += (uint32_t)((latestTimeStamp - next_first_ts) / delta);
+	}
+
+	return smps;
+}
+
+// The timestamp entry containing the sample 'samples', i.e. the last entry that starts at or before it.
+static uint32_t TimeIndexEntryForSamples(device_metadata *dm, uint32_t samples)
+{
+	uint32_t lo = 0, hi = dm->payloadTimeStampCount;
+
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi + 1) >> 1;
+		if (dm->indexSample[mid] <= samples)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// Timestamp of the first sample, with the sampling jitter removed via linear regression when there are enough timestamps.
+static uint64_t TimeIndexFirstTimeStamp(device_metadata *dm)
+{
+	uint64_t computedTimeStamp = dm->firstTimeStamp;
+
+	if (dm->payloadTimeStampCount > 5)  // reduce sampling jitter if we have enough timestamps, if there is not jitter the timestamps are preserved.
+	{
+		uint32_t sample;
+
+		// Compute the linear regression
+		FLOAT_PRECISION slope = 0.0, intercept = 0.0;
+		FLOAT_PRECISION top = 0.0, bot = 0.0, meanX = 0, meanY = 0;
+		uint32_t uniformStep = 0, tests = 0;
+
+		for (sample = 1; sample < dm->payloadTimeStampCount-1; sample++)
+		{
+			tests++;
+			if( ((dm->deltaTimeStamp[sample] / dm->sampleCount[sample]) &~7) == ((dm->deltaTimeStamp[sample-1] / dm->sampleCount[sample-1]) & ~7))
+				uniformStep++;
+		}
+
+		if (uniformStep != tests) // erratic timeStamps, linear regress them
+		{
+			for (sample = 0; sample < dm->payloadTimeStampCount; sample++)
+			{
+				meanY += (FLOAT_PRECISION)(dm->firstTimeStamp + dm->indexTimeStamp[sample]);
+				meanX += (FLOAT_PRECISION)dm->indexSample[sample];
+			}
+
+			meanY /= (FLOAT_PRECISION)dm->payloadTimeStampCount;
+			meanX /= (FLOAT_PRECISION)dm->payloadTimeStampCount;
+
+			for (sample = 0; sample < dm->payloadTimeStampCount; sample++)
+			{
+				FLOAT_PRECISION smps = (FLOAT_PRECISION)dm->indexSample[sample];
+				FLOAT_PRECISION ts = (FLOAT_PRECISION)(dm->firstTimeStamp + dm->indexTimeStamp[sample]);
+
+				top += (smps - meanX)*(ts - meanY);
+				bot += (smps - meanX)*(smps - meanX);
+			}
+			slope = top / bot;
+			intercept = meanY - slope * meanX;
+
+			if (slope > 0 && (int64_t)intercept < (int64_t)dm->lastTimeStamp) // i.e. not crazy
+			{
+				if (intercept < 0)
+					intercept = 1.0;
+				computedTimeStamp = (uint64_t)(intercept + 0.5); // compute more accurate timestamp
+			}
+		}
+	}
+
+	return computedTimeStamp;
+}
+
+#if BLOCK_COMPRESSION
+// Once a store completes another block of dm->block_samples, replace the uncompressed samples with their compressed 
+// KLV, call with the device locked.  Only while the buffer holds just the stored blocks followed by these samples of 
+// the same FourCC.  If compression doesn't make them smaller they stay as they are until the next block completes.
+static void CompressStoredBlock(device_metadata *dm, uint32_t added)
+{
+	uint32_t *klv = dm->payload_buffer;
+	uint32_t samples, rawbytes, blockbytes, *scratch;
+
+	while (GPMF_VALID_FOURCC(klv[0]) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(klv[1])))
+		klv += 2 + (GPMF_DATA_SIZE(klv[1]) >> 2);
+
+	if (!GPMF_VALID_FOURCC(klv[0]) || GPMF_SAMPLE_TYPE(klv[1]) == GPMF_TYPE_NEST)
+		return;
+	if (klv != dm->payload_buffer && klv[0] != dm->payload_buffer[0])
+		return;
+	rawbytes = 8 + GPMF_DATA_SIZE(klv[1]);
+	if (klv[rawbytes >> 2] != GPMF_KEY_END)
+		return;
+
+	samples = GPMF_SAMPLES(klv[1]);
+	if (added > samples || samples / dm->block_samples == (samples - added) / dm->block_samples)
+		return;
+
+	scratch = GetScratchBuf(dm, rawbytes + COMPRESS_DST_SLACK, GPMF_FLAGS_NONE);
+	if (scratch == NULL)
+		return;
+
+	blockbytes = GPMFCompress(scratch, klv, 8 + GPMF_DATA_PACKEDSIZE(klv[1]), dm->quantize, dm->coding, &dm->stats);
+	if (scratch[1] == klv[1] || blockbytes >= rawbytes) // stored uncompressed
+		return;
+
+	while (blockbytes & 3)
+		((uint8_t *)scratch)[blockbytes++] = 0;
+	memcpy(klv, scratch, blockbytes);
+	klv[blockbytes >> 2] = GPMF_KEY_END;
+	dm->payload_curr_size = (uint32_t)((uint8_t *)klv - (uint8_t *)dm->payload_buffer) + blockbytes;
+}
+#endif
+
+
 void AppendFormattedMetadata(device_metadata *dm, uint32_t *formatted, uint32_t bytelen, uint32_t flags, uint32_t sample_count, uint64_t TimeStamp)
 {
 	uint32_t count_msg[5];
+	uint32_t storedblock = 0;
 	uint32_t tag = formatted[0], *payload_ptr;
 	uint32_t typesize = formatted[1];
 	uint32_t samples = GPMF_SAMPLES(typesize);
@@ -639,6 +910,11 @@ again:
 		
 		dm->last_nonsticky_fourcc = tag;
 		dm->last_nonsticky_typesize = typesize;
+
+#if BLOCK_COMPRESSION
+		if (dm->block_samples && dm->quantize && !(flags & (GPMF_FLAGS_GROUPED | GPMF_FLAGS_SORTED)))
+			storedblock = samples;
+#endif
 		
 		if (TimeStamp)
 		{
@@ -674,6 +950,7 @@ again:
 					}
 				} while (downsmp == 0);
 				dm->payloadTimeStampCount = downsmp;
+				TimeIndexUpdate(dm, 0);
 			}
 			if(dm->payloadTimeStampCount == 0)
 			{
@@ -728,6 +1005,7 @@ again:
 			}
 			dm->sampleCount[dm->payloadTimeStampCount] = (uint16_t)sample_count;
 			dm->payloadTimeStampCount++;
+			TimeIndexUpdate(dm, dm->payloadTimeStampCount >= 2 ? dm->payloadTimeStampCount - 2 : 0);
 
 		}
 	}
@@ -765,7 +1043,7 @@ tryagain:
 		{
 			uint32_t currtypesize = *(payload_ptr+1);
 			
-			if (GPMF_SAMPLE_TYPE(currtypesize) == GPMF_TYPE_NEST)
+			if (GPMF_SAMPLE_TYPE(currtypesize) == GPMF_TYPE_NEST || GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(currtypesize))) // samples are appended after any stored blocks
 			{
 				uint32_t tsize = *(payload_ptr + 1);
 				uint32_t offset = 2 + ((GPMF_DATA_SIZE(tsize)) >> 2);
@@ -965,6 +1243,11 @@ tryagain:
 
 		goto again;
 	}
+
+#if BLOCK_COMPRESSION
+	if (storedblock)
+		CompressStoredBlock(dm, storedblock);
+#endif
 	
 	if(!(flags & GPMF_FLAGS_LOCKED))
 		Unlock(&dm->device_lock);
@@ -1039,6 +1322,7 @@ void GPMFWriteStreamReset(size_t dm_handle)
 			dm->deltaTimeStamp[pos] = 0;
 			dm->sampleCount[pos] = 0;
 		}
+		TimeIndexUpdate(dm, 0);
 		dm->firstTimeStamp = 0;
 		dm->lastTimeStamp = 0;
 
@@ -1061,6 +1345,104 @@ void GPMFWriteStreamReset(size_t dm_handle)
 }
 
 
+uint32_t GPMFWriteStreamSetPriority(size_t dm_handle, uint32_t priority)
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+
+	Lock(&dm->device_lock);
+	dm->priority = priority;
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
+uint32_t GPMFWriteStreamSetAdaptiveCompression(size_t dm_handle, uint32_t enable)
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+
+	Lock(&dm->device_lock);
+	if (enable)
+		dm->coding |= STREAM_CODING_ADAPTIVE;
+	else
+		dm->coding &= ~STREAM_CODING_ADAPTIVE;
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
+uint32_t GPMFWriteStreamSetWideCompression(size_t dm_handle, uint32_t enable)
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+
+	Lock(&dm->device_lock);
+	if (enable)
+		dm->coding |= STREAM_CODING_WIDE_DELTA;
+	else
+		dm->coding &= ~STREAM_CODING_WIDE_DELTA;
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
+uint32_t GPMFWriteStreamSetFloatCompression(size_t dm_handle, uint32_t enable)
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+
+	Lock(&dm->device_lock);
+	if (enable)
+		dm->coding |= STREAM_CODING_FLOAT_XOR;
+	else
+		dm->coding &= ~STREAM_CODING_FLOAT_XOR;
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
+uint32_t GPMFWriteStreamSetBlockCompression(size_t dm_handle, uint32_t block_samples)
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+	if (block_samples > 0xffff) return GPMF_ERROR_STRUCTURE; // a KLV repeat is 16-bit
+
+	Lock(&dm->device_lock);
+	dm->block_samples = block_samples;
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
+uint32_t GPMFWriteGetStreamStats(size_t dm_handle, GPMFStreamStats *stats, uint32_t reset)
+
+{
+	device_metadata *dm = (device_metadata *)dm_handle;
+
+	if (dm == NULL) return GPMF_ERROR_MEMORY;
+
+	Lock(&dm->device_lock);
+	if (stats)
+		*stats = dm->stats;
+	if (reset)
+		memset(&dm->stats, 0, sizeof(dm->stats));
+	Unlock(&dm->device_lock);
+
+	return GPMF_ERROR_OK;
+}
+
+
 
 
 void AddSTRM(size_t hndl, uint32_t *payload, int32_t longs)
@@ -1714,6 +2096,8 @@ size_t GPMFWriteServiceInit()
 {
 	GPMFWriterWorkspace *ws = malloc(sizeof(GPMFWriterWorkspace));
 
+	GPMF_BuildFusedCodeTables(); // build the shared encoder tables before any stream can compress
+
 	if (ws)
 	{
 		int i;
@@ -1738,12 +2122,42 @@ void GPMFWriteServiceClose(size_t ws_handle)
 		for (i = 0; i < GPMF_CHANNEL_MAX; i++)
 			DeleteLock(&ws->metadata_device_list[i]);
 
+#if PARALLEL_COMPRESSION_THREADS
+		DestroyCompressPool(ws->pool);
+#endif
 		free(ws);
 	}
 }
 
 
 
+static uint32_t EstimateStreamDataSize(device_metadata *dm, uint64_t latestTimeStamp) // non-sticky bytes stored for the window, call with the device locked
+{
+#if SCAN_GPMF_FOR_STATE
+	uint32_t payload_curr_size = SeekEndGPMF(dm->payload_buffer, dm->payload_alloc_size);
+#else
+	uint32_t payload_curr_size = dm->payload_curr_size;
+#endif
+	uint32_t curr_size = ((payload_curr_size + 3)&~3);
+
+	if(LARGESTTIMESTAMP == latestTimeStamp || dm->payloadTimeStampCount == 0)
+		return curr_size;
+	else
+	{
+		// same split point as GPMFWriteGetPayloadAndSession() will use
+		uint32_t totalsamples = dm->indexSample[dm->payloadTimeStampCount];
+		uint32_t samples = TimeIndexSamplesBefore(dm, TimeIndexFirstTimeStamp(dm), latestTimeStamp);
+
+		if (samples >= totalsamples)
+			return curr_size;
+		else if (samples > 0 && curr_size > 8)
+			return 8 + (uint32_t)(((uint64_t)(curr_size - 8) * samples + totalsamples - 1) / totalsamples);
+	}
+
+	return 0;
+}
+
+
 uint32_t GPMFWriteEstimateBufferSize(size_t ws_handle, uint32_t channel, uint32_t payloadscale, uint64_t latestTimeStamp) // how much data is currently needing to be readout. 
 {
 	GPMFWriterWorkspace *ws = (GPMFWriterWorkspace *)ws_handle;
@@ -1812,25 +2226,7 @@ uint32_t GPMFWriteEstimateBufferSize(size_t ws_handle, uint32_t channel, uint32_
 				//copy the preformatted device metadata into the output buffer
 				if (session_scale == 0)
 				{
-#if SCAN_GPMF_FOR_STATE
-					uint32_t payload_curr_size = SeekEndGPMF(src_lptr, dm->payload_alloc_size);
-#else
-					uint32_t payload_curr_size = dm->payload_curr_size;
-#endif
-					uint32_t curr_size = ((payload_curr_size + 3)&~3);
-
-					if(LARGESTTIMESTAMP == latestTimeStamp)
-						devicesizebytes += curr_size;
-					else
-					{
-						if (latestTimeStamp >= dm->lastTimeStamp)
-							devicesizebytes += curr_size;
-						else if (latestTimeStamp > dm->firstTimeStamp)
-						{
-							float fraction = (float)(latestTimeStamp - dm->firstTimeStamp) / (float)(dm->lastTimeStamp - dm->firstTimeStamp);
-							devicesizebytes += (uint32_t)(fraction * (float)curr_size);
-						}
-					}
+					devicesizebytes += EstimateStreamDataSize(dm, latestTimeStamp);
 				}
 				else
 				{
@@ -1839,6 +2235,15 @@ uint32_t GPMFWriteEstimateBufferSize(size_t ws_handle, uint32_t channel, uint32_
 					do
 					{
 						uint32_t samples = GPMF_SAMPLES(src_lptr[1]);
+#if BLOCK_COMPRESSION
+						if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1]))) // stored blocks go in session payloads unscaled, see CopyStoredBlocks()
+						{
+							devicesizebytes += CopyStoredBlocks(NULL, &src_lptr, &samples);
+							last_tag = tag;
+							tag = src_lptr[0];
+							continue;
+						}
+#endif
 						if ((samples >= (session_scale * 2) && session_scale) || GPMF_SAMPLE_TYPE(src_lptr[1]) == GPMF_TYPE_NEST || last_tag == tag) //DAN20160609 Scale data that is twice or more the the target sample rate.
 						{
 							if (GPMF_SAMPLE_TYPE(src_lptr[1]) != GPMF_TYPE_NEST && last_tag != tag)
@@ -1899,42 +2304,13 @@ uint32_t GPMFWriteEstimateBufferSize(size_t ws_handle, uint32_t channel, uint32_
 
 
 
-static uint32_t IsValidGPMF(uint32_t *buffer, uint32_t size, uint32_t recurse, uint32_t level) // test if the data is a completed GPMF structure starting with DEVC
-{
-	uint32_t pos = 0;
-	size >>= 2; // long size
-	while (pos + 1 < size)
-	{
-		uint32_t tag = buffer[pos];
-		uint32_t tsize = buffer[pos + 1];
-		uint32_t datasize = GPMF_DATA_SIZE(tsize);
-		if (level == 0 && tag != GPMF_KEY_DEVICE)
-			return 0;
-		else
-		{
-			if (0 == GPMF_VALID_FOURCC(tag))
-				return 0;
-
-			pos += 2;
-			if (recurse && GPMF_SAMPLE_TYPE(tsize) == GPMF_TYPE_NEST)
-			{
-				int ret = IsValidGPMF(&buffer[pos], datasize, recurse, level + 1);
-				if (ret == 0)
-					return 0;
-			}
-			pos += (datasize >> 2);
-		}
-	}
-
-	if (pos == size)
-		return 1;
-	else
-		return 0;
-}
-
 uint32_t GPMFWriteIsValidGPMF(uint32_t *buffer, uint32_t size, uint32_t recurse) // test if the data is a completed GPMF structure starting with DEVC
 {
-	return IsValidGPMF(buffer, size, recurse, 0);
+	uint32_t flags = GPMF_VALIDATE_DEVC | GPMF_VALIDATE_EXACT;
+	if (recurse)
+		flags |= GPMF_VALIDATE_RECURSE;
+
+	return GPMF_OK == GPMF_ValidateBuffer(buffer, size >> 2, flags, NULL) ? 1 : 0;
 }
 
 
@@ -1960,73 +2336,154 @@ void GPMF_CompressedPutWord(BITSTREAM *stream, BITSTREAM_WORD_TYPE word)
 	}
 }
 
-// Write bits to a compressed bitstream
-void GPMF_CompressedPutBits(BITSTREAM *stream, BITSTREAM_WORD_TYPE wBits, int nBits)
+// Write up to 32 bits to a compressed bitstream
+static void GPMF_CompressedPutLongBits(BITSTREAM *stream, uint32_t wBits, int nBits)
 {
-	BITSTREAM_WORD_TYPE  wBuffer;
-	BITSTREAM_WORD_TYPE bitsFree;
+	uint64_t wAccumulator = (stream->wAccumulator << nBits) | (wBits & (uint32_t)(((uint64_t)1 << nBits) - 1));
+	int32_t accumulatorBits = stream->accumulatorBits + nBits;
 
-	// Move the current word into a int32_t buffer
-	wBuffer = stream->wBuffer;
+	// Fewer than 32 bits are held between calls, so the accumulator never exceeds 64 bits
+	if (accumulatorBits >= 2 * BITSTREAM_WORD_SIZE)
+	{
+		BITSTREAM_WORD_TYPE *lpCurrentWord = (BITSTREAM_WORD_TYPE *)(stream->lpCurrentWord);
+		int wordsUsed = stream->wordsUsed + 2 * sizeof(BITSTREAM_WORD_TYPE);
 
-	// Number of bits remaining in the current word
-	bitsFree = stream->bitsFree;
+		accumulatorBits -= 2 * BITSTREAM_WORD_SIZE;
 
-	// Will the bits fit in the int32_t buffer?
-	if (bitsFree == BITSTREAM_WORD_SIZE) {
-		wBuffer = wBits & BITMASK(nBits);
-		bitsFree -= (BITSTREAM_WORD_TYPE)nBits;
-	}
-	else if (nBits <= bitsFree) {
-		wBuffer <<= nBits;
-		wBuffer |= (wBits & BITMASK(nBits));
-		bitsFree -= (BITSTREAM_WORD_TYPE)nBits;
+		// One bounds check for the two words
+		assert(wordsUsed <= stream->dwBlockLength);
+		if (wordsUsed <= stream->dwBlockLength)
+		{
+			lpCurrentWord[0] = BYTESWAP16((BITSTREAM_WORD_TYPE)(wAccumulator >> (accumulatorBits + BITSTREAM_WORD_SIZE)));
+			lpCurrentWord[1] = BYTESWAP16((BITSTREAM_WORD_TYPE)(wAccumulator >> accumulatorBits));
+
+			stream->lpCurrentWord = (uint8_t *)(lpCurrentWord + 2);
+			stream->wordsUsed = wordsUsed;
+		}
+		else
+		{
+			stream->error = BITSTREAM_ERROR_OVERFLOW;
+		}
 	}
-	else {
-		// Fill the buffer with as many bits as will fit
-		wBuffer <<= bitsFree;
-		nBits -= bitsFree;
 
-		// Should have some bits remaining
-		assert(nBits > 0);
+	stream->wAccumulator = wAccumulator;
+	stream->accumulatorBits = accumulatorBits;
+}
+
+// Write bits to a compressed bitstream
+void GPMF_CompressedPutBits(BITSTREAM *stream, BITSTREAM_WORD_TYPE wBits, int nBits)
+{
+	GPMF_CompressedPutLongBits(stream, wBits, nBits);
+}
 
-		// Insert as many bits as will fit into the buffer
-		wBuffer |= (wBits >> nBits) & BITMASK(bitsFree);
 
-		// Insert all of the bytes in the buffer into the bitstream
-		GPMF_CompressedPutWord(stream, wBuffer);
+static void GPMF_CompressedFlushStream(BITSTREAM *stream)
+{
+	uint64_t wAccumulator = stream->wAccumulator;
+	int32_t accumulatorBits = stream->accumulatorBits;
 
-		wBuffer = wBits & BITMASK(nBits);
-		bitsFree = BITSTREAM_WORD_SIZE - (BITSTREAM_WORD_TYPE)nBits;
+	// Write the remaining whole words
+	while (accumulatorBits >= BITSTREAM_WORD_SIZE)
+	{
+		accumulatorBits -= BITSTREAM_WORD_SIZE;
+		GPMF_CompressedPutWord(stream, (BITSTREAM_WORD_TYPE)(wAccumulator >> accumulatorBits));
 	}
 
-	// Save the new current word and bit count in the stream
-	stream->wBuffer = wBuffer;
-	stream->bitsFree = bitsFree;
+	// Fill the rest of the last word with zeros
+	if (accumulatorBits > 0)
+		GPMF_CompressedPutWord(stream, (BITSTREAM_WORD_TYPE)(wAccumulator << (BITSTREAM_WORD_SIZE - accumulatorBits)));
+
+	// Indicate that the bitstream buffer is empty
+	stream->wAccumulator = 0;
+	stream->accumulatorBits = 0;
 }
 
 
+#define ENC_VALUE_RANGE		38	// enchuftable.length - 1
+#define ENC_ZERORUN_FUSED	256
 
+typedef struct fusedcode {
+	uint64_t bits;		// Code word bits right justified, including the sign bit for values
+	uint32_t size;		// Size of code word in bits
+} FUSEDCODE;
 
-static void GPMF_CompressedFlushStream(BITSTREAM *stream)
+static FUSEDCODE encvaluetable[2 * ENC_VALUE_RANGE + 1];	// Huffman code with sign for delta -38 to 38, indexed by delta + 38
+static FUSEDCODE enczerorunfusedtable[ENC_ZERORUN_FUSED];	// complete code sequence for zero runs of 0 to 255
+
+#define ENC_TABLES_NONE		0
+#define ENC_TABLES_BUILDING	1
+#define ENC_TABLES_BUILT	2
+static long encfusedtables_state = ENC_TABLES_NONE;
+
+#if _WINDOWS
+#define GPMF_LOAD_TABLES_STATE(p)		InterlockedCompareExchange((LONG volatile *)(p), 0, 0)
+#define GPMF_CLAIM_TABLES(p)			(InterlockedCompareExchange((LONG volatile *)(p), ENC_TABLES_BUILDING, ENC_TABLES_NONE) == ENC_TABLES_NONE)
+#define GPMF_PUBLISH_TABLES(p)			InterlockedExchange((LONG volatile *)(p), ENC_TABLES_BUILT)
+#else
+#define GPMF_LOAD_TABLES_STATE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define GPMF_CLAIM_TABLES(p)			__sync_bool_compare_and_swap((p), ENC_TABLES_NONE, ENC_TABLES_BUILDING)
+#define GPMF_PUBLISH_TABLES(p)			__atomic_store_n((p), ENC_TABLES_BUILT, __ATOMIC_RELEASE)
+#endif
+
+// Precompute the fused value+sign codes and zero run sequences from the codebooks in GPMF_bitstream.h, once.  The 
+// first caller builds them, any other caller waits until they are published.
+static void GPMF_BuildFusedCodeTables(void)
 {
-	int bitsFree = stream->bitsFree;
+	int i, j;
+
+	if (GPMF_LOAD_TABLES_STATE(&encfusedtables_state) == ENC_TABLES_BUILT)
+		return;
+
+	if (!GPMF_CLAIM_TABLES(&encfusedtables_state))
+	{
+		while (GPMF_LOAD_TABLES_STATE(&encfusedtables_state) != ENC_TABLES_BUILT)
+			; // another thread is building them, it only takes a few microseconds
+		return;
+	}
+
+	for (i = -ENC_VALUE_RANGE; i <= ENC_VALUE_RANGE; i++)
+	{
+		int mag = abs(i);
+		uint64_t bits = enchuftable.entries[mag].bits;
+		uint32_t size = enchuftable.entries[mag].size;
+
+		if (mag) {
+			bits <<= 1;
+			if (i < 0) bits |= 1; //add sign bit
+			size++; //sign bit.
+		}
+		encvaluetable[i + ENC_VALUE_RANGE].bits = bits;
+		encvaluetable[i + ENC_VALUE_RANGE].size = size;
+	}
 
-	// Does the buffer contain any data?
-	if (bitsFree < BITSTREAM_WORD_SIZE)
+	for (i = 0; i < ENC_ZERORUN_FUSED; i++)
 	{
-		BITSTREAM_WORD_TYPE wBuffer = stream->wBuffer;
+		uint64_t bits = 0;
+		uint32_t size = 0;
+		int zeros = i;
 
-		// Fill the rest of the buffer with zeros
-		wBuffer <<= bitsFree;
+		// same longest first selection as GPMF_CompressedZeroRun() used per run
+		for (j = enczerorunstable.length - 1; j >= 0 && zeros > 0; )
+		{
+			if (enczerorunstable.entries[j].count > zeros)
+				j--;
+			else
+			{
+				bits = (bits << enczerorunstable.entries[j].size) | enczerorunstable.entries[j].bits;
+				size += enczerorunstable.entries[j].size;
+				zeros -= enczerorunstable.entries[j].count;
+			}
+		}
 
-		// Write the buffer to the output
-		GPMF_CompressedPutWord(stream, wBuffer);
+		// zeros have code '0'
+		bits <<= zeros;
+		size += zeros;
 
-		// Indicate that the bitstream buffer is empty
-		stream->bitsFree = BITSTREAM_WORD_SIZE;
-		stream->wBuffer = 0;
+		enczerorunfusedtable[i].bits = bits;
+		enczerorunfusedtable[i].size = size;
 	}
+
+	GPMF_PUBLISH_TABLES(&encfusedtables_state);
 }
 
 
@@ -2045,57 +2502,53 @@ BITSTREAM_WORD_TYPE GPMF_CompressedPutCode(BITSTREAM *stream, int code)
 int GPMF_CompressedZeroRun(BITSTREAM *stream, int zeros)
 {
 	uint32_t totalBits = 0;
-	BITSTREAM_WORD_TYPE numBits = 0, bits;
-	int i = enczerorunstable.length - 1;
+	FUSEDCODE *run;
 
-	while (i >= 0 && zeros > 0)
+	// the longest zero run code for anything beyond the precomputed sequences
+	while (zeros >= ENC_ZERORUN_FUSED)
 	{
-		if (enczerorunstable.entries[i].count > zeros)
-		{
-			i--;
-		}
-		else
-		{
-			numBits = enczerorunstable.entries[i].size;
-			bits = enczerorunstable.entries[i].bits;
-			zeros -= enczerorunstable.entries[i].count;
+		const RLV *z = &enczerorunstable.entries[enczerorunstable.length - 1];
+		GPMF_CompressedPutBits(stream, z->bits, z->size);
+		totalBits += z->size;
+		zeros -= z->count;
+	}
 
-			GPMF_CompressedPutBits(stream, bits, numBits);
-			totalBits += numBits;
-		}
+	run = &enczerorunfusedtable[zeros];
+	if (run->size > 32)
+	{
+		GPMF_CompressedPutLongBits(stream, (uint32_t)(run->bits >> 32), run->size - 32);
+		GPMF_CompressedPutLongBits(stream, (uint32_t)run->bits, 32);
+	}
+	else
+	{
+		GPMF_CompressedPutLongBits(stream, (uint32_t)run->bits, run->size);
 	}
-
-	// zeros have code '0'
-	GPMF_CompressedPutBits(stream, 0, zeros);
-	totalBits += zeros;
+	totalBits += run->size;
 
 	return totalBits;
 }
 
 int GPMF_CompressedPutValue(BITSTREAM *stream, int delta)
 {
-	BITSTREAM_WORD_TYPE numBits = 0, bits;
-	int mag = abs(delta);
-
-	if (mag < enchuftable.length)
+	if (delta >= -ENC_VALUE_RANGE && delta <= ENC_VALUE_RANGE)
 	{
-		numBits = enchuftable.entries[mag].size;
-		bits = enchuftable.entries[mag].bits;
-		if (mag) {
-			bits <<= 1;
-			if (delta < 0) bits |= 1; //add sign bit
-			numBits++; //sign bit.
-		}
+		FUSEDCODE *code = &encvaluetable[delta + ENC_VALUE_RANGE];
+
+		GPMF_CompressedPutLongBits(stream, (uint32_t)code->bits, code->size);
 
-		GPMF_CompressedPutBits(stream, bits, numBits);
+		return code->size;
 	}
 	else
 	{
-		numBits += GPMF_CompressedPutCode(stream, HUFF_ESC_CODE_ENTRY);
-		GPMF_CompressedPutBits(stream, (BITSTREAM_WORD_TYPE)delta, stream->bits_per_src_word); numBits += stream->bits_per_src_word;
-	}
+		// <ESC><data> as one code
+		uint32_t escBits = enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits;
+		uint32_t escSize = enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].size;
+		uint32_t bits_per_src_word = stream->bits_per_src_word;
 
-	return numBits;
+		GPMF_CompressedPutLongBits(stream, (escBits << bits_per_src_word) | ((uint32_t)delta & BITMASK(bits_per_src_word)), escSize + bits_per_src_word);
+
+		return escSize + bits_per_src_word;
+	}
 }
 
 
@@ -2108,19 +2561,476 @@ void GPMF_InitCompressedBitstream(BITSTREAM *stream, uint8_t *buffer, uint32_t b
 	stream->wordsUsed = 0;
 
 	// Initialize the current bit buffer
-	stream->bitsFree = BITSTREAM_WORD_SIZE;
-	stream->wBuffer = 0;
+	stream->wAccumulator = 0;
+	stream->accumulatorBits = 0;
 	stream->error = 0;
 	stream->bits_per_src_word = (uint16_t)bits_per_src_word;
+
+	GPMF_BuildFusedCodeTables();
 }
 
 
-#if HUFF_STATS
-uint32_t sourcesize = 0;
-uint32_t storedsize = 0;
+#define COMPRESS_DELTA_BLOCK	256		// samples per channel quantized and delta'd ahead of the entropy coder
+
+// De-interleave one channel, byte-swap, quantize and delta code count samples from start.
+// Integer division is replaced with an exact reciprocal multiply. *last is the quantized sample before start.
+static void GPMF_QuantizedDeltas(int32_t *deltas, int8_t *src, int typesign, uint32_t start, uint32_t count,
+									int channels, int chn, uint32_t quant, int32_t *last)
+{
+	uint32_t i;
+	uint32_t pos = start*channels + chn;
+
+	switch (typesign)
+	{
+	default:
+	case -2: { int16_t *sshort = (int16_t *)src;  for (i = 0; i < count; i++, pos += channels) deltas[i] = (int16_t)BYTESWAP16(sshort[pos]); } break;
+	case -1: { int8_t *sbyte = src;               for (i = 0; i < count; i++, pos += channels) deltas[i] = sbyte[pos]; } break;
+	case 1:  { uint8_t *sByte = (uint8_t *)src;   for (i = 0; i < count; i++, pos += channels) deltas[i] = sByte[pos]; } break;
+	case 2:  { uint16_t *sShort = (uint16_t *)src; for (i = 0; i < count; i++, pos += channels) deltas[i] = BYTESWAP16(sShort[pos]); } break;
+	}
+
+	if (quant > 1 && quant < 32768)
+	{
+		// floor(2^32/quant)+1 gives the exact quotient for all 16-bit magnitudes, truncated towards zero like '/'
+		uint64_t recip = (((uint64_t)1 << 32) / quant) + 1;
+		for (i = 0; i < count; i++)
+		{
+			int32_t sign = deltas[i] >> 31;
+			uint32_t mag = (uint32_t)((deltas[i] ^ sign) - sign);
+			int32_t q = (int32_t)(((uint64_t)mag * recip) >> 32);
+			deltas[i] = (q ^ sign) - sign;
+		}
+	}
+	else if (quant != 1)
+	{
+		int32_t divisor = (typesign == -2) ? (int16_t)quant : (int32_t)quant;
+		for (i = 0; i < count; i++)
+			deltas[i] /= divisor;
+	}
+
+	if (count)
+	{
+		int32_t prev = *last;
+		*last = deltas[count - 1];
+		for (i = count - 1; i > 0; i--)
+			deltas[i] -= deltas[i - 1];
+		deltas[0] -= prev;
+	}
+}
+
+static int LeadingZeros32(uint32_t x) // x != 0
+{
+#if defined(__GNUC__)
+	return __builtin_clz(x);
+#else
+	int n = 0;
+	while (!(x & 0x80000000)) x <<= 1, n++;
+	return n;
 #endif
+}
+
+static int TrailingZeros32(uint32_t x) // x != 0
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(x);
+#else
+	int n = 0;
+	while (!(x & 1)) x >>= 1, n++;
+	return n;
+#endif
+}
 
-uint32_t GPMFCompress(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition, uint32_t quantize)
+// Lossless compression of 'f' samples, each channel XORs the current and previous IEEE-754 value:
+// '0' same value, '10'<bits> XOR fits within the previous leading/trailing zero window, 
+// '11'<5-bit leading zeros><5-bit length-1><bits> new window.
+//[FOURCC]['%'4 repeat][uncompressed typeSizeRepeat][first sample]{channel 0 stream}{channel 1 stream}... 16-bit aligned streams
+static uint32_t GPMFCompressFloat(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition)
+{
+	BITSTREAM bstream;
+	uint32_t typesizerepeat = src_gpmf[1];
+	uint32_t repeat = GPMF_SAMPLES(typesizerepeat);
+	uint32_t channels = GPMF_SAMPLE_SIZE(typesizerepeat) / 4;
+	uint32_t *src = &src_gpmf[2];
+	uint32_t returnpayloadsize = 0;
+	uint32_t chn, i;
+
+	dst_gpmf[0] = src_gpmf[0];         returnpayloadsize += 4;
+	dst_gpmf[1] = 0;/*fill at end*/    returnpayloadsize += 4;
+	dst_gpmf[2] = typesizerepeat;      returnpayloadsize += 4;
+
+	memcpy(&dst_gpmf[3], src, channels * 4);  // store the first full sample as is.
+	returnpayloadsize += channels * 4;
+
+	for (chn = 0; chn < channels && returnpayloadsize + 256/8 < payloadAddition; chn++)
+	{
+		uint32_t bufsize = payloadAddition - returnpayloadsize;
+		uint32_t totalbits = 0;
+		uint32_t last = BYTESWAP32(src[chn]);
+		int lastLead = -1, lastTrail = 0;
+
+		GPMF_InitCompressedBitstream(&bstream, (uint8_t *)dst_gpmf + returnpayloadsize, bufsize, 32);
+
+		for (i = 1; i < repeat; i++)
+		{
+			uint32_t curr = BYTESWAP32(src[i*channels + chn]);
+			uint32_t xor = curr ^ last;
+			last = curr;
+
+			if (xor == 0)
+			{
+				GPMF_CompressedPutLongBits(&bstream, 0, 1);
+				totalbits += 1;
+			}
+			else
+			{
+				int lead = LeadingZeros32(xor);
+				int trail = TrailingZeros32(xor);
+				int len;
+
+				if (lastLead >= 0 && lead >= lastLead && trail >= lastTrail)
+				{
+					len = 32 - lastLead - lastTrail;
+					GPMF_CompressedPutLongBits(&bstream, 2, 2);
+					GPMF_CompressedPutLongBits(&bstream, xor >> lastTrail, len);
+					totalbits += 2 + len;
+				}
+				else
+				{
+					len = 32 - lead - trail;
+					GPMF_CompressedPutLongBits(&bstream, (3 << 10) | (lead << 5) | (len - 1), 12);
+					GPMF_CompressedPutLongBits(&bstream, xor >> trail, len);
+					totalbits += 12 + len;
+					lastLead = lead;
+					lastTrail = trail;
+				}
+			}
+
+			//make sure compressed is not larger than uncompressed.
+			if (totalbits + 256 > bufsize * 8) // in bits
+				break;
+		}
+
+		if (i < repeat)
+			break;
+
+		GPMF_CompressedFlushStream(&bstream);
+
+		returnpayloadsize += ((totalbits + 15) / 16) * 2; //16-bit aligned with a compressed channel
+	}
+
+	if (chn < channels || ((returnpayloadsize + 3) & ~3) >= payloadAddition)
+	{
+		//too big, just store uncompresssed.
+		memcpy(dst_gpmf, src_gpmf, payloadAddition);
+		returnpayloadsize = payloadAddition;
+	}
+	else
+	{
+		while (returnpayloadsize & 3)
+			((uint8_t *)dst_gpmf)[returnpayloadsize++] = 0; //32-bit aligned 
+
+		dst_gpmf[1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED_FLOAT, 4, (returnpayloadsize - 8) / 4);
+	}
+
+
+	return returnpayloadsize;
+}
+
+
+static uint32_t PutRice(BITSTREAM *bstream, uint32_t zigzag, uint32_t k, uint32_t bits_per_src_word)
+{
+	uint32_t q = zigzag >> k;
+	if (q < RICE_ESCAPE_ONES)
+	{
+		GPMF_CompressedPutLongBits(bstream, (((1 << q) - 1) << (k + 1)) | (zigzag & ((1 << k) - 1)), q + 1 + k);
+		return q + 1 + k;
+	}
+
+	GPMF_CompressedPutLongBits(bstream, (1 << RICE_ESCAPE_ONES) - 1, RICE_ESCAPE_ONES);
+	GPMF_CompressedPutLongBits(bstream, zigzag, bits_per_src_word + 2);
+	return RICE_ESCAPE_ONES + bits_per_src_word + 2;
+}
+
+
+#define WIDE_LENGTH_BITS		6		// an escaped value stores its bit length - 1
+
+static uint32_t BitLength64(uint64_t x)
+{
+	uint32_t hi = (uint32_t)(x >> 32);
+	if (hi)
+		return 64 - LeadingZeros32(hi);
+	if ((uint32_t)x)
+		return 32 - LeadingZeros32((uint32_t)x);
+	return 0;
+}
+
+static void PutWideBits(BITSTREAM *bstream, uint64_t value, uint32_t n) // n <= 64
+{
+	if (n > 32)
+	{
+		GPMF_CompressedPutLongBits(bstream, (uint32_t)(value >> 32), n - 32);
+		n = 32;
+	}
+	if (n)
+		GPMF_CompressedPutLongBits(bstream, (uint32_t)value, n);
+}
+
+static uint32_t PutWideRice(BITSTREAM *bstream, uint64_t zigzag, uint32_t k)
+{
+	uint64_t q = zigzag >> k;
+	uint32_t len;
+
+	if (q < RICE_ESCAPE_ONES)
+	{
+		GPMF_CompressedPutLongBits(bstream, ((1 << q) - 1) << 1, (uint32_t)q + 1);
+		PutWideBits(bstream, zigzag, k);
+		return (uint32_t)q + 1 + k;
+	}
+
+	len = BitLength64(zigzag);
+	GPMF_CompressedPutLongBits(bstream, (((1 << RICE_ESCAPE_ONES) - 1) << WIDE_LENGTH_BITS) | (len - 1), RICE_ESCAPE_ONES + WIDE_LENGTH_BITS);
+	PutWideBits(bstream, zigzag, len);
+	return RICE_ESCAPE_ONES + WIDE_LENGTH_BITS + len;
+}
+
+static int64_t WideQuantizedSample(uint8_t *src, uint32_t bytesize, int signed_type, uint32_t quant)
+{
+	if (bytesize == 4)
+	{
+		uint32_t v;
+		memcpy(&v, src, 4);
+		v = BYTESWAP32(v);
+		if (signed_type)
+			return quant > 1 ? (int64_t)(int32_t)v / quant : (int64_t)(int32_t)v;
+		return quant > 1 ? (int64_t)(v / quant) : (int64_t)v;
+	}
+	else
+	{
+		uint64_t v;
+		memcpy(&v, src, 8);
+		v = BYTESWAP64(v);
+		if (signed_type)
+			return quant > 1 ? (int64_t)v / quant : (int64_t)v;
+		return quant > 1 ? (int64_t)(v / quant) : (int64_t)v;
+	}
+}
+
+// Differences wrap modulo 2^64, so every 64-bit input is lossless at QUAN 1.
+#define WIDE_ZIGZAG(d)		(((uint64_t)(d) << 1) ^ (uint64_t)((int64_t)(d) >> 63))
+
+// Delta coding of 'l', 'L', 'j' and 'J' samples at their full width, each channel is Rice coded with a delta or 
+// delta-of-delta predictor and the k that is smallest for this payload: zigzag values <q ones>'0'<k bits> for 
+// q < RICE_ESCAPE_ONES, else <RICE_ESCAPE_ONES ones><6-bit length-1><length bits>.  QUAN divides values as for shorts.
+//[FOURCC]['&'4 repeat][uncompressed typeSizeRepeat][first sample][quant 32-bit][predictor 8-bit][k 8-bit]{channel 0 stream}... 16-bit aligned streams
+static uint32_t GPMFCompressWide(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition, uint32_t quantize, uint32_t *escapes)
+{
+	BITSTREAM bstream;
+	uint32_t typesizerepeat = src_gpmf[1];
+	uint8_t type = GPMF_SAMPLE_TYPE(typesizerepeat);
+	uint32_t bytesize = (type == GPMF_TYPE_SIGNED_LONG || type == GPMF_TYPE_UNSIGNED_LONG) ? 4 : 8;
+	int signed_type = (type == GPMF_TYPE_SIGNED_LONG || type == GPMF_TYPE_SIGNED_64BIT_INT);
+	uint32_t repeat = GPMF_SAMPLES(typesizerepeat);
+	uint32_t channels = GPMF_SAMPLE_SIZE(typesizerepeat) / bytesize;
+	uint32_t quant = quantize ? quantize : 1;
+	uint8_t *src = (uint8_t *)&src_gpmf[2];
+	uint8_t *dst = (uint8_t *)dst_gpmf;
+	uint32_t returnpayloadsize = 0, escaped = 0;
+	uint32_t chn, i;
+
+	dst_gpmf[0] = src_gpmf[0];         returnpayloadsize += 4;
+	dst_gpmf[1] = 0;/*fill at end*/    returnpayloadsize += 4;
+	dst_gpmf[2] = typesizerepeat;      returnpayloadsize += 4;
+
+	memcpy(&dst[returnpayloadsize], src, channels * bytesize);  // store the first full sample as is.
+	returnpayloadsize += channels * bytesize;
+
+	for (chn = 0; chn < channels && returnpayloadsize + 6 + 256/8 < payloadAddition; chn++)
+	{
+		uint32_t count[2][65] = { { 0 } };
+		uint32_t bufsize, totalbits = 0, predictor = 0, k = 0, p, j, len;
+		uint64_t best = (uint64_t)-1;
+		int64_t first = WideQuantizedSample(&src[chn * bytesize], bytesize, signed_type, quant);
+		uint64_t prev = (uint64_t)first, prevdelta = 0;
+
+		// measure both predictors, bucketing the zigzag values by bit length
+		for (i = 1; i < repeat; i++)
+		{
+			uint64_t curr = (uint64_t)WideQuantizedSample(&src[(i*channels + chn) * bytesize], bytesize, signed_type, quant);
+			uint64_t delta = curr - prev;
+			count[0][BitLength64(WIDE_ZIGZAG(delta))]++;
+			count[1][BitLength64(WIDE_ZIGZAG(delta - prevdelta))]++;
+			prev = curr;
+			prevdelta = delta;
+		}
+
+		for (p = 0; p < 2; p++)
+		{
+			for (j = 0; j < bytesize * 8; j++)
+			{
+				uint64_t bits = 0;
+				for (len = 0; len <= 64; len++)
+				{
+					if (count[p][len] == 0)
+						continue;
+					if (len <= j)
+						bits += (uint64_t)count[p][len] * (1 + j);
+					else if (len < j + 5)
+						bits += (uint64_t)count[p][len] * (1 + j + ((3u << (len - j)) >> 2)); // mid-range unary length
+					else
+						bits += (uint64_t)count[p][len] * (RICE_ESCAPE_ONES + WIDE_LENGTH_BITS + len);
+				}
+				if (bits < best)
+				{
+					best = bits;
+					predictor = p;
+					k = j;
+				}
+			}
+		}
+
+		dst[returnpayloadsize + 0] = (uint8_t)(quant >> 24);
+		dst[returnpayloadsize + 1] = (uint8_t)(quant >> 16);
+		dst[returnpayloadsize + 2] = (uint8_t)(quant >> 8);
+		dst[returnpayloadsize + 3] = (uint8_t)quant;
+		dst[returnpayloadsize + 4] = (uint8_t)predictor;
+		dst[returnpayloadsize + 5] = (uint8_t)k;
+		returnpayloadsize += 6;
+
+		bufsize = payloadAddition - returnpayloadsize;
+		GPMF_InitCompressedBitstream(&bstream, &dst[returnpayloadsize], bufsize, 32);
+
+		prev = (uint64_t)first;
+		prevdelta = 0;
+		for (i = 1; i < repeat; i++)
+		{
+			uint64_t curr = (uint64_t)WideQuantizedSample(&src[(i*channels + chn) * bytesize], bytesize, signed_type, quant);
+			uint64_t delta = curr - prev;
+			uint64_t zigzag = WIDE_ZIGZAG(predictor == COMPRESS_PREDICT_DELTA_DELTA ? delta - prevdelta : delta);
+
+			prev = curr;
+			prevdelta = delta;
+			if ((zigzag >> k) >= RICE_ESCAPE_ONES)
+				escaped++;
+			totalbits += PutWideRice(&bstream, zigzag, k);
+
+			//make sure compressed is not larger than uncompressed.
+			if (totalbits + 256 > bufsize * 8) // in bits
+				break;
+		}
+
+		if (i < repeat)
+			break;
+
+		GPMF_CompressedFlushStream(&bstream);
+
+		returnpayloadsize += ((totalbits + 15) / 16) * 2; //16-bit aligned with a compressed channel
+	}
+
+	if (chn < channels || ((returnpayloadsize + 3) & ~3) >= payloadAddition)
+	{
+		//too big, just store uncompresssed.
+		memcpy(dst_gpmf, src_gpmf, payloadAddition);
+		returnpayloadsize = payloadAddition;
+	}
+	else
+	{
+		while (returnpayloadsize & 3)
+			dst[returnpayloadsize++] = 0; //32-bit aligned 
+
+		dst_gpmf[1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED_WIDE, 4, (returnpayloadsize - 8) / 4);
+		*escapes += escaped;
+	}
+
+	return returnpayloadsize;
+}
+
+// Measure one channel's deltas with the Huffman tables and estimate each Rice codebook, returns 1 if a Rice coding is smaller.
+// Rice costs come from zigzag values bucketed by bit length; a value of length L escapes under k exactly when L >= k + 5,
+// otherwise its unary part is approximated by the bucket sum >> k.
+static uint32_t ChooseAdaptiveCoding(int8_t *sbyte, int typesign, uint32_t repeat, int channels, int chn, uint32_t quant,
+									uint32_t bits_per_src_word, uint32_t *predictor, uint32_t *k)
+{
+	int32_t deltas[COMPRESS_DELTA_BLOCK];
+	uint32_t count[2][33] = { { 0 } };
+	uint64_t sum[2][33] = { { 0 } };
+	uint32_t huffbits = enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].size;
+	uint32_t zerorun = 0, i, j, p, best;
+	int32_t last = 0, prevdelta = 0;
+
+	GPMF_QuantizedDeltas(deltas, sbyte, typesign, 0, 1, channels, chn, quant, &last);
+
+	for (i = 1; i < repeat; i++)
+	{
+		int32_t delta, dd;
+		uint32_t zz[2];
+
+		if (((i - 1) % COMPRESS_DELTA_BLOCK) == 0)
+			GPMF_QuantizedDeltas(deltas, sbyte, typesign, i, (repeat - i) < COMPRESS_DELTA_BLOCK ? (repeat - i) : COMPRESS_DELTA_BLOCK, channels, chn, quant, &last);
+
+		delta = deltas[(i - 1) % COMPRESS_DELTA_BLOCK];
+		dd = delta - prevdelta;
+		prevdelta = delta;
+
+		zz[COMPRESS_PREDICT_DELTA] = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+		zz[COMPRESS_PREDICT_DELTA_DELTA] = ((uint32_t)dd << 1) ^ (uint32_t)(dd >> 31);
+		for (p = 0; p < 2; p++)
+		{
+			uint32_t len = zz[p] ? 32 - LeadingZeros32(zz[p]) : 0;
+			count[p][len]++;
+			sum[p][len] += zz[p];
+		}
+
+		if (delta == 0)
+		{
+			zerorun++;
+			continue;
+		}
+		if (zerorun)
+		{
+			while (zerorun >= ENC_ZERORUN_FUSED)
+			{
+				huffbits += enczerorunstable.entries[enczerorunstable.length - 1].size;
+				zerorun -= enczerorunstable.entries[enczerorunstable.length - 1].count;
+			}
+			huffbits += enczerorunfusedtable[zerorun].size;
+			zerorun = 0;
+		}
+		if (delta >= -ENC_VALUE_RANGE && delta <= ENC_VALUE_RANGE)
+			huffbits += encvaluetable[delta + ENC_VALUE_RANGE].size;
+		else
+			huffbits += enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].size + bits_per_src_word;
+	}
+
+	best = huffbits;
+	for (p = 0; p < 2; p++)
+	{
+		for (j = 0; j <= bits_per_src_word; j++)
+		{
+			uint64_t bits = 0;
+			uint32_t len;
+
+			for (len = 0; len <= bits_per_src_word + 2; len++)
+			{
+				if (len >= j + 5)
+					bits += (uint64_t)count[p][len] * (RICE_ESCAPE_ONES + bits_per_src_word + 2);
+				else
+					bits += (uint64_t)count[p][len] * (1 + j) + (sum[p][len] >> j);
+			}
+			if (bits < best)
+			{
+				best = (uint32_t)bits;
+				*predictor = p;
+				*k = j;
+			}
+		}
+	}
+
+	return best < huffbits;
+}
+
+
+static uint32_t CompressKLV(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition, uint32_t quantize, uint32_t coding,
+							uint32_t *escapes, uint32_t *zeroruns)
 {
 	BITSTREAM bstream;
 	uint32_t returnpayloadsize = 0;
@@ -2131,9 +3041,18 @@ uint32_t GPMFCompress(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAd
 	uint16_t repeat = (bptr[6] << 8) | bptr[7];
 	uint32_t quantHi = quantize;
 	uint32_t quantLo = quantize;
+	uint32_t byteswritten = 0;
+	uint32_t ricechannels = 0;
 
 	//[] = 32-bit, {} - 16-bit, unisgned or unsigned depending on the uncompressed type.
 	//[FOURCC]['#'sizerepeat][uncompressed typeSizeRepeat]{quantization}{first value}... delta encoded huffman ...
+	//'$' rather than '#' when any channel is Rice coded
+
+	if ((coding & STREAM_CODING_FLOAT_XOR) && type == GPMF_TYPE_FLOAT)
+		return GPMFCompressFloat(dst_gpmf, src_gpmf, payloadAddition);
+	if ((coding & STREAM_CODING_WIDE_DELTA) &&
+		(type == GPMF_TYPE_SIGNED_LONG || type == GPMF_TYPE_UNSIGNED_LONG || type == GPMF_TYPE_SIGNED_64BIT_INT || type == GPMF_TYPE_UNSIGNED_64BIT_INT))
+		return GPMFCompressWide(dst_gpmf, src_gpmf, payloadAddition, quantize, escapes);
 
 	dst_gpmf[0] = src_gpmf[0];         returnpayloadsize += 4;
 	dst_gpmf[1] = 0;/*fill at end*/    returnpayloadsize += 4;
@@ -2161,196 +3080,828 @@ uint32_t GPMFCompress(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAd
 		//int16_t *dshort = (int16_t *)dbyte;
 		uint16_t *dShort = (uint16_t *)dbyte;
 		int8_t *sbyte = (int8_t *)&src_gpmf[2];
-		uint8_t *sByte = (uint8_t *)sbyte;
-		int16_t *sshort = (int16_t *)sbyte;
-		uint16_t *sShort = (uint16_t *)sbyte;
+		int32_t deltas[COMPRESS_DELTA_BLOCK];
+		int32_t last = 0;
 		int pos = 0;
 
 		channels = GPMF_SAMPLE_SIZE(typesizerepeat) / bytesize;
 
-		if (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_SIGNED_BYTE || type == GPMF_TYPE_SIGNED_LONG)
-			signed_type = -1; //signed
+		if (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_SIGNED_BYTE || type == GPMF_TYPE_SIGNED_LONG)
+			signed_type = -1; //signed
+
+		memcpy(dbyte, sbyte, bytesize*channels);  // store the first full sample as is.
+		pos += channels;
+		returnpayloadsize += bytesize*channels;
+
+		for (chn = 0; chn < channels; chn++)
+		{
+			uint32_t quant = quantHi, bufsize;
+			uint32_t totalbits = 0, zerorun = 0;
+			uint32_t rice = 0, predictor = COMPRESS_PREDICT_DELTA, k = 0;
+			int32_t prevdelta = 0;
+
+			if (returnpayloadsize + COMPRESS_CHANNEL_HEADER + 256/8 >= payloadAddition) // no room for this channel's header and a bitstream
+			{
+				memcpy(dst_gpmf, src_gpmf, payloadAddition);
+				return payloadAddition;
+			}
+			bufsize = payloadAddition - returnpayloadsize - COMPRESS_CHANNEL_HEADER; // the bitstream follows the header
+
+			if (chn & 1) quant = quantLo; // Hack for encoding quantized 32-bit data with 16-bits.
+
+			if ((coding & STREAM_CODING_ADAPTIVE) && quant < (bytesize == 2 ? COMPRESS_CODING_FLAG16 : COMPRESS_CODING_FLAG8))
+				rice = ChooseAdaptiveCoding(sbyte, bytesize*signed_type, repeat, channels, chn, quant, bytesize * 8, &predictor, &k);
+			ricechannels += rice;
+
+			if (bytesize == 2)
+			{
+				dShort[pos] = BYTESWAP16(rice ? (quant | COMPRESS_CODING_FLAG16) : quant); pos++;
+				if (rice) { dShort[pos] = BYTESWAP16((predictor << 8) | k); pos++; } // uses the slack in the 4 bytes counted below
+				GPMF_InitCompressedBitstream(&bstream, (uint8_t*)&dShort[pos], bufsize, bytesize * 8);
+			}
+			else
+			{
+				dByte[pos] = (uint8_t)(rice ? (quant | COMPRESS_CODING_FLAG8) : quant); pos++;
+				pos = ((pos + 1) & ~1); //16-bit aligned compressed data
+				if (rice) { dByte[pos] = (uint8_t)predictor; dByte[pos + 1] = (uint8_t)k; pos += 2; }
+				GPMF_InitCompressedBitstream(&bstream, &dByte[pos], bufsize, bytesize * 8);
+			}
+
+
+			returnpayloadsize += 4;
+
+			GPMF_QuantizedDeltas(deltas, sbyte, bytesize*signed_type, 0, 1, channels, chn, quant, &last); // seed with the first sample
+
+			for (i = 1; i < repeat; i++)
+			{
+				int delta;
+
+				if (((i - 1) % COMPRESS_DELTA_BLOCK) == 0)
+					GPMF_QuantizedDeltas(deltas, sbyte, bytesize*signed_type, i, (repeat - i) < COMPRESS_DELTA_BLOCK ? (repeat - i) : COMPRESS_DELTA_BLOCK, channels, chn, quant, &last);
+
+				delta = deltas[(i - 1) % COMPRESS_DELTA_BLOCK];
+
+				if (rice)
+				{
+					int32_t value = (predictor == COMPRESS_PREDICT_DELTA_DELTA) ? delta - prevdelta : delta;
+					uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+					prevdelta = delta;
+					if ((zigzag >> k) >= RICE_ESCAPE_ONES)
+						(*escapes)++;
+					totalbits += PutRice(&bstream, zigzag, k, bytesize * 8);
+				}
+				else
+				{
+					if (delta == 0) {
+						zerorun++;
+						continue;
+					}
+
+					if (zerorun)
+					{
+						totalbits += GPMF_CompressedZeroRun(&bstream, zerorun);
+						zerorun = 0;
+						(*zeroruns)++;
+					}
+
+					if (delta < -ENC_VALUE_RANGE || delta > ENC_VALUE_RANGE)
+						(*escapes)++;
+					totalbits += GPMF_CompressedPutValue(&bstream, delta);
+				}
+
+				//make sure compressed is not larger than uncompressed.
+				if (totalbits + 256 > bufsize * 8) // in bits
+				{
+					//too big, just store uncompresssed.
+					memcpy(dst_gpmf, src_gpmf, payloadAddition);
+					return payloadAddition;
+				}
+			}
+
+			if (!rice)
+				totalbits += GPMF_CompressedPutCode(&bstream, HUFF_END_CODE_ENTRY);
+
+			GPMF_CompressedFlushStream(&bstream);
+
+			int bytesadded = ((totalbits + 15) >> 4) << 1; // the bitstream is flushed in whole 16-bit words
+			returnpayloadsize += bytesadded;
+			pos += (bytesadded >> (bytesize - 1)); // the next channel's header follows the last word, for bytes too
+		}
+		byteswritten = 12 + pos * bytesize;
+		break;
+	}
+	default: // do not compress other types of data
+		memcpy(dst_gpmf, src_gpmf, payloadAddition);
+		return payloadAddition;
+	}
+
+
+	returnpayloadsize = ((returnpayloadsize + 3) >> 2) << 2; //32-bit aligned channel
+
+	if (returnpayloadsize > payloadAddition) // double check
+	{
+		memcpy(dst_gpmf, src_gpmf, payloadAddition);
+		returnpayloadsize = payloadAddition;
+	}
+	else
+	{
+		uint32_t typesizerepeat_compressed;
+
+		typesizerepeat_compressed = GPMF_MAKE_TYPE_SIZE_COUNT(ricechannels ? GPMF_TYPE_COMPRESSED_ADAPTIVE : GPMF_TYPE_COMPRESSED, bytesize, (returnpayloadsize - 8) / bytesize);
+		dst_gpmf[1] = typesizerepeat_compressed;
+
+		if (byteswritten < returnpayloadsize) // clear the counted but unused tail, so the output doesn't depend on the buffer's old contents
+			memset((uint8_t *)dst_gpmf + byteswritten, 0, returnpayloadsize - byteswritten);
+	}
+
+
+	return returnpayloadsize;
+}
+
+
+// Compress one KLV, accumulating its statistics into the stream's when stats is not NULL.
+uint32_t GPMFCompress(uint32_t* dst_gpmf, uint32_t *src_gpmf, uint32_t payloadAddition, uint32_t quantize, uint32_t coding, GPMFStreamStats *stats)
+{
+	uint32_t escapes = 0, zeroruns = 0;
+	uint32_t storedsize = CompressKLV(dst_gpmf, src_gpmf, payloadAddition, quantize, coding, &escapes, &zeroruns);
+
+	if (stats)
+	{
+		stats->raw_bytes += payloadAddition;
+		stats->stored_bytes += storedsize;
+		stats->blocks++;
+		if (dst_gpmf[1] == src_gpmf[1]) // stored as is, the compressed forms change the type
+			stats->fallbacks++;
+		else
+		{
+			stats->escape_codes += escapes;
+			stats->zero_runs += zeroruns;
+		}
+	}
+
+	return storedsize;
+}
+
+
+static uint32_t CountSamplesGrouped(uint32_t *srcPayload, uint32_t *currentTotalSampleBytes)
+{
+	uint32_t grouped = 0;
+	uint32_t currentTag = srcPayload[0];
+
+	if (currentTag)
+	{
+		uint32_t *src_lptr = srcPayload;
+		uint32_t sampleDatasize = GPMF_DATA_SIZE(src_lptr[1]) >> 2;
+		uint32_t nextTag = src_lptr[2 + sampleDatasize];
+		uint32_t *next_lptr = &src_lptr[2 + sampleDatasize];
+		
+		if(sampleDatasize == 0 && nextTag != currentTag)
+			return 0;
+		else
+			grouped++;  //at least one grouped sample
+
+		while (nextTag == currentTag) // Grouped data link FACE, HUES, SCEN
+		{
+			*currentTotalSampleBytes += 8 + GPMF_DATA_SIZE(next_lptr[1]);
+			sampleDatasize = GPMF_DATA_SIZE(next_lptr[1]) >> 2;
+			nextTag = next_lptr[2 + sampleDatasize];
+			next_lptr = &next_lptr[2 + sampleDatasize];
+			grouped++;
+		}
+	}
+
+	return grouped;
+}
+
+
+static uint32_t DataSizeForSamples(uint32_t *srcPayload, uint32_t samples2store, uint32_t grouped)
+{
+	uint32_t dataSize = 0;
+
+	if (samples2store == 0) return 0;
+
+	if (grouped)
+	{
+		uint32_t i;
+		uint32_t *sample_group = srcPayload;
+
+		//recompute the size for samples2store grouped samples.
+		for (i = 0; i < samples2store; i++)
+		{
+			uint32_t groupbytes = GPMF_DATA_SIZE(sample_group[1]);
+			dataSize += 8 + groupbytes;
+			sample_group += (8 + groupbytes) >> 2;
+		}
+		//remainingSize = currentTotalSampleBytes - dataSize;
+		//remainingOffset = dataSize;
+	}
+	else
+	{
+
+		uint32_t sampleSize = GPMF_SAMPLE_SIZE(srcPayload[1]);
+
+		dataSize = 8 + sampleSize*samples2store;
+		//remainingSize = ((sampleSize * remainingSamples + 3) & ~3);
+		//remainingOffset = sampleSize * remainingSamples;
+	}
+
+	return dataSize;
+}
+
+
+#if BLOCK_COMPRESSION
+// Samples in a stream buffer starting with stored blocks, see CompressStoredBlock(), including the samples after them.
+static uint32_t CountStoredSamples(uint32_t *src_lptr)
+{
+	uint32_t samples = 0;
+
+	while (GPMF_VALID_FOURCC(src_lptr[0]) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1])))
+	{
+		samples += GPMF_SAMPLES(src_lptr[2]);
+		src_lptr += 2 + (GPMF_DATA_SIZE(src_lptr[1]) >> 2);
+	}
+	if (GPMF_VALID_FOURCC(src_lptr[0]))
+		samples += GPMF_SAMPLES(src_lptr[1]);
+
+	return samples;
+}
+
+// Limit the samples to store from a stream buffer starting with stored blocks to a block boundary when they end within 
+// a block, and to what one GPMF_TYPE_COMPRESSED_SEGMENTS entry can hold.
+static uint32_t StoredBlockSamples(uint32_t *src_lptr, uint32_t samples)
+{
+	uint32_t count = 0, longs = 1;
+
+	while (GPMF_VALID_FOURCC(src_lptr[0]) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1])))
+	{
+		uint32_t blocksamples = GPMF_SAMPLES(src_lptr[2]);
+		uint32_t blocklongs = 1 + (GPMF_DATA_SIZE(src_lptr[1]) >> 2); // the segment drops the FourCC
+
+		if (count + blocksamples > samples || count + blocksamples > 0xffff || longs + blocklongs > 0xffff)
+			return count;
+		count += blocksamples;
+		longs += blocklongs;
+		src_lptr += 1 + blocklongs;
+	}
+
+	if (GPMF_VALID_FOURCC(src_lptr[0]) && samples > count) // the samples after the blocks, no larger than uncompressed
+	{
+		uint32_t sample_size = GPMF_SAMPLE_SIZE(src_lptr[1]);
+		uint32_t tail = GPMF_SAMPLES(src_lptr[1]);
+
+		if (tail > samples - count) tail = samples - count;
+		if (tail > 0xffff - count) tail = 0xffff - count;
+		if (sample_size && longs + 1 + ((tail * sample_size + 3) >> 2) > 0xffff)
+			tail = ((0xffff - longs - 1) * 4) / sample_size;
+		count += tail;
+	}
+
+	return count;
+}
+
+// Move the stored blocks holding the first samples (block aligned by StoredBlockSamples()) out of the stream buffer, 
+// into dst unless NULL.  A single block with nothing after it is copied as is, otherwise the blocks become segments of 
+// a GPMF_TYPE_COMPRESSED_SEGMENTS entry, returned in *segments so the payload loop appends the remaining samples as 
+// the last segment.  Unless release is set the blocks stay in the buffer for the session pass, *next is where the 
+// samples after them begin either way.  Returns the bytes written to dst.
+static uint32_t SpliceStoredBlocks(device_metadata *dm, uint32_t *dst, uint32_t samples, uint32_t release, uint32_t *blocksamples, uint32_t **segments, uint32_t **next)
+{
+	uint32_t *block = dm->payload_buffer, *out = dst;
+	uint32_t count = 0, blocks = 0, bytes = 0, endbytes;
+
+	*segments = NULL;
+	*next = dm->payload_buffer;
+	while (GPMF_VALID_FOURCC(block[0]) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(block[1])) && count + GPMF_SAMPLES(block[2]) <= samples)
+	{
+		count += GPMF_SAMPLES(block[2]);
+		bytes += 8 + GPMF_DATA_SIZE(block[1]);
+		block += 2 + (GPMF_DATA_SIZE(block[1]) >> 2);
+		blocks++;
+	}
+	*blocksamples = count;
+	if (blocks == 0)
+		return 0;
+	if (!release)
+		*next = block;
+
+	if (dst)
+	{
+		uint32_t *src = dm->payload_buffer;
+
+		if (blocks == 1 && count == samples)
+		{
+			memcpy(out, src, bytes);
+			out += bytes >> 2;
+		}
+		else
+		{
+			out[0] = src[0];
+			out[2] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_SAMPLE_TYPE(src[2]), GPMF_SAMPLE_SIZE(src[2]), samples);
+			out += 3;
+			while (src < block)
+			{
+				uint32_t segmentbytes = 4 + GPMF_DATA_SIZE(src[1]);
+				memcpy(out, &src[1], segmentbytes);
+				out += segmentbytes >> 2;
+				src += 1 + (segmentbytes >> 2);
+			}
+			dst[1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED_SEGMENTS, 4, (uint32_t)(out - dst) - 2);
+			*segments = dst;
+		}
+	}
+
+	if (release)
+	{
+		endbytes = (SeekEndGPMF(dm->payload_buffer, dm->payload_alloc_size) + 3) & ~3;
+		memmove(dm->payload_buffer, block, endbytes - bytes + 4); // with the terminator
+		dm->payload_curr_size = endbytes - bytes;
+	}
+
+	return dst ? (uint32_t)(out - dst) * 4 : 0;
+}
+
+// Copy a stream buffer starting with stored blocks into a session payload, dst unless NULL for just the size.  They 
+// can't be scaled, so the blocks and the samples after them of the same FourCC go in as they are, as segments of 
+// GPMF_TYPE_COMPRESSED_SEGMENTS entries.  *src is advanced past them and *samples is set to the samples copied.  
+// Returns the bytes written to dst.
+static uint32_t CopyStoredBlocks(uint32_t *dst, uint32_t **src, uint32_t *samples)
+{
+	uint32_t *klv = *src;
+	uint32_t tag = klv[0], pos = 0, entry = 0, count = 0;
+
+	*samples = 0;
+	while (GPMF_VALID_FOURCC(klv[0]) && klv[0] == tag)
+	{
+		uint32_t typesize = GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(klv[1])) ? klv[2] : klv[1];
+		uint32_t klvsamples = GPMF_SAMPLES(typesize);
+		uint32_t segmentlongs = 1 + (GPMF_DATA_SIZE(klv[1]) >> 2); // the segment drops the FourCC
+
+		if (1 + segmentlongs > 0xffff) // too large for a segment, copied as is
+		{
+			if (dst) memcpy(&dst[pos], klv, (1 + segmentlongs) * 4);
+			pos += 1 + segmentlongs;
+			count = 0;
+		}
+		else
+		{
+			if (count == 0 || count + klvsamples > 0xffff || pos + segmentlongs - entry - 2 > 0xffff) // start a new entry
+			{
+				entry = pos;
+				count = 0;
+				if (dst) dst[pos] = tag;
+				pos += 3;
+			}
+			if (dst) memcpy(&dst[pos], &klv[1], segmentlongs * 4);
+			pos += segmentlongs;
+			count += klvsamples;
+
+			if (dst)
+			{
+				dst[entry + 1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED_SEGMENTS, 4, pos - entry - 2);
+				dst[entry + 2] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_SAMPLE_TYPE(typesize), GPMF_SAMPLE_SIZE(typesize), count);
+			}
+		}
+
+		*samples += klvsamples;
+		klv += 1 + segmentlongs;
+	}
+
+	*src = klv;
+	return pos * 4;
+}
+#endif
+
+// Samples the payload pass takes from the front of dm's buffer for latestTimeStamp, 0x0fffffff when it isn't limited 
+// by time, block aligned for stored blocks.  Shared by the payload loop and PrecompressStreams(). Call with dm locked.
+static uint32_t PayloadSamplesToStore(device_metadata *dm, uint64_t latestTimeStamp)
+{
+	uint32_t samples2store = 0x0fffffff;
+#if BLOCK_COMPRESSION
+	uint32_t *src_lptr = (uint32_t *)dm->payload_buffer;
+#endif
+
+	if (dm->payload_sticky_curr_size > 0 && dm->last_nonsticky_fourcc != 0 && dm->payloadTimeStampCount != 0)
+	{
+		uint64_t computedTimeStamp = TimeIndexFirstTimeStamp(dm);
+
+		if (LARGESTTIMESTAMP == latestTimeStamp)
+			samples2store = 0xffffff;
+		else if (latestTimeStamp > computedTimeStamp)
+			samples2store = TimeIndexSamplesBefore(dm, computedTimeStamp, latestTimeStamp);
+		else
+			samples2store = 0;
+	}
+
+#if BLOCK_COMPRESSION
+	if (GPMF_VALID_FOURCC(*src_lptr) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1])))
+		samples2store = StoredBlockSamples(src_lptr, samples2store);
+#endif
+
+	return samples2store;
+}
+
+
+#define PRIORITY_STORED		0
+
+#define PRIORITY_DEFERRED	1
+#define PRIORITY_PENDING	2
+
+// Bytes of the DEVC, DVID, DVNM and TICK written for a device ahead of its streams.
+static uint32_t DeviceHeaderSize(device_metadata *dm)
+{
+	uint32_t bytes = 8 + 12 + 8 + ((strlen(dm->device_name) + 3) & ~3);
+
+	if (dm->device_id == GPMF_DEVICE_ID_CAMERA && dm->channel != GPMF_CHANNEL_SETTINGS)
+		bytes += 12;
+
+	return bytes;
+}
+
+// Bytes for the headers of the devices from dm on that differ from last_deviceID, each with up to pad bytes of 
+// chunk padding.
+static uint32_t DeviceHeaders(device_metadata *dm, uint32_t last_deviceID, uint32_t pad)
+{
+	uint32_t bytes = 0;
+
+	for (; dm; dm = dm->next)
+	{
+		if (dm->device_id != last_deviceID && dm->device_id != GPMF_DEVICE_ID_PREFORMATTED)
+		{
+			last_deviceID = dm->device_id;
+			bytes += DeviceHeaderSize(dm) + pad;
+		}
+	}
+
+	return bytes;
+}
+
+// Upper bound of the bytes the first samples of each KLV in a stream buffer take in a payload, copied or, for 
+// streams with QUAN, compressed (up to COMPRESS_DST_SLACK larger).  Call with the device locked.
+static uint32_t PayloadDataBound(uint32_t *src_lptr, uint32_t samples, uint32_t quantize)
+{
+	uint32_t bytes = 0;
+
+#if BLOCK_COMPRESSION
+	if (GPMF_VALID_FOURCC(src_lptr[0]) && GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1])))
+		bytes += 12; // the GPMF_TYPE_COMPRESSED_SEGMENTS header, the stored blocks are copied as they are
+#endif
+	while (GPMF_VALID_FOURCC(src_lptr[0]))
+	{
+		uint32_t typesize = src_lptr[1];
+		uint32_t klvbytes = 8 + GPMF_DATA_SIZE(typesize);
+
+		src_lptr += klvbytes >> 2;
+		if (GPMF_SAMPLE_TYPE(typesize) != GPMF_TYPE_NEST && !GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(typesize)))
+		{
+			if (GPMF_SAMPLES(typesize) > samples) // only the first samples are stored
+				klvbytes = (8 + GPMF_SAMPLE_SIZE(typesize) * samples + 3) & ~3;
+			if (quantize)
+				klvbytes += COMPRESS_DST_SLACK;
+		}
+		bytes += klvbytes;
+	}
+
+	return bytes;
+}
+
+// Mark which streams fit within buffer_size, highest priority first, by their estimated size without a margin, as the 
+// payload loop checks each stream against the space really left before copying it. Call with the device list locked.
+// Returns the number of deferred streams, the first max_deferred of them are listed in deferred_streams.
+static uint32_t SelectPriorityStreams(GPMFWriterWorkspace *ws, uint32_t channel, uint32_t buffer_size, uint64_t latestTimeStamp,
+									size_t *deferred_streams, uint32_t max_deferred)
+{
+	device_metadata *dm, *best;
+	uint32_t last_deviceID = 0;
+	uint32_t overhead = 0, available = 0;
+	uint32_t num_deferred = 0;
+
+	// The device headers are always stored
+	dm = ws->metadata_devices[channel];
+	while (dm)
+	{
+		Lock(&dm->device_lock);
+		dm->deferred = PRIORITY_PENDING;
+		if (dm->device_id != last_deviceID && dm->device_id != GPMF_DEVICE_ID_PREFORMATTED)
+		{
+			last_deviceID = dm->device_id;
+			overhead += DeviceHeaderSize(dm);
+		}
+		Unlock(&dm->device_lock);
+		dm = dm->next;
+	}
+
+	if (buffer_size > overhead)
+		available = buffer_size - overhead;
 
-		memcpy(dbyte, sbyte, bytesize*channels);  // store the first full sample as is.
-		pos += channels;
-		returnpayloadsize += bytesize*channels;
+	do
+	{
+		best = NULL;
+		dm = ws->metadata_devices[channel];
+		while (dm)
+		{
+			if (dm->deferred == PRIORITY_PENDING && (best == NULL || dm->priority > best->priority))
+				best = dm;
+			dm = dm->next;
+		}
 
-		for (chn = 0; chn < channels; chn++)
+		if (best)
 		{
-			uint32_t quant = quantHi, bufsize = payloadAddition - returnpayloadsize;
-			uint32_t totalbits = 0, zerorun = 0;
+			uint32_t streamsize = 0;
 
-			if (chn & 1) quant = quantLo; // Hack for encoding quantized 32-bit data with 16-bits.
+			Lock(&best->device_lock);
+			if (best->payload_sticky_curr_size > 0)
+				streamsize += 8 + 16 + ((best->payload_sticky_curr_size + 3)&~3); // STRM, STMP and the sticky data
+			if (best->payload_curr_size > 0)
+				streamsize += EstimateStreamDataSize(best, latestTimeStamp);
 
-			if (bytesize == 2)
+			if (streamsize <= available)
 			{
-				dShort[pos] = BYTESWAP16(quant); pos++,
-					GPMF_InitCompressedBitstream(&bstream, (uint8_t*)&dShort[pos], bufsize, bytesize * 8);
+				available -= streamsize;
+				best->deferred = PRIORITY_STORED;
 			}
 			else
 			{
-				dByte[pos] = (uint8_t)quant; pos++;
-				pos = ((pos + 1) & ~1); //16-bit aligned compressed data
-				GPMF_InitCompressedBitstream(&bstream, &dByte[pos], bufsize, bytesize * 8);
+				best->deferred = PRIORITY_DEFERRED;
+				if (deferred_streams && num_deferred < max_deferred)
+					deferred_streams[num_deferred] = (size_t)best;
+				num_deferred++;
 			}
+			Unlock(&best->device_lock);
+		}
+	} while (best);
 
+	return num_deferred;
+}
 
-			returnpayloadsize += 4;
 
-			for (i = 1; i < repeat; i++)
-			{
-				int delta = 0;
-				switch (bytesize*signed_type)
-				{
-				default:
-				case -2: delta = ((int16_t)BYTESWAP16(sshort[i*channels + chn]) / (int16_t)quant) - ((int16_t)BYTESWAP16(sshort[(i - 1)*channels + chn]) / (int16_t)quant); break;
-				case -1: delta = ((int)(sbyte[i*channels + chn]) / (int)quant) - ((int)(sbyte[(i - 1)*channels + chn]) / (int)quant); break;
-				case 1: delta = ((int)(sByte[i*channels + chn]) / (int)quant) - ((int)(sByte[(i - 1)*channels + chn]) / (int)quant); break;
-				case 2: delta = ((int)BYTESWAP16(sShort[i*channels + chn]) / (int)quant) - ((int)BYTESWAP16(sShort[(i - 1)*channels + chn]) / (int)quant); break;
-				}
+#if PARALLEL_COMPRESSION_THREADS
+static compress_pool *CreateCompressPool(uint32_t threads)
+{
+	compress_pool *pool = malloc(sizeof(compress_pool));
 
-				if (delta == 0) {
-					zerorun++;
-					continue;
-				}
+	if (pool)
+	{
+		memset(pool, 0, sizeof(compress_pool));
+		pool->threads = threads;
+		CreateLock(&pool->lock);
+		CreateCondition(&pool->wake);
+		CreateCondition(&pool->done);
+	}
 
-				if (zerorun)
-				{
-					totalbits += GPMF_CompressedZeroRun(&bstream, zerorun);
-					zerorun = 0;
-				}
+	return pool;
+}
 
-				totalbits += GPMF_CompressedPutValue(&bstream, delta);
+static void DestroyCompressPool(compress_pool *pool)
+{
+	uint32_t i;
 
-				//make sure compressed is not larger than uncompressed.
-				if (totalbits + 256 > bufsize * 8) // in bits
-				{
-					//too big, just store uncompresssed.
-					memcpy(dst_gpmf, src_gpmf, payloadAddition);
-#if HUFF_STATS
-					sourcesize += payloadAddition;
-					storedsize += payloadAddition;
-#endif
-					return payloadAddition;
-				}
-			}
+	if (pool == NULL) return;
 
-			totalbits += GPMF_CompressedPutCode(&bstream, HUFF_END_CODE_ENTRY);
+	Lock(&pool->lock);
+	pool->shutdown = 1;
+	WakeAllCondition(&pool->wake);
+	Unlock(&pool->lock);
 
-			GPMF_CompressedFlushStream(&bstream);
+	for (i = 0; i < pool->workercount; i++)
+		JoinWorker(&pool->workers[i]);
 
-			int bytesadded = ((totalbits + 7) / 8);
-			int lastsize = returnpayloadsize;
-			returnpayloadsize += bytesadded;
-			returnpayloadsize = ((returnpayloadsize + 1) & ~1); //16-bit aligned with a compressed channel
-			pos += ((returnpayloadsize - lastsize) >> (bytesize - 1));
-		}
-		break;
-	}
-	default: // do not compress other types of data
-		memcpy(dst_gpmf, src_gpmf, payloadAddition);
-		return payloadAddition;
-	}
+	DeleteCondition(&pool->wake);
+	DeleteCondition(&pool->done);
+	DeleteLock(&pool->lock);
+	if (pool->scratch)
+		free(pool->scratch);
+	free(pool);
+}
 
+static void RunCompressJob(compress_pool *pool) // call with pool->lock held and nextjob < jobcount, returns with it held
+{
+	compress_job *job = &pool->jobs[pool->nextjob++];
 
-	returnpayloadsize = ((returnpayloadsize + 3) >> 2) << 2; //32-bit aligned channel
+	Unlock(&pool->lock);
+	job->dstsize = GPMFCompress((uint32_t *)&pool->scratch[job->dst_offset], (uint32_t *)&pool->scratch[job->src_offset], 
+		job->srcsize, job->quantize, job->coding, &job->stats);
+	Lock(&pool->lock);
 
-	if (returnpayloadsize > payloadAddition) // double check
+	if (++pool->completed == pool->jobcount)
+		WakeAllCondition(&pool->done);
+}
+
+static void CompressWorker(void *arg)
+{
+	compress_pool *pool = (compress_pool *)arg;
+
+	Lock(&pool->lock);
+	while (!pool->shutdown)
 	{
-		memcpy(dst_gpmf, src_gpmf, payloadAddition);
-		returnpayloadsize = payloadAddition;
+		if (pool->nextjob < pool->jobcount)
+			RunCompressJob(pool);
+		else
+			WaitCondition(&pool->wake, &pool->lock);
 	}
-	else
+	Unlock(&pool->lock);
+}
+
+// Queue a scratch copy of a KLV, with its type-size-repeat replaced, exactly as the payload loop will compress it.
+static void AddCompressJob(compress_pool *pool, uint32_t *src, uint32_t srcsize, uint32_t typesizerepeat, uint32_t quantize, uint32_t coding)
+{
+	uint32_t src_offset = pool->scratch_used;
+	uint32_t dst_offset = src_offset + ((srcsize + 7) & ~7);
+	uint32_t needed = dst_offset + ((srcsize + COMPRESS_DST_SLACK + 7) & ~7);
+
+	compress_job *job;
+
+	if (pool->queued >= COMPRESS_MAX_JOBS)
+		return;
+
+	if (needed > pool->scratch_size)
 	{
-		uint32_t typesizerepeat_compressed;
+		uint32_t newsize = needed * 2;
+		uint8_t *newscratch = realloc(pool->scratch, newsize);
 
-		typesizerepeat_compressed = GPMF_MAKE_TYPE_SIZE_COUNT('#', bytesize, (returnpayloadsize - 8) / bytesize);
-		dst_gpmf[1] = typesizerepeat_compressed;
+		if (newscratch == NULL)
+			return; // this block is compressed inline
+		pool->scratch = newscratch;
+		pool->scratch_size = newsize;
 	}
 
-#if HUFF_STATS
-	sourcesize += payloadAddition;
-	storedsize += returnpayloadsize;
-#endif
+	memcpy(&pool->scratch[src_offset], src, srcsize);
+	((uint32_t *)&pool->scratch[src_offset])[1] = typesizerepeat;
+
+	job = &pool->jobs[pool->queued++];
+	job->src_offset = src_offset;
+	job->dst_offset = dst_offset;
+	job->srcsize = srcsize;
+	job->dstsize = 0;
+	job->quantize = quantize;
+	job->coding = coding;
+	memset(&job->stats, 0, sizeof(job->stats));
+	pool->scratch_used = needed;
+}
 
-	return returnpayloadsize;
+static void ReleaseCompressPool(compress_pool *pool)
+{
+	Lock(&pool->lock);
+	pool->jobcount = pool->nextjob = pool->completed = pool->matched = 0;
+	pool->busy = 0;
+	Unlock(&pool->lock);
 }
 
+// Compress the first sample block of every QUAN stream on the worker pool ahead of payload assembly. Each stream is 
+// locked only while its block is copied to scratch memory, selected by PayloadSamplesToStore() and SpliceStoredBlocks() 
+// as the payload loop selects it, and the copies are compressed with no stream locked.  A block that changed since its 
+// copy is compressed inline by the payload loop.
+// Call with the device list locked. Returns 1 if the pool is now owned by the caller, release with ReleaseCompressPool().
+static uint32_t PrecompressStreams(GPMFWriterWorkspace *ws, uint32_t channel, uint64_t latestTimeStamp, uint32_t prioritize)
+{
+	compress_pool *pool = ws->pool;
+	device_metadata *dm;
+
+	if (pool == NULL) return 0;
 
+	Lock(&pool->lock);
+	if (pool->busy)
+	{
+		Unlock(&pool->lock);
+		return 0;
+	}
+	pool->busy = 1;
+	Unlock(&pool->lock);
 
-static uint32_t CountSamplesGrouped(uint32_t *srcPayload, uint32_t *currentTotalSampleBytes)
-{
-	uint32_t grouped = 0;
-	uint32_t currentTag = srcPayload[0];
+	pool->queued = 0;
+	pool->scratch_used = 0;
 
-	if (currentTag)
+	for (dm = ws->metadata_devices[channel]; dm; dm = dm->next)
 	{
-		uint32_t *src_lptr = srcPayload;
-		uint32_t sampleDatasize = GPMF_DATA_SIZE(src_lptr[1]) >> 2;
-		uint32_t nextTag = src_lptr[2 + sampleDatasize];
-		uint32_t *next_lptr = &src_lptr[2 + sampleDatasize];
-		
-		if(sampleDatasize == 0 && nextTag != currentTag)
-			return 0;
-		else
-			grouped++;  //at least one grouped sample
+		uint32_t *src_lptr;
+		uint32_t currentTotalSampleBytes, currentSamples, samples2store, storesamples, grouped = 0, dataSize;
 
-		while (nextTag == currentTag) // Grouped data link FACE, HUES, SCEN
+		if (!dm->quantize || (prioritize && dm->deferred))
+			continue;
+
+		Lock(&dm->device_lock);
+		src_lptr = (uint32_t *)dm->payload_buffer;
+		if (dm->payload_curr_size > 8 && GPMF_VALID_FOURCC(*src_lptr))
 		{
-			*currentTotalSampleBytes += 8 + GPMF_DATA_SIZE(next_lptr[1]);
-			sampleDatasize = GPMF_DATA_SIZE(next_lptr[1]) >> 2;
-			nextTag = next_lptr[2 + sampleDatasize];
-			next_lptr = &next_lptr[2 + sampleDatasize];
-			grouped++;
+			currentTotalSampleBytes = 8 + GPMF_DATA_SIZE(src_lptr[1]);
+			if (dm->groupedFourCC && dm->groupedFourCC == *src_lptr)
+				grouped = CountSamplesGrouped(src_lptr, &currentTotalSampleBytes);
+			currentSamples = grouped ? grouped : GPMF_SAMPLES(src_lptr[1]);
+			samples2store = PayloadSamplesToStore(dm, latestTimeStamp);
+#if BLOCK_COMPRESSION
+			if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1]))) // stored blocks are copied, only the samples after them are compressed
+			{
+				uint32_t blocksamples, *segments;
+
+				currentSamples = CountStoredSamples(src_lptr);
+				if (samples2store > currentSamples)
+					samples2store = currentSamples;
+				SpliceStoredBlocks(dm, NULL, samples2store, 0, &blocksamples, &segments, &src_lptr);
+				samples2store -= blocksamples;
+				currentSamples -= blocksamples;
+			}
+#endif
+			storesamples = samples2store < currentSamples ? samples2store : currentSamples;
+
+			dataSize = DataSizeForSamples(src_lptr, storesamples, grouped);
+			if (grouped != 1 && dataSize > 100)
+			{
+				if (grouped)
+				{
+					uint32_t i, *sample_group = src_lptr;
+					for (i = 0; i < storesamples; i++)
+					{
+						uint32_t groupbytes = GPMF_DATA_SIZE(sample_group[1]);
+						AddCompressJob(pool, sample_group, 8 + groupbytes, sample_group[1], dm->quantize, dm->coding);
+						sample_group += (8 + groupbytes) >> 2;
+					}
+				}
+				else
+				{
+					AddCompressJob(pool, src_lptr, dataSize, 
+						GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_SAMPLE_TYPE(src_lptr[1]), GPMF_SAMPLE_SIZE(src_lptr[1]), storesamples), 
+						dm->quantize, dm->coding);
+				}
+			}
 		}
+		Unlock(&dm->device_lock);
 	}
 
-	return grouped;
-}
+	if (pool->queued < 2) // nothing to gain from the workers
+	{
+		ReleaseCompressPool(pool);
+		return 0;
+	}
 
+	Lock(&pool->lock);
+	pool->jobcount = pool->queued;
+	pool->nextjob = pool->completed = pool->matched = 0;
+	while (pool->workercount + 1 < pool->threads && pool->workercount < PARALLEL_COMPRESSION_THREADS && pool->workercount + 1 < pool->jobcount)
+	{
+		if (THREAD_ERROR_OKAY != CreateWorker(&pool->workers[pool->workercount], CompressWorker, pool))
+			break; // whatever isn't taken by a worker is compressed below
+		pool->workercount++;
+	}
+	WakeAllCondition(&pool->wake);
+	while (pool->nextjob < pool->jobcount)
+		RunCompressJob(pool);
+	while (pool->completed < pool->jobcount)
+		WaitCondition(&pool->done, &pool->lock);
+	Unlock(&pool->lock);
 
-static uint32_t DataSizeForSamples(uint32_t *srcPayload, uint32_t samples2store, uint32_t grouped)
-{
-	uint32_t dataSize = 0;
+	return 1;
+}
 
-	if (samples2store == 0) return 0;
+#endif
 
-	if (grouped)
+// GPMFCompress() for the payload loop, using the pool's result when it compressed this exact block.
+static uint32_t CompressBlock(GPMFWriterWorkspace *ws, uint32_t precompressed, uint32_t *dst, uint32_t *src, uint32_t srcsize, uint32_t quantize, uint32_t coding,
+							GPMFStreamStats *stats)
+{
+#if PARALLEL_COMPRESSION_THREADS
+	if (precompressed)
 	{
+		compress_pool *pool = ws->pool;
 		uint32_t i;
-		uint32_t *sample_group = srcPayload;
 
-		//recompute the size for samples2store grouped samples.
-		for (i = 0; i < samples2store; i++)
+		for (i = pool->matched; i < pool->jobcount; i++)
 		{
-			uint32_t groupbytes = GPMF_DATA_SIZE(sample_group[1]);
-			dataSize += 8 + groupbytes;
-			sample_group += (8 + groupbytes) >> 2;
+			compress_job *job = &pool->jobs[i];
+			if (job->srcsize == srcsize && job->quantize == quantize && job->coding == coding &&
+				0 == memcmp(&pool->scratch[job->src_offset], src, srcsize))
+			{
+				pool->matched = i + 1;
+				memcpy(dst, &pool->scratch[job->dst_offset], job->dstsize);
+				if (stats)
+				{
+					stats->raw_bytes += job->stats.raw_bytes;
+					stats->stored_bytes += job->stats.stored_bytes;
+					stats->blocks += job->stats.blocks;
+					stats->fallbacks += job->stats.fallbacks;
+					stats->escape_codes += job->stats.escape_codes;
+					stats->zero_runs += job->stats.zero_runs;
+				}
+				return job->dstsize;
+			}
 		}
-		//remainingSize = currentTotalSampleBytes - dataSize;
-		//remainingOffset = dataSize;
-	}
-	else
-	{
-
-		uint32_t sampleSize = GPMF_SAMPLE_SIZE(srcPayload[1]);
-
-		dataSize = 8 + sampleSize*samples2store;
-		//remainingSize = ((sampleSize * remainingSamples + 3) & ~3);
-		//remainingOffset = sampleSize * remainingSamples;
 	}
+#else
+	(void)ws; (void)precompressed;
+#endif
 
-	return dataSize;
+	return GPMFCompress(dst, src, srcsize, quantize, coding, stats);
 }
 
 
-uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size,
+static uint32_t GetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size,
 										uint32_t **payload, uint32_t *payloadsize,
 										uint32_t **session, uint32_t *sessionsize, int session_reduction,
-										uint64_t latestTimeStamp)
+										uint64_t latestTimeStamp, uint32_t prioritize, size_t *deferred_streams, uint32_t *deferred_count)
 {
 	uint32_t *newpayload = NULL;
 	uint32_t estimatesize = 0,j;
+	uint32_t precompressed = 0;
+	uint32_t num_deferred = 0, max_deferred = deferred_count ? *deferred_count : 0;
 
 	device_metadata *dm, *dmnext;
 	GPMFWriterWorkspace *ws = (GPMFWriterWorkspace *)ws_handle;
@@ -2362,7 +3913,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 	if (session)
 		estimatesize += GPMFWriteEstimateBufferSize(ws_handle, channel, session_reduction, latestTimeStamp);
 
-	if(buffer_size < estimatesize)
+	if(buffer_size < estimatesize && !prioritize)
 	{
 		DBG_MSG("GPMFWriteGetPayloadAndSession: not enough buffer to work with\n");
 		return GPMF_ERROR_MEMORY;
@@ -2375,11 +3926,36 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 			*payloadsize = 0;
 		if (sessionsize)
 			*sessionsize = 0;
+		if (deferred_count)
+			*deferred_count = 0;
 		return GPMF_ERROR_EMPTY_DATA;
 	}
 
 	Lock(&ws->metadata_device_list[channel]);	//Prevent device list changes while extracting data from the current device list
 
+	if (prioritize)
+	{
+		if (DeviceHeaders(ws->metadata_devices[channel], 0, GetChunkSize(buffer_size) - 1) > buffer_size) // these are always stored
+		{
+			Unlock(&ws->metadata_device_list[channel]);
+			if (deferred_count)
+				*deferred_count = 0;
+			return GPMF_ERROR_MEMORY;
+		}
+
+		if (buffer_size < estimatesize)
+			num_deferred = SelectPriorityStreams(ws, channel, buffer_size, latestTimeStamp, deferred_streams, max_deferred);
+		else
+		{
+			for (dm = ws->metadata_devices[channel]; dm; dm = dm->next)
+				dm->deferred = PRIORITY_STORED;
+		}
+	}
+
+#if PARALLEL_COMPRESSION_THREADS
+	if (payload && buffer)
+		precompressed = PrecompressStreams(ws, channel, latestTimeStamp, prioritize);
+#endif
 	
 	newpayload = (uint32_t *)buffer;
 
@@ -2419,8 +3995,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 				Lock(&dm->device_lock); // Get data and return, minimal processing within the lock
 				//if(dm->payload_curr_size > 0) // Store information of all connected devices even if they have sent no data
 				{
-					FLOAT_PRECISION slope = 0.0, intercept = 0.0;
- 					uint32_t samples2store = 0x0fffffff;
+					uint32_t samples2store = 0x0fffffff;
 					uint32_t streamsizebytes = 0, *laststreamsizeptr = NULL;
 					size_t namelen;
 					uint32_t namlen4byte;
@@ -2429,6 +4004,12 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 					uint32_t ts_pos = 0;
 					uint32_t empty = 0;
 					uint32_t *ptrSessionTSMP = NULL;
+					uint32_t *streamstart = NULL, devicestart = 0;
+					GPMFStreamStats *stats = j == 0 ? &dm->stats : NULL; // the session pass compresses the same samples again, only the payload pass counts
+#if BLOCK_COMPRESSION
+					uint32_t blocksamples = 0;
+					uint32_t *segments = NULL;
+#endif
 
 					uint32_t *src_lptr = (uint32_t *)dm->payload_buffer;
 					uint8_t *src_bptr = (uint8_t *)dm->payload_buffer;
@@ -2445,6 +4026,10 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 							currentSamples = grouped;
 						else
 							currentTotalSampleBytes = 8 + GPMF_DATA_SIZE(src_lptr[1]);
+#if BLOCK_COMPRESSION
+						if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1]))) // starts with stored blocks
+							currentSamples = CountStoredSamples(src_lptr);
+#endif
 					}
 
 
@@ -2541,7 +4126,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 						}
 					}
 
-					if(newpayload && grouped == 1) // skip grouped stream if there is only one value to output, wait until there is at least 2.
+					if(newpayload && (grouped == 1 || (prioritize && dm->deferred))) // skip grouped stream if there is only one value to output, wait until there is at least 2.
 					{
 						dmnext = dm->next;
 						Unlock(&dm->device_lock);
@@ -2549,6 +4134,8 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 						continue;
 					}
 
+					streamstart = ptr;
+					devicestart = devicesizebytes;
 
 					// Wrap telemetry in a New Stream (or channel) if the payload has sticky metadata
 					if (dm->payload_sticky_curr_size > 0 && dm->last_nonsticky_fourcc != 0 && (currentSamples > 0 || session_scale == 0))
@@ -2565,59 +4152,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 							uint32_t swap64timestamp[2];
 							uint64_t *ptr64 = (uint64_t *)&swap64timestamp[0];
 
-							if (dm->payloadTimeStampCount > 5)  // reduce sampling jitter if we have enough timestamps, if there is not jitter the timestamps are preserved.
-							{
-								uint32_t sample;
-
-								// Compute the linear regression
-								FLOAT_PRECISION top = 0.0, bot = 0.0, meanX = 0, meanY = 0;
-
-								int64_t ts = dm->firstTimeStamp;
-								int32_t smps = 0;
-								uint32_t uniformStep = 0, tests = 0;
-								
-								for (sample = 1; sample < dm->payloadTimeStampCount-1; sample++)
-								{
-									tests++;
-									if( ((dm->deltaTimeStamp[sample] / dm->sampleCount[sample]) &~7) == ((dm->deltaTimeStamp[sample-1] / dm->sampleCount[sample-1]) & ~7))
-										uniformStep++;
-								}
-								
-								if (uniformStep != tests) // erratic timeStamps, linear regress them
-								{
-									for (sample = 0; sample < dm->payloadTimeStampCount; sample++)
-									{
-										meanY += (FLOAT_PRECISION)ts;
-										meanX += (FLOAT_PRECISION)smps;
-
-										ts += dm->deltaTimeStamp[sample];
-										smps += dm->sampleCount[sample];
-									}
-
-									meanY /= (FLOAT_PRECISION)dm->payloadTimeStampCount;
-									meanX /= (FLOAT_PRECISION)dm->payloadTimeStampCount;
-
-									ts = dm->firstTimeStamp;
-									smps = 0;
-									for (sample = 0; sample < dm->payloadTimeStampCount; sample++)
-									{
-										top += ((FLOAT_PRECISION)smps - meanX)*((FLOAT_PRECISION)ts - meanY);
-										bot += ((FLOAT_PRECISION)smps - meanX)*((FLOAT_PRECISION)smps - meanX);
-
-										ts += dm->deltaTimeStamp[sample];
-										smps += dm->sampleCount[sample];
-									}
-									slope = top / bot;
-									intercept = meanY - slope * meanX;
-
-									if (slope > 0 && (int64_t)intercept < (int64_t)dm->lastTimeStamp) // i.e. not crazy
-									{
-										if (intercept < 0)
-											intercept = 1.0;
-										computedTimeStamp = (uint64_t)(intercept + 0.5); // compute more accurate timestamp
-									}
-								}
-							}
+							computedTimeStamp = TimeIndexFirstTimeStamp(dm);
 
 							if (newpayload)
 							{
@@ -2644,43 +4179,37 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 								streamsizebytes += 4*(2+ts_pos);
 								#endif
 							}
+						}
+					}
 
-									
-							if (LARGESTTIMESTAMP == latestTimeStamp)
-								samples2store = 0xffffff;
-							else if (latestTimeStamp > computedTimeStamp)
-							{
-								{
-									uint32_t smps = 0;
-									uint64_t next_first_ts = computedTimeStamp;
-									ts_pos = 0;	
-									while ((next_first_ts + dm->deltaTimeStamp[ts_pos]) < latestTimeStamp && ts_pos < dm->payloadTimeStampCount-1)
-									{
-										next_first_ts += dm->deltaTimeStamp[ts_pos];
-										smps += dm->sampleCount[ts_pos];
-										
-										ts_pos++;
-									}
+					if (session_scale == 0)
+						samples2store = PayloadSamplesToStore(dm, latestTimeStamp);
 
-									if (ts_pos < dm->payloadTimeStampCount)
-									{
-										uint32_t delta = dm->deltaTimeStamp[ts_pos];
-										if (delta == 0 && ts_pos > 0) delta = dm->deltaTimeStamp[ts_pos - 1];
-										if (delta && dm->sampleCount[ts_pos] > 0)
-										{
-											uint32_t newsmps;
-											delta /= dm->sampleCount[ts_pos];
-											newsmps = (uint32_t)((latestTimeStamp - next_first_ts) / delta);
-											smps += newsmps;
-											next_first_ts += newsmps * delta;
-										}
-									}
-									
-									samples2store = smps;
-								}
-							}
-							else
-								samples2store = 0;
+					if (newpayload && prioritize) // the selection used an estimate, so check the stream against the space really left
+					{
+						uint32_t pad = GetChunkSize(buffer_size) - 1;
+						uint32_t needed = ((dm->payload_sticky_curr_size + 3) & ~3) + pad;
+
+						if (samples2store == 0 || dm->payload_curr_size <= 8)
+							needed += 12 + 8; // an EMPT and an empty KLV
+						else
+							needed += PayloadDataBound(src_lptr, samples2store, dm->quantize);
+						needed += pad + DeviceHeaders(dm->next, dm->device_id, pad);
+
+						if ((uint32_t)(ptr - newpayload) * 4 + needed > buffer_size)
+						{
+							ptr = streamstart;
+							devicesizebytes = devicestart;
+
+							dm->deferred = PRIORITY_DEFERRED;
+							if (deferred_streams && num_deferred < max_deferred)
+								deferred_streams[num_deferred] = (size_t)dm;
+							num_deferred++;
+
+							dmnext = dm->next;
+							Unlock(&dm->device_lock);
+							dm = dmnext;
+							continue;
 						}
 					}
 
@@ -2889,6 +4418,24 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 								}
 								else
 								{
+#if BLOCK_COMPRESSION
+									if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(srcPayload[1]))) // stored blocks go first, then the samples after them
+									{
+										uint32_t blockbytes = SpliceStoredBlocks(dm, newpayload ? ptr : NULL, storesamples, freebuffers, &blocksamples, &segments, &srcPayload);
+
+										if (newpayload)
+										{
+											devicesizebytes += blockbytes;
+											streamsizebytes += blockbytes;
+											ptr += blockbytes >> 2;
+										}
+										remainingPayload = srcPayload;
+										storesamples -= blocksamples;
+										currentSamples -= blocksamples;
+										currentTotalSampleBytes = GPMF_VALID_FOURCC(srcPayload[0]) ? 8 + GPMF_DATA_SIZE(srcPayload[1]) : 0;
+										sampleSize = GPMF_SAMPLE_SIZE(srcPayload[1]);
+									}
+#endif
 									dataSize = DataSizeForSamples(srcPayload, storesamples, grouped);
 
 									remainingSize = currentTotalSampleBytes - dataSize;
@@ -2917,7 +4464,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 												for (i = 0; i < storesamples; i++)
 												{
 													uint32_t groupbytes = GPMF_DATA_SIZE(sample_group[1]);
-													payloadAddition += GPMFCompress(ptr, sample_group, 8+groupbytes, dm->quantize);
+													payloadAddition += CompressBlock(ws, precompressed && j == 0, ptr, sample_group, 8+groupbytes, dm->quantize, dm->coding, stats);
 
 													if (payloadAddition & 3)
 													{
@@ -2939,7 +4486,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 											}
 											else
 											{
-												payloadAddition = GPMFCompress(ptr, srcPayload, payloadAddition, dm->quantize);
+												payloadAddition = CompressBlock(ws, precompressed && j == 0, ptr, srcPayload, payloadAddition, dm->quantize, dm->coding, stats);
 											}
 										}
 										else
@@ -2955,11 +4502,21 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 											payloadAddition &= 0xfffffffc;
 										}
 
+#if BLOCK_COMPRESSION
+										if (segments) // the last segment after the stored blocks, without the FourCC
+										{
+											memmove(ptr, ptr + 1, payloadAddition - 4);
+											payloadAddition -= 4;
+											segments[1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED_SEGMENTS, 4, GPMF_SAMPLES(segments[1]) + (payloadAddition >> 2));
+											segments = NULL;
+										}
+#endif
 										devicesizebytes += payloadAddition;
 										streamsizebytes += payloadAddition;
 										ptr += (payloadAddition >> 2);
 									}
 
+
 									// restore remaining data
 									remainingSamples = currentSamples - storesamples;
 									if (remainingSamples)
@@ -2970,7 +4527,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 										{
 											srcdata = (uint8_t *)srcPayload;
 											srcdata += remainingOffset;
-											memcpy(remainingPayload, srcdata, remainingSize); //move remaining samples down
+											memmove(remainingPayload, srcdata, remainingSize); //move remaining samples down
 											remainingPayload += ((remainingSize + 3) >> 2);
 
 											srcdata = (uint8_t *)srcPayload;
@@ -2984,7 +4541,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 
 											srcdata = (uint8_t *)srcPayload;
 											srcdata += remainingOffset;
-											memcpy(&remainingPayload[2], srcdata, sampleSize*remainingSamples); //move remaining samples down
+											memmove(&remainingPayload[2], srcdata, sampleSize*remainingSamples); //move remaining samples down
 											remainingPayload += 2 + ((sampleSize*remainingSamples + 3) >> 2);
 
 											srcdata = (uint8_t *)srcPayload;
@@ -2999,7 +4556,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 												movebytes += 8 + GPMF_DATA_SIZE(moreGPMF[1]);
 												moreGPMF += 2 + (GPMF_DATA_SIZE(moreGPMF[1])>>2);
 											}
-											memcpy(remainingPayload, srcdata, movebytes); 
+											memmove(remainingPayload, srcdata, movebytes); 
 
 											remainingPayload[movebytes >> 2] = GPMF_KEY_END;
 										}
@@ -3047,6 +4604,22 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 								uint32_t samples = GPMF_SAMPLES(src_lptr[1]);
 								if (dm->groupedFourCC && grouped) samples = grouped;
 
+#if BLOCK_COMPRESSION
+								if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(src_lptr[1]))) // stored blocks can't be scaled, they go in as is with the samples after them
+								{
+									uint32_t blockbytes = CopyStoredBlocks(ptr, &src_lptr, &samples);
+
+									devicesizebytes += blockbytes;
+									streamsizebytes += blockbytes;
+									ptr += blockbytes >> 2;
+									samples_out += samples;
+
+									src_bptr = (uint8_t *)src_lptr;
+									last_tag = tag;
+									tag = src_lptr[0];
+									continue;
+								}
+#endif
 								if ((samples >= (session_scale * 2) && session_scale) || GPMF_SAMPLE_TYPE(src_lptr[1]) == GPMF_TYPE_NEST || tag == last_tag) //DAN20160609 Scale data that is twice or more the the target sample rate.
 								{
 								  if (dm->groupedFourCC && grouped)
@@ -3062,7 +4635,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 										if (dm->quantize)
 										{
 											//char *cptr = (char *)src_lptr;
-											datasize += GPMFCompress(ptr, sample_group, 8 + groupbytes, dm->quantize);
+											datasize += GPMFCompress(ptr, sample_group, 8 + groupbytes, dm->quantize, dm->coding, stats);
 											//WIP cptr[8] = GPMF_TYPE_GROUPED;
 										}
 										else
@@ -3292,21 +4865,21 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 					}
 					
 
+#if BLOCK_COMPRESSION
+					currentSamples += blocksamples; // count the spliced blocks again for releasing their time index
+#endif
 					if (freebuffers)
 					{
-						if(dm->payload_curr_size > 0 && dm->device_id != GPMF_DEVICE_ID_PREFORMATTED) // only clear is used for metadata, PREFORMATTED uses this buffer for nested payloads.
+						if(dm->payload_curr_size > 0 && dm->device_id != GPMF_DEVICE_ID_PREFORMATTED)
+ // only clear is used for metadata, PREFORMATTED uses this buffer for nested payloads.
 						{
-							uint32_t smps = 0;
-							uint64_t currts = dm->firstTimeStamp;
-							ts_pos = 0;
+							uint32_t smps;
+							uint64_t currts;
 							if (samples2store >= currentSamples) samples2store = currentSamples;
-								
-							while (smps + dm->sampleCount[ts_pos] <= samples2store && ts_pos < dm->payloadTimeStampCount)
-							{
-								currts += dm->deltaTimeStamp[ts_pos];
-								smps += dm->sampleCount[ts_pos];
-								ts_pos++;
-							}
+
+							ts_pos = TimeIndexEntryForSamples(dm, samples2store);
+							smps = dm->indexSample[ts_pos];
+							currts = dm->firstTimeStamp + dm->indexTimeStamp[ts_pos];
 
 							if (samples2store >= currentSamples)
 							{								
@@ -3316,20 +4889,19 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 								dm->deltaTimeStamp[0] = 0;
 								dm->sampleCount[0] = 0;
 								dm->payloadTimeStampCount = 0;
+								TimeIndexUpdate(dm, 0);
 								dm->firstTimeStamp = dm->lastTimeStamp = currts;
 							}
 							else
 							{
-								if (dm->sampleCount[ts_pos] && samples2store)
+								if (ts_pos < dm->payloadTimeStampCount && dm->sampleCount[ts_pos] && samples2store > smps)
 								{
 									uint32_t ticks_per_sample = dm->deltaTimeStamp[ts_pos] / dm->sampleCount[ts_pos];
-									while (smps < samples2store)
-									{
-										currts += ticks_per_sample;
-										dm->deltaTimeStamp[ts_pos] -= ticks_per_sample;
-										dm->sampleCount[ts_pos]--;
-										smps++;
-									}
+									uint32_t trimmed = samples2store - smps;
+
+									currts += (uint64_t)ticks_per_sample * trimmed;
+									dm->deltaTimeStamp[ts_pos] -= ticks_per_sample * trimmed;
+									dm->sampleCount[ts_pos] -= (uint16_t)trimmed;
 								}
 
 								if (currts > dm->firstTimeStamp)
@@ -3337,8 +4909,8 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 								
 								if(ts_pos>0 && dm->payloadTimeStampCount>=ts_pos)
 								{
-									memcpy(&dm->deltaTimeStamp[0], &dm->deltaTimeStamp[ts_pos], sizeof(dm->deltaTimeStamp[0])*(dm->payloadTimeStampCount - ts_pos));
-									memcpy(&dm->sampleCount[0], &dm->sampleCount[ts_pos], sizeof(dm->sampleCount[0])*(dm->payloadTimeStampCount - ts_pos));
+									memmove(&dm->deltaTimeStamp[0], &dm->deltaTimeStamp[ts_pos], sizeof(dm->deltaTimeStamp[0])*(dm->payloadTimeStampCount - ts_pos));
+									memmove(&dm->sampleCount[0], &dm->sampleCount[ts_pos], sizeof(dm->sampleCount[0])*(dm->payloadTimeStampCount - ts_pos));
 									dm->payloadTimeStampCount -= ts_pos;
 								}
 								ts_pos = dm->payloadTimeStampCount;
@@ -3348,6 +4920,7 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 									dm->sampleCount[ts_pos] = 0;
 									ts_pos++;
 								}
+								TimeIndexUpdate(dm, 0);
 
 								dm->payload_curr_size = SeekEndGPMF(dm->payload_buffer, dm->payload_alloc_size);
 							}
@@ -3421,12 +4994,34 @@ uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint
 			break;
 		}
 	}
+#if PARALLEL_COMPRESSION_THREADS
+	if (precompressed)
+		ReleaseCompressPool(ws->pool);
+#endif
 	Unlock(&ws->metadata_device_list[channel]);
 
+	if (prioritize && deferred_count)
+		*deferred_count = num_deferred;
+
 	return GPMF_ERROR_OK;
 }
 
 
+uint32_t GPMFWriteGetPayloadAndSession(	size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size,
+										uint32_t **payload, uint32_t *payloadsize,
+										uint32_t **session, uint32_t *sessionsize, int session_reduction,
+										uint64_t latestTimeStamp)
+{
+	return GetPayloadAndSession(ws_handle, channel, buffer, buffer_size, payload, payloadsize, session, sessionsize, session_reduction, latestTimeStamp, 0, NULL, NULL);
+}
+
+uint32_t GPMFWriteGetPayloadPriority(size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size, uint32_t **payload, uint32_t *size, uint64_t latestTimeStamp,
+	size_t *deferred_streams, uint32_t *deferred_count)
+{
+	if (buffer == NULL) return GPMF_ERROR_MEMORY;
+
+	return GetPayloadAndSession(ws_handle, channel, buffer, buffer_size, payload, size, NULL, NULL, 0, latestTimeStamp, 1, deferred_streams, deferred_count);
+}
 
 uint32_t GPMFWriteGetPayload(size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size, uint32_t **payload, uint32_t *size)
 {
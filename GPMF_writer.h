@@ -55,6 +55,16 @@ typedef enum
 #define FLOAT_PRECISION float
 //#define FLOAT_PRECISION double
 
+typedef struct GPMFStreamStats	// compression statistics for a QUAN stream, see GPMFWriteGetStreamStats()
+{
+	uint64_t raw_bytes;			// uncompressed bytes passed to the compressor
+	uint64_t stored_bytes;		// bytes stored for them, compressed or not
+	uint32_t blocks;			// KLVs passed to the compressor
+	uint32_t fallbacks;			// KLVs stored uncompressed, as compression did not make them smaller
+	uint32_t escape_codes;		// deltas outside the codebook, stored as escape plus a full word
+	uint32_t zero_runs;			// runs of zero deltas coded
+} GPMFStreamStats;
+
 typedef struct device_metadata
 {
 	struct device_metadata *next;
@@ -82,12 +92,20 @@ typedef struct device_metadata
 	char complex_type[256]; // Maximum structure size for a sample is 255 bytes.
 	uint32_t deltaTimeStamp[MAX_TIMESTAMPS];
 	uint16_t sampleCount[MAX_TIMESTAMPS];
+	uint64_t indexTimeStamp[MAX_TIMESTAMPS+1]; // time index: offset from firstTimeStamp to the first sample of each timestamp entry
+	uint32_t indexSample[MAX_TIMESTAMPS+1];	   // time index: samples stored before each timestamp entry
 	uint64_t firstTimeStamp;
 	uint64_t lastTimeStamp;
 	uint32_t payloadTimeStampCount;
 	uint32_t quantize;
 	uint32_t groupedFourCC;
 	uint32_t sessionTSMPs;
+	uint32_t priority;		// higher values are stored first by GPMFWriteGetPayloadPriority()
+	uint32_t deferred;		// set when the last GPMFWriteGetPayloadPriority() left this stream's samples buffered
+	uint32_t coding;		// optional QUAN codings: adaptive Rice, full width delta and float XOR, see GPMFWriteStreamSetAdaptiveCompression()
+	uint32_t block_samples;	// QUAN streams compress each completed block of this many samples at store time, see GPMFWriteStreamSetBlockCompression()
+
+	GPMFStreamStats stats;
 } device_metadata;
 
 #define GPMF_STICKY_PAYLOAD_SIZE			256	// can be increased if need
@@ -157,6 +175,20 @@ void GPMFWriteServiceClose(size_t ws_handle);
 uint32_t GPMFWriteSetScratchBuffer(size_t ws_handle, uint32_t *buffer, uint32_t buffer_size);
 
 
+/* GPMFWriteSetCompressionThreads
+*
+* Optional:  Compress the QUAN streams of each payload on up to threads threads, the calling thread included, 
+* rather than one after another while the payload is assembled.  The output is the same.  Helps when several 
+* compressed streams are extracted together.  Ignored on platforms without worker threads.
+*
+* @param[in] ws_handle returned by GPMFWriteServiceInit()
+* @param[in] threads 0 or 1 (the default) compresses on the calling thread.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteSetCompressionThreads(size_t ws_handle, uint32_t threads);
+
+
 /* GPMFWriteStreamOpen
 *
 * Open a new stream for a particular device, a device may have mulitple streams/sensors 
@@ -182,6 +214,94 @@ size_t GPMFWriteStreamOpen(
 );
 
 
+/* GPMFWriteStreamSetPriority
+*
+* Set the storage priority of a stream, used by GPMFWriteGetPayloadPriority() when the output buffer is too small for all streams.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[in] priority higher values are stored first, all streams default to zero.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteStreamSetPriority(size_t dm_handle, uint32_t priority);
+
+
+/* GPMFWriteStreamSetAdaptiveCompression
+*
+* For streams compressed with QUAN, measure each payload channel and store it with the smallest of the default 
+* Huffman delta coding or a Rice codebook with a delta or delta-of-delta predictor.  Payloads with Rice coded 
+* channels are typed GPMF_TYPE_COMPRESSED_ADAPTIVE rather than '#', requiring a parser that supports it.  The 
+* quantization is not changed.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[in] enable non-zero to enable, off by default.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteStreamSetAdaptiveCompression(size_t dm_handle, uint32_t enable);
+
+
+/* GPMFWriteStreamSetWideCompression
+*
+* For streams compressed with QUAN, delta code 'l','L','j' and 'J' samples at their full width as 
+* GPMF_TYPE_COMPRESSED_WIDE, rather than as two 16-bit channels for 32-bit types and uncompressed for 64-bit types.
+* Requires a parser with GPMF_TYPE_COMPRESSED_WIDE support.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[in] enable non-zero to enable, off by default.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteStreamSetWideCompression(size_t dm_handle, uint32_t enable);
+
+
+/* GPMFWriteStreamSetFloatCompression
+*
+* For streams compressed with QUAN, losslessly XOR code 'f' samples as GPMF_TYPE_COMPRESSED_FLOAT, which are 
+* otherwise stored uncompressed.  The quantization value is not used for these samples.  Requires a parser with 
+* GPMF_TYPE_COMPRESSED_FLOAT support.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[in] enable non-zero to enable, off by default.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteStreamSetFloatCompression(size_t dm_handle, uint32_t enable);
+
+
+/* GPMFWriteStreamSetBlockCompression
+*
+* For streams compressed with QUAN, compress every completed block of block_samples samples within the stream's 
+* buffer as it is stored, so the buffer_size given to GPMFWriteStreamOpen() holds several times more telemetry. 
+* A block is all the samples pending when a store reaches the next multiple of block_samples, so it holds at least 
+* block_samples samples, more when a store adds several at once or the previous attempt didn't compress smaller.
+* Payloads carry the stored blocks and the samples since as one GPMF_TYPE_COMPRESSED_SEGMENTS entry, which needs a
+* parser that supports it.  Applies to a stream's first non-sticky FourCC and not to grouped or sorted data.  A 
+* windowed payload ends on a block boundary within the stored blocks.  Session payloads can't scale stored blocks, 
+* they carry them and the samples after them at the full rate.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[in] block_samples samples per stored block, up to 65535, zero (the default) compresses only at extraction.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteStreamSetBlockCompression(size_t dm_handle, uint32_t block_samples);
+
+
+/* GPMFWriteGetStreamStats
+*
+* Compression statistics accumulated for a stream while storing blocks and extracting payloads, for tuning its QUAN value.
+* Session payloads aren't counted, they compress the same samples again.  Streams without QUAN report zeros.
+*
+* @param[in] dm_handle returned by GPMFWriteStreamOpen()
+* @param[out] stats for the stream, may be NULL when only resetting.
+* @param[in] reset non-zero to clear the counters after reading them.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteGetStreamStats(size_t dm_handle, GPMFStreamStats *stats, uint32_t reset);
+
+
 /* GPMFWriteStreamReset
 *
 * Reset stream for a particular device, clear any stale data from an earlier capture. 
@@ -377,6 +497,29 @@ uint32_t GPMFWriteGetPayloadWindow(size_t ws_handle, uint32_t channel, uint32_t
 uint32_t GPMFWriteFlushWindow(size_t ws_handle, uint32_t channel, uint64_t latestTimeStamp);
 
 
+/* GPMFWriteGetPayloadPriority
+*
+* Same as GPMFWriteGetPayloadWindow(), but if buffer_size is too small for all the data, the buffer is filled
+* with the highest priority streams (and their sticky data) and the remaining streams are left buffered for the next call.
+* Each stream is checked against the space left before it is copied, so the payload never exceeds buffer_size.  Fails 
+* with GPMF_ERROR_MEMORY only when the buffer can't hold the device headers.
+*
+* @param[in] ws_handle returned by GPMFWriteServiceInit()
+* @param[in] channel to indicate the type of metadata
+* @param[in] buffer externally allocated buffer where data will be copied to.*
+* @param[in] buffer_size the size of the buffer.*
+* @param[out] payload pointer to the payload (in this function, it will always point to the buffer passed in)
+* @param[out] size the size of returned payload
+* @param[in] latest TimeStamp to get, leave newer samples for a later request.
+* @param[out] deferred_streams optional array of dm_handles for the streams that were not stored.
+* @param[in,out] deferred_count in: number of entries in deferred_streams, out: number of streams deferred.
+*
+* @retval error code
+*/
+uint32_t GPMFWriteGetPayloadPriority(size_t ws_handle, uint32_t channel, uint32_t *buffer, uint32_t buffer_size, uint32_t **payload, uint32_t *size, uint64_t latestTimeStamp,
+	size_t *deferred_streams, uint32_t *deferred_count);
+
+
 /* GPMFWriteGetPayloadAndSession
 *
 * Called for each payload to be sent to the MP4 and/or Session File (with optional sampling reduction), returns pointers to pre-alloc'd memory and its sizes.
@@ -0,0 +1,104 @@
+/*! @file GPMF_bench_compress.c
+ *
+ *  @brief Throughput benchmark for the GPMF compressor, GPMFCompress() on a synthetic IMU payload
+ *
+ *  @version 1.0.0
+ *
+ *  (C) Copyright 2017 GoPro Inc (http://gopro.com/).
+ *
+ *  Licensed under either:
+ *  - Apache License, Version 2.0, http://www.apache.org/licenses/LICENSE-2.0  
+ *  - MIT license, http://opensource.org/licenses/MIT
+ *  at your option.
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../GPMF_common.h"
+#include "../GPMF_writer.h"
+#include "../GPMF_compress.h"
+
+#define BENCH_SAMPLES		4000
+#define BENCH_CHANNELS		3
+#define BENCH_ITERATIONS	2000
+
+
+static double Seconds(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char type = argc > 1 ? argv[1][0] : GPMF_TYPE_SIGNED_SHORT;		// b, B, s, S, l, L or f
+	uint32_t quantize = argc > 2 ? atoi(argv[2]) : 1;
+	uint32_t coding = argc > 3 ? atoi(argv[3]) : 0;		// mask of STREAM_CODING_* options
+	uint32_t bytes = (type == 's' || type == 'S') ? 2 : (type == 'l' || type == 'L' || type == 'f') ? 4 : 1;
+	uint32_t size = 8 + BENCH_SAMPLES * BENCH_CHANNELS * bytes;
+	uint32_t *src = (uint32_t *)malloc(size);
+	uint32_t *dst = (uint32_t *)malloc(size + 64);
+	uint8_t *data;
+	uint32_t i, c, k, out, hash = 2166136261u;
+	double begin, secs;
+
+	if (src == NULL || dst == NULL)
+	{
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	data = (uint8_t *)&src[2];
+	srand(7);
+	for (i = 0; i < BENCH_SAMPLES; i++)
+	{
+		for (c = 0; c < BENCH_CHANNELS; c++)
+		{
+			int32_t tri = (int32_t)((i * (c + 1) * 3) % 1200);
+			int32_t v = (tri < 600 ? tri : 1200 - tri) - 300 + rand() % 9 - 4;	// IMU like, a smooth wave plus noise
+			uint32_t w;
+			float f = (float)v * 0.01f;
+
+			if (type == 'f')
+				memcpy(&w, &f, sizeof(w));
+			else
+				w = (uint32_t)(bytes == 4 ? v * 100 : bytes == 1 ? v / 8 : v);
+
+			for (k = 0; k < bytes; k++)	// big endian, as stored in GPMF
+				data[(i * BENCH_CHANNELS + c) * bytes + k] = (uint8_t)(w >> (8 * (bytes - 1 - k)));
+		}
+	}
+
+	src[0] = STR2FOURCC("GYRO");
+	src[1] = GPMF_MAKE_TYPE_SIZE_COUNT(type, bytes * BENCH_CHANNELS, BENCH_SAMPLES);
+
+	// the output hash is for checking that a coder change leaves the bitstream unchanged
+	out = GPMFCompress(dst, src, size, quantize, coding, NULL);
+	for (i = 0; i < out; i++)
+		hash = (hash ^ ((uint8_t *)dst)[i]) * 16777619u;
+
+	begin = Seconds();
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+		out = GPMFCompress(dst, src, size, quantize, coding, NULL);
+	secs = Seconds() - begin;
+
+	printf("%c quant %d coding %d: in %d out %d hash %08x %.1f MB/s\n", type, quantize, coding, size, out, hash,
+		secs > 0.0 ? (double)size * BENCH_ITERATIONS / secs / 1e6 : 0.0);
+
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include "../GPMF_writer.h"
 #include "GPMF_parser.h"
 #include "GPMF_mp4writer.h"
+#include "GPMF_mp4reader.h"
 
 //#define REALTICK
 
@@ -66,16 +67,31 @@ int main(int argc, char *argv[])
 	size_t gpmfhandle = 0;
 	size_t mp4_handle = 0;
 	int32_t ret = GPMF_OK;
+	int fragment_ms = 0, async = 0, usage = argc < 2, arg;
 
-	if (argc != 2)
+	for (arg = 2; arg < argc; arg++)
 	{
-		printf("usage: %s <file_with_GPMF.MP4|MOV>\n", argv[0]);
+		if (0 == strcmp(argv[arg], "-async"))
+			async = 1;
+		else if (fragment_ms == 0 && atoi(argv[arg]) > 0)
+			fragment_ms = atoi(argv[arg]);
+		else
+			usage = 1;
+	}
+	if (usage)
+	{
+		printf("usage: %s <file_with_GPMF.MP4|MOV> [fragment_ms] [-async]\n", argv[0]);
 		return -1;
 	}
 
 	srand(0);
 
-	mp4_handle = OpenMP4Export(argv[1], 1000, 1001);
+	if (fragment_ms) // fragmented MP4, a moof+mdat every fragment_ms
+		mp4_handle = OpenMP4ExportFragmented(argv[1], 1000, 1001, 0, fragment_ms);
+	else
+		mp4_handle = OpenMP4Export(argv[1], 1000, 1001);
+	if (async)
+		ExportAsync(mp4_handle, 0); // the file writes leave the payload loop for an I/O thread
 
 	gpmfhandle = GPMFWriteServiceInit();
 	if (gpmfhandle && mp4_handle)
@@ -613,9 +629,43 @@ int main(int argc, char *argv[])
 		*/
 		}
 
+#if ENABLE_SNR_B && ENABLE_SNR_D
+		// Priority fill: when a burst is more than the payload buffer holds, the highest priority streams are 
+		// stored first and the rest stay buffered for the next call.
+		{
+			size_t deferred[4];
+			uint32_t deferred_count, calls = 0, small_size = 2560;
+			int16_t burst[350 * 3];
+			int32_t gps[100];
+
+			for (i = 0; i < 350 * 3; i++) burst[i] = (int16_t)i;
+			for (i = 0; i < 100; i++) gps[i] = (int32_t)i;
+
+			GPMFWriteStreamSetPriority(handleD, 1); // GPS before the gyro
+			GPMFWriteStreamStore(handleB, STR2FOURCC("GYRO"), GPMF_TYPE_SIGNED_SHORT, sizeof(int16_t) * 3, 350, burst, GPMF_FLAGS_NONE);
+			GPMFWriteStreamStore(handleD, STR2FOURCC("GPS5"), GPMF_TYPE_SIGNED_LONG, sizeof(int32_t), 100, gps, GPMF_FLAGS_NONE);
+
+			do
+			{
+				deferred_count = 4;
+				err = GPMFWriteGetPayloadPriority(gpmfhandle, GPMF_CHANNEL_TIMED, (uint32_t *)buffer, small_size, &payload, &payload_size, LARGESTTIMESTAMP, deferred, &deferred_count);
+				if (err == GPMF_OK)
+					printf("priority payload_size = %d of %d, %d streams deferred, %s\n", payload_size, small_size, deferred_count, 
+						GPMFWriteIsValidGPMF(payload, payload_size, 1) ? "valid" : "invalid");
+			} while (err == GPMF_OK && deferred_count && ++calls < 4);
+		}
+#endif
+
 	cleanup:
 
-		if (mp4_handle) CloseExport(mp4_handle); 
+		if (mp4_handle)
+		{
+			mp4exportstats stats;
+			GetExportStats(mp4_handle, &stats);
+			if (stats.queue_size)
+				printf("export queue peak %d of %d bytes, %d stalls, %d writes, slowest %dus\n", stats.queue_peak, stats.queue_size, stats.stalls, stats.writes, stats.write_us_max);
+			CloseExport(mp4_handle);
+		}
 #if ENABLE_SNR_A
 		if (handleA) GPMFWriteStreamClose(handleA);
 #endif
@@ -626,6 +676,26 @@ int main(int argc, char *argv[])
 		GPMFWriteServiceClose(gpmfhandle);
 	}
 
+	// Read the new file back through the mapped reader and validate each payload
+	if (ret == GPMF_OK)
+	{
+		size_t mp4 = OpenMP4Source(argv[1]);
+		if (mp4)
+		{
+			uint32_t i, valid = 0, count = GetNumberPayloads(mp4);
+			for (i = 0; i < count; i++)
+			{
+				GPMF_stream gs;
+				if (GPMF_OK == GPMF_Init(&gs, GetPayload(mp4, i), GetPayloadSize(mp4, i)) &&
+					GPMF_OK == GPMF_Validate(&gs, GPMF_RECURSE_LEVELS))
+					valid++;
+				ReleasePayload(mp4, i);
+			}
+			printf("%d of %d payloads valid\n", valid, count);
+			CloseSource(mp4);
+		}
+	}
+
 
 	return ret;
 }
@@ -29,17 +29,22 @@ extern "C" {
 
 
 
-uint32_t hdr_size=28;
-uint8_t hdr[] = {
+const uint32_t hdr_size=36;
+const uint8_t hdr[] = {
 0x00,0x00,0x00,0x14,0x66,0x74,0x79,0x70,0x71,0x74,0x20,0x20,0x00,0x00,0x02,
-0x00,0x71,0x74,0x20,0x20,0x00,0x00,0x00,0x08,0x6d,0x64,0x61,0x74
+0x00,0x71,0x74,0x20,0x20,0x00,0x00,0x00,0x08,0x77,0x69,0x64,0x65,0x00,0x00,
+0x00,0x08,0x6d,0x64,0x61,0x74
 };
 
-uint32_t mdat_byte_size_offsets = 20;
+const uint32_t mdat_byte_size_offsets = 28;
 //new mdat size = total_payload_size
 
-uint32_t moov_size = 590;
-uint8_t moov[] = {
+const uint32_t mdat_byte_largesize_offsets = 20;
+//over 4GB the 'wide' and mdat headers become one mdat with a 64-bit largesize, the payloads don't move
+
+/* read-only, each export patches its own copy */
+const uint32_t moov_size = 590;
+const uint8_t moov[] = {
 0x00,0x00,0x02,0x62,0x6d,0x6f,0x6f,0x76,0x00,0x00,0x00,0x6c,0x6d,0x76,0x68,
 0x64,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x52,0x41,
 0x54,0x45,0x44,0x52,0x54,0x4e,0x00,0x01,0x00,0x00,0x01,0x00,0x00,0x00,0x00,
@@ -83,39 +88,124 @@ uint8_t moov[] = {
 };
 
 /* these all increase by number of payload * 4 */
-uint32_t moov_size_offsets = 6;
-uint32_t moov_byte_size_offsets[] =
+const uint32_t moov_size_offsets = 6;
+const uint32_t moov_byte_size_offsets[] =
 {
 	0, 0x74, 0xd8, 0x12a, 0x1da, 0x23a
 };
 
-uint32_t moov_rate_offsets = 2;
-uint32_t moov_byte_rate_offsets[] =
+const uint32_t moov_rate_offsets = 2;
+const uint32_t moov_byte_rate_offsets[] =
 {
 	0x1c, 0xf4,	0x21a
 };
 
-uint32_t moov_duration_offsets = 3;
-uint32_t moov_byte_duration_offsets[] =
+const uint32_t moov_duration_offsets = 3;
+const uint32_t moov_byte_duration_offsets[] =
 {
 	0x20, 0x98, 0xf8
 };
 
 
-uint32_t moov_payload_count_offsets = 3;
-uint32_t moov_byte_payload_count_offsets[] =
+const uint32_t moov_payload_count_offsets = 1;
+const uint32_t moov_byte_payload_count_offsets[] =
+{
+	0x24a		// stsz, the stts and stsc entries are built at close
+};
+
+
+
+/* 32-bit times and durations that are 64-bit in version 1 of mvhd, tkhd and mdhd, each widens its boxes by 4 */
+const uint32_t moov_widen_offsets = 9;
+const uint32_t moov_byte_widen_offsets[] =
+{
+	0x14, 0x18, 0x20, 0x88, 0x8c, 0x98, 0xec, 0xf0, 0xf8
+};
+
+const uint32_t moov_version_box_offsets = 3;
+const uint32_t moov_byte_version_box_offsets[] =
 {
-	0x216, 0x232, 0x24a
+	0x08, 0x7c, 0xe0	// mvhd, tkhd and mdhd, their version byte follows the box header
 };
 
 
 
-uint32_t stco_size=20;
-uint8_t stco[] = {
+const uint32_t stco_size=20;
+const uint8_t stco[] = {
 0x00,0x00,0x00,0x14,0x73,0x74,0x63,0x6f,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-0x01,0x00,0x00,0x00,0x1c
+0x01,0x00,0x00,0x00,0x24
+};
+
+const uint32_t co64_size=24;	// in place of stco when a chunk starts beyond 4GB
+const uint8_t co64[] = {
+0x00,0x00,0x00,0x18,0x63,0x6f,0x36,0x34,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x24
+};
+
+const uint32_t chunk_table_header_size = 16;	// stco and co64 up to their entries, entry_count at 12
+
+
+/* Fragmented MP4, the moov above up to its sample tables, which are left empty, then mvex. Each fragment is
+   a moof holding the payload sizes followed by an mdat holding the payloads. The moov is written before the
+   duration is known, so its mvhd, tkhd and mdhd are always version 1. */
+const uint32_t ftyp_fragmented_size = 28;
+const uint8_t ftyp_fragmented[] = {
+0x00,0x00,0x00,0x1c,0x66,0x74,0x79,0x70,0x69,0x73,0x6f,0x6d,0x00,0x00,0x02,
+0x00,0x69,0x73,0x6f,0x6d,0x69,0x73,0x6f,0x36,0x6d,0x70,0x34,0x31
 };
 
+const uint32_t moov_sample_tables_offset = 0x206;	// stts, stsc and stsz to the end of the moov
+const uint32_t moov_fragmented_size_offsets = 5;		// moov, trak, mdia, minf and stbl from moov_byte_size_offsets[]
+
+const uint32_t sample_tables_empty_size = 68;
+const uint8_t sample_tables_empty[] = {
+0x00,0x00,0x00,0x10,0x73,0x74,0x74,0x73,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x10,0x73,0x74,0x73,0x63,0x00,0x00,0x00,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x00,0x14,0x73,0x74,0x73,0x7a,0x00,0x00,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x10,0x73,0x74,0x63,0x6f,
+0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
+};
+
+const uint32_t mvex_size = 60;
+const uint8_t mvex[] = {
+0x00,0x00,0x00,0x3c,0x6d,0x76,0x65,0x78,0x00,0x00,0x00,0x14,0x6d,0x65,0x68,
+0x64,0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+0x00,0x20,0x74,0x72,0x65,0x78,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x01,0x00,
+0x00,0x00,0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
+};
+
+const uint32_t mvex_byte_duration_offset = 20;		// mehd fragment_duration, 64-bit
+const uint32_t mvex_byte_payload_duration_offset = 48;	// trex default_sample_duration
+
+const uint32_t free_align_size = 10;	// after the moov, so the payloads in each mdat are 32-bit aligned
+const uint8_t free_align[] = {
+0x00,0x00,0x00,0x0a,0x66,0x72,0x65,0x65,0x00,0x00
+};
+
+
+const uint32_t moof_size = 88;	// increases by number of payloads * 4
+const uint8_t moof[] = {
+0x00,0x00,0x00,0x58,0x6d,0x6f,0x6f,0x66,0x00,0x00,0x00,0x10,0x6d,0x66,0x68,
+0x64,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x40,0x74,0x72,
+0x61,0x66,0x00,0x00,0x00,0x10,0x74,0x66,0x68,0x64,0x00,0x02,0x00,0x00,0x00,
+0x00,0x00,0x01,0x00,0x00,0x00,0x14,0x74,0x66,0x64,0x74,0x01,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x14,0x74,0x72,0x75,
+0x6e,0x00,0x00,0x02,0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
+};
+
+const uint32_t moof_size_offsets = 3;
+const uint32_t moof_byte_size_offsets[] =
+{
+	0, 0x18, 0x44		// moof, traf and trun
+};
+
+const uint32_t moof_byte_sequence_offset = 0x14;		// mfhd sequence_number
+const uint32_t moof_byte_decode_time_offset = 0x3c;	// tfdt baseMediaDecodeTime, 64-bit
+const uint32_t moof_byte_trun_flags_offset = 0x4c;	// sample-duration-present (0x100) adds a duration before each size
+const uint32_t moof_byte_payload_count_offset = 0x50;	// trun sample_count
+const uint32_t moof_byte_data_offset = 0x54;			// trun data_offset, from the start of the moof to the payloads
+
+
 
 
 
@@ -0,0 +1,507 @@
+/*! @file mp4reader.c
+*
+*  @brief Way-way Too Crude MP4|MOV reader (just to verify GPMF written to a MP4/MOV file)
+*
+*  @version 1.0.0
+*
+*  (C) Copyright 2019 GoPro Inc (http://gopro.com/).
+*
+*  Licensed under the Apache License, Version 2.0 (the "License");
+*  you may not use this file except in compliance with the License.
+*  You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+*
+*/
+
+/* The file is memory mapped and the sample tables of the GPMF track are read once into arrays, so a payload
+   is only a pointer into the map. Nothing is copied and only the pages of payloads in use become resident.
+   Fragmented files (moof+mdat) are indexed the same way from their track fragments. */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "GPMF_mp4reader.h"
+
+
+#define MP4_TYPE(a,b,c,d)	(((uint32_t)(a)<<24)|((uint32_t)(b)<<16)|((uint32_t)(c)<<8)|(uint32_t)(d))
+
+static uint32_t Read32(uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t Read64(uint8_t *p)
+{
+	return ((uint64_t)Read32(p) << 32) | Read32(p + 4);
+}
+
+
+// Steps over the box at *pos within [*pos, end), returns 0 at the end or on a size that doesn't fit
+static uint32_t NextBox(uint8_t *map, uint64_t *pos, uint64_t end, uint32_t *type, uint64_t *data, uint64_t *data_end)
+{
+	uint64_t start = *pos, size;
+
+	if (start + 8 > end)
+		return 0;
+
+	size = Read32(map + start);
+	*type = Read32(map + start + 4);
+	*data = start + 8;
+	if (size == 1) // 64-bit largesize
+	{
+		if (start + 16 > end)
+			return 0;
+		size = Read64(map + start + 8);
+		*data = start + 16;
+	}
+	else if (size == 0) // to the end of the enclosing box
+		size = end - start;
+
+	if (size < *data - start || size > end - start)
+		return 0;
+
+	*data_end = start + size;
+	*pos = start + size;
+	return 1;
+}
+
+static uint32_t FindBox(uint8_t *map, uint64_t start, uint64_t end, uint32_t type, uint64_t *data, uint64_t *data_end)
+{
+	uint64_t pos = start;
+	uint32_t boxtype;
+
+	while (NextBox(map, &pos, end, &boxtype, data, data_end))
+	{
+		if (boxtype == type)
+			return 1;
+	}
+	return 0;
+}
+
+// A full box's table of count entries, each entrysize bytes, starting at data + header
+static uint8_t *BoxTable(uint8_t *map, uint64_t data, uint64_t data_end, uint32_t header, uint32_t entrysize, uint32_t *count)
+{
+	if (data + header > data_end)
+		return NULL;
+
+	*count = Read32(map + data + header - 4);
+	if ((uint64_t)*count * entrysize > data_end - data - header)
+		return NULL;
+
+	return map + data + header;
+}
+
+// The per payload offsets, sizes and count + 1 times, sized in size_t so a huge count fails rather than wraps
+static uint32_t AllocIndex(mp4source *mp4, uint32_t count)
+{
+	size_t n = (size_t)count;
+
+	if (n >= SIZE_MAX / sizeof(uint64_t))
+		return 0;
+
+	mp4->offsets = (uint64_t *)malloc(n * sizeof(uint64_t));
+	mp4->sizes = (uint32_t *)malloc(n * sizeof(uint32_t));
+	mp4->times = (uint64_t *)malloc((n + 1) * sizeof(uint64_t));
+	return mp4->offsets != NULL && mp4->sizes != NULL && mp4->times != NULL;
+}
+
+// Fragmented files have empty sample tables, the samples are in each moof's track fragments (traf) instead. Every
+// moof in the file is walked, once to count the samples and once to fill the arrays. A moof or mdat cut short by a
+// crash ends the walk, so the payloads up to that point are still read.
+static uint32_t WalkFragments(mp4source *mp4, uint32_t track_id, uint32_t default_duration, uint32_t default_size, uint32_t fill)
+{
+	uint8_t *map = mp4->map;
+	uint64_t pos = 0, start, moof, moof_end, traf, traf_end, data, data_end, t = 0;
+	uint32_t type, n = 0;
+
+	for (start = pos; NextBox(map, &pos, mp4->filesize, &type, &moof, &moof_end); start = pos)
+	{
+		uint64_t tpos = moof;
+
+		if (type != MP4_TYPE('m','o','o','f'))
+			continue;
+
+		while (NextBox(map, &tpos, moof_end, &type, &traf, &traf_end))
+		{
+			uint64_t base = start, data_pos, o, rpos = traf;
+			uint32_t flags, duration = default_duration, size = default_size;
+
+			if (type != MP4_TYPE('t','r','a','f'))
+				continue;
+
+			if (!FindBox(map, traf, traf_end, MP4_TYPE('t','f','h','d'), &data, &data_end) || data + 8 > data_end ||
+				Read32(map + data + 4) != track_id)
+				continue;
+			flags = Read32(map + data) & 0xffffff;
+			o = data + 8;
+			if (flags & 0x1) { if (o + 8 > data_end) return n; base = Read64(map + o); o += 8; } // base_data_offset
+			if (flags & 0x2) o += 4; // sample_description_index
+			if (flags & 0x8) { if (o + 4 > data_end) return n; duration = Read32(map + o); o += 4; }
+			if (flags & 0x10) { if (o + 4 > data_end) return n; size = Read32(map + o); o += 4; }
+
+			if (FindBox(map, traf, traf_end, MP4_TYPE('t','f','d','t'), &data, &data_end) && data + 8 <= data_end)
+				t = map[data] == 1 && data + 12 <= data_end ? Read64(map + data + 4) : Read32(map + data + 4);
+
+			data_pos = base;
+			while (NextBox(map, &rpos, traf_end, &type, &data, &data_end))
+			{
+				uint32_t count, entry, s;
+
+				if (type != MP4_TYPE('t','r','u','n') || data + 8 > data_end)
+					continue;
+
+				flags = Read32(map + data) & 0xffffff;
+				count = Read32(map + data + 4);
+				o = data + 8;
+				if (flags & 0x1) // data_offset, signed, but one before the moof (or base_data_offset) isn't in its mdat
+				{
+					if (o + 4 > data_end || (int32_t)Read32(map + o) < 0)
+						return n;
+					data_pos = base + Read32(map + o);
+					o += 4;
+				}
+				if (flags & 0x4) o += 4; // first_sample_flags
+				entry = ((flags >> 8) & 1) * 4 + ((flags >> 9) & 1) * 4 + ((flags >> 10) & 1) * 4 + ((flags >> 11) & 1) * 4;
+				if (o > data_end || (uint64_t)count * entry > data_end - o)
+					return n;
+
+				for (s = 0; s < count; s++)
+				{
+					uint32_t d = duration, sz = size;
+
+					if (flags & 0x100) d = Read32(map + o), o += 4;
+					if (flags & 0x200) sz = Read32(map + o), o += 4;
+					o += ((flags >> 10) & 1) * 4 + ((flags >> 11) & 1) * 4; // sample flags and composition offset
+
+					if (data_pos > mp4->filesize || sz > mp4->filesize - data_pos) // written so a corrupt offset can't wrap
+						return n;
+					if (fill)
+					{
+						mp4->offsets[n] = data_pos;
+						mp4->sizes[n] = sz;
+						mp4->times[n] = t;
+						mp4->times[n + 1] = t + d;
+					}
+					data_pos += sz;
+					t += d;
+					n++;
+				}
+			}
+		}
+	}
+
+	return n;
+}
+
+static uint32_t IndexFragments(mp4source *mp4, uint64_t moov, uint64_t moov_end, uint64_t trak, uint64_t trak_end)
+{
+	uint8_t *map = mp4->map;
+	uint64_t mvex, mvex_end, data, data_end, pos;
+	uint32_t type, track_id, count, default_duration = 0, default_size = 0;
+
+	if (!FindBox(map, trak, trak_end, MP4_TYPE('t','k','h','d'), &data, &data_end) || data + 24 > data_end)
+		return 0;
+	track_id = Read32(map + data + (map[data] == 1 ? 20 : 12));
+
+	if (!FindBox(map, moov, moov_end, MP4_TYPE('m','v','e','x'), &mvex, &mvex_end))
+		return 0;
+	for (pos = mvex; NextBox(map, &pos, mvex_end, &type, &data, &data_end);)
+	{
+		if (type == MP4_TYPE('t','r','e','x') && data + 24 <= data_end && Read32(map + data + 4) == track_id)
+		{
+			default_duration = Read32(map + data + 12);
+			default_size = Read32(map + data + 16);
+		}
+	}
+
+	count = WalkFragments(mp4, track_id, default_duration, default_size, 0);
+	if (count == 0)
+		return 0;
+
+	if (!AllocIndex(mp4, count))
+		return 0;
+
+	mp4->times[0] = 0;
+	mp4->payload_count = WalkFragments(mp4, track_id, default_duration, default_size, 1);
+	return mp4->payload_count == count;
+}
+
+
+static uint32_t IndexTrack(mp4source *mp4, uint64_t moov, uint64_t moov_end, uint64_t trak, uint64_t trak_end)
+{
+	uint8_t *map = mp4->map;
+	uint64_t mdia, mdia_end, minf, minf_end, stbl, stbl_end, data, data_end;
+	uint8_t *stsz, *chunks, *stsc, *stts;
+	uint32_t fixed_size, count, chunk_count, stsc_count, stts_count, chunk_bytes = 4;
+	uint32_t i, e, sample;
+	uint64_t t;
+
+	if (!FindBox(map, trak, trak_end, MP4_TYPE('m','d','i','a'), &mdia, &mdia_end))
+		return 0;
+
+	if (!FindBox(map, mdia, mdia_end, MP4_TYPE('h','d','l','r'), &data, &data_end) || data + 12 > data_end ||
+		Read32(map + data + 8) != MP4_TYPE('m','e','t','a'))
+		return 0;
+
+	if (!FindBox(map, mdia, mdia_end, MP4_TYPE('m','d','h','d'), &data, &data_end))
+		return 0;
+	i = map[data] == 1 ? 20 : 12; // version 1 has 64-bit creation and modification times
+	if (data + i + 4 > data_end)
+		return 0;
+	mp4->timescale = Read32(map + data + i);
+
+	if (!FindBox(map, mdia, mdia_end, MP4_TYPE('m','i','n','f'), &minf, &minf_end) ||
+		!FindBox(map, minf, minf_end, MP4_TYPE('s','t','b','l'), &stbl, &stbl_end))
+		return 0;
+
+	if (!FindBox(map, stbl, stbl_end, MP4_TYPE('s','t','s','d'), &data, &data_end) || data + 16 > data_end ||
+		Read32(map + data + 12) != MP4_TYPE('g','p','m','d'))
+		return 0;
+
+	if (!FindBox(map, stbl, stbl_end, MP4_TYPE('s','t','s','z'), &data, &data_end) || data + 12 > data_end)
+		return 0;
+	fixed_size = Read32(map + data + 4);
+	stsz = BoxTable(map, data, data_end, 12, fixed_size ? 0 : 4, &count);
+	if (stsz == NULL)
+		return 0;
+	if (count == 0)
+		return IndexFragments(mp4, moov, moov_end, trak, trak_end);
+	if (fixed_size && count > mp4->filesize / fixed_size) // no table to bound it, but every sample is in the file
+		return 0;
+
+	if (FindBox(map, stbl, stbl_end, MP4_TYPE('c','o','6','4'), &data, &data_end))
+		chunk_bytes = 8;
+	else if (!FindBox(map, stbl, stbl_end, MP4_TYPE('s','t','c','o'), &data, &data_end))
+		return 0;
+	chunks = BoxTable(map, data, data_end, 8, chunk_bytes, &chunk_count);
+
+	if (!FindBox(map, stbl, stbl_end, MP4_TYPE('s','t','s','c'), &data, &data_end))
+		return 0;
+	stsc = BoxTable(map, data, data_end, 8, 12, &stsc_count);
+
+	if (!FindBox(map, stbl, stbl_end, MP4_TYPE('s','t','t','s'), &data, &data_end))
+		return 0;
+	stts = BoxTable(map, data, data_end, 8, 8, &stts_count);
+
+	if (chunks == NULL || stsc == NULL || stsc_count == 0 || stts == NULL)
+		return 0;
+
+	if (!AllocIndex(mp4, count))
+		return 0;
+
+	for (i = 0; i < count; i++)
+		mp4->sizes[i] = fixed_size ? fixed_size : Read32(stsz + i * 4);
+
+	// chunks hold runs of consecutive samples, stsc gives samples per chunk from each first_chunk (1 based) on
+	for (i = 0, e = 0, sample = 0; i < chunk_count && sample < count; i++)
+	{
+		uint64_t offset = chunk_bytes == 8 ? Read64(chunks + i * 8) : Read32(chunks + i * 4);
+		uint32_t s, samples_per_chunk;
+
+		while (e + 1 < stsc_count && Read32(stsc + (e + 1) * 12) <= i + 1)
+			e++;
+		samples_per_chunk = Read32(stsc + e * 12 + 4);
+
+		for (s = 0; s < samples_per_chunk && sample < count; s++, sample++)
+		{
+			if (offset > mp4->filesize || mp4->sizes[sample] > mp4->filesize - offset)
+				return 0;
+			mp4->offsets[sample] = offset;
+			offset += mp4->sizes[sample];
+		}
+	}
+	if (sample < count)
+		return 0;
+
+	for (e = 0, t = 0, sample = 0; e < stts_count && sample < count; e++)
+	{
+		uint32_t n = Read32(stts + e * 8), delta = Read32(stts + e * 8 + 4);
+
+		for (; n && sample < count; n--, sample++)
+		{
+			mp4->times[sample] = t;
+			t += delta;
+		}
+	}
+	for (; sample <= count; sample++) // stts short of the sample count, the rest have no duration
+		mp4->times[sample] = t;
+
+	mp4->payload_count = count;
+	return 1;
+}
+
+
+size_t OpenMP4Source(char *filename)
+{
+	mp4source *mp4 = (mp4source *)malloc(sizeof(mp4source));
+	uint64_t pos = 0, data, data_end, moov, moov_end;
+	uint32_t type, found = 0;
+
+	if (mp4 == NULL) return 0;
+
+	memset(mp4, 0, sizeof(mp4source));
+
+#ifdef _WINDOWS
+	mp4->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mp4->file != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER size;
+		if (GetFileSizeEx(mp4->file, &size) && size.QuadPart > 0)
+		{
+			mp4->filesize = (uint64_t)size.QuadPart;
+			mp4->mapping = CreateFileMappingA(mp4->file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mp4->mapping)
+				mp4->map = (uint8_t *)MapViewOfFile(mp4->mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+	}
+#else
+	mp4->fd = open(filename, O_RDONLY);
+	if (mp4->fd >= 0)
+	{
+		struct stat st;
+		if (fstat(mp4->fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size == (size_t)st.st_size)
+		{
+			void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, mp4->fd, 0);
+			mp4->filesize = (uint64_t)st.st_size;
+			if (map != MAP_FAILED)
+				mp4->map = (uint8_t *)map;
+		}
+	}
+#endif
+
+	if (mp4->map)
+	{
+		while (!found && NextBox(mp4->map, &pos, mp4->filesize, &type, &moov, &moov_end))
+		{
+			if (type == MP4_TYPE('m','o','o','v'))
+			{
+				uint64_t trak = moov;
+
+				while (!found && NextBox(mp4->map, &trak, moov_end, &type, &data, &data_end))
+				{
+					if (type == MP4_TYPE('t','r','a','k'))
+					{
+						found = IndexTrack(mp4, moov, moov_end, data, data_end);
+						if (!found)
+						{
+							if (mp4->offsets) free(mp4->offsets), mp4->offsets = NULL;
+							if (mp4->sizes) free(mp4->sizes), mp4->sizes = NULL;
+							if (mp4->times) free(mp4->times), mp4->times = NULL;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (!found)
+	{
+		CloseSource((size_t)mp4);
+		mp4 = NULL;
+	}
+
+	return (size_t)mp4;
+}
+
+
+
+uint32_t GetNumberPayloads(size_t handle)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL) return 0;
+
+	return mp4->payload_count;
+}
+
+
+uint32_t *GetPayload(size_t handle, uint32_t index)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL || index >= mp4->payload_count) return NULL;
+
+	return (uint32_t *)(mp4->map + mp4->offsets[index]);
+}
+
+
+uint32_t GetPayloadSize(size_t handle, uint32_t index)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL || index >= mp4->payload_count) return 0;
+
+	return mp4->sizes[index];
+}
+
+
+uint32_t GetPayloadTime(size_t handle, uint32_t index, double *in, double *out)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL || index >= mp4->payload_count || mp4->timescale == 0 || in == NULL || out == NULL) return 1;
+
+	*in = (double)mp4->times[index] / (double)mp4->timescale;
+	*out = (double)mp4->times[index + 1] / (double)mp4->timescale;
+	return 0;
+}
+
+
+void ReleasePayload(size_t handle, uint32_t index)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL || index >= mp4->payload_count || mp4->sizes[index] == 0) return;
+
+#ifdef _WINDOWS
+	// the pages aren't locked, so this only trims them from the working set
+	VirtualUnlock(mp4->map + mp4->offsets[index], mp4->sizes[index]);
+#else
+	{
+		uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+		uint64_t start = mp4->offsets[index] & ~(page - 1);
+		uint64_t end = (mp4->offsets[index] + mp4->sizes[index]) & ~(page - 1);
+
+		// The mapping is read-only and file backed, any page dropped here is simply read again if touched.
+		// The last partial page is left to the next payload, as dropping a page about to be touched again
+		// left the surrounding pages resident.
+		if (end > start)
+			madvise(mp4->map + start, (size_t)(end - start), MADV_DONTNEED);
+	}
+#endif
+}
+
+
+
+void CloseSource(size_t handle)
+{
+	mp4source *mp4 = (mp4source *)handle;
+	if (mp4 == NULL) return;
+
+#ifdef _WINDOWS
+	if (mp4->map) UnmapViewOfFile(mp4->map);
+	if (mp4->mapping) CloseHandle(mp4->mapping);
+	if (mp4->file != INVALID_HANDLE_VALUE && mp4->file) CloseHandle(mp4->file);
+#else
+	if (mp4->map) munmap(mp4->map, (size_t)mp4->filesize);
+	if (mp4->fd >= 0) close(mp4->fd);
+#endif
+
+	if (mp4->offsets) free(mp4->offsets), mp4->offsets = 0;
+	if (mp4->sizes) free(mp4->sizes), mp4->sizes = 0;
+	if (mp4->times) free(mp4->times), mp4->times = 0;
+
+	free(mp4);
+}
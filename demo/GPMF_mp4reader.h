@@ -0,0 +1,70 @@
+/*! @file GPMF_mp4reader.h
+*
+*  @brief Way-way Too Crude MP4|MOV reader, the GPMF track of a memory mapped file
+*
+*  @version 1.0.0
+*
+*  (C) Copyright 2019 GoPro Inc (http://gopro.com/).
+*
+*  Licensed under the Apache License, Version 2.0 (the "License");
+*  you may not use this file except in compliance with the License.
+*  You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+*
+*/
+
+#ifndef _GPMF_MP4READER_H
+#define _GPMF_MP4READER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WINDOWS
+#include <windows.h>
+#endif
+
+typedef struct mp4source
+{
+	uint8_t *map;				// the whole file, mapped read-only
+	uint64_t filesize;
+	uint32_t payload_count;
+	uint64_t *offsets;			// file offset of each payload, from stco/co64 and stsc
+	uint32_t *sizes;			// size of each payload in bytes, from stsz
+	uint64_t *times;			// start of each payload in timescale units, from stts, payload_count+1 entries
+	uint32_t timescale;			// from mdhd
+#ifdef _WINDOWS
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} mp4source;
+
+
+size_t OpenMP4Source(char *filename);													// maps the file and indexes the first 'meta' track with 'gpmd' samples, 0 on failure
+
+uint32_t GetNumberPayloads(size_t handle);
+
+uint32_t *GetPayload(size_t handle, uint32_t index);									// points into the mapped file (32-bit aligned when the chunk offsets are), valid until CloseSource()
+uint32_t GetPayloadSize(size_t handle, uint32_t index);
+uint32_t GetPayloadTime(size_t handle, uint32_t index, double *in, double *out);		// in seconds, returns 0 on success
+
+void ReleasePayload(size_t handle, uint32_t index);									// hint that the payload's pages can leave resident memory, the pointer stays valid
+
+void CloseSource(size_t handle);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,11 +27,285 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
+#ifdef _WINDOWS
+#include <io.h>
+#include <winioctl.h>
+#endif
+
+#include "../threadlock.h"
 #include "GPMF_mp4binaryheaders.h"
 #include "GPMF_mp4writer.h"
 
+#if defined(THREADLOCK_WORKERS)
+#define ASYNC_EXPORT		1		// ExportAsync() moves the payload writes to an I/O thread
+#else
+#define ASYNC_EXPORT		0
+#endif
+
+
+
+// big endian fields, byte at a time as some template offsets aren't 32-bit aligned
+static void Write32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)(value >> 24), p[1] = (uint8_t)(value >> 16), p[2] = (uint8_t)(value >> 8), p[3] = (uint8_t)value;
+}
+
+static uint32_t Read32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void Write64(uint8_t *p, uint64_t value)
+{
+	Write32(p, (uint32_t)(value >> 32));
+	Write32(p + 4, (uint32_t)value);
+}
+
+
+// where a template moov offset lands once version 1 has inserted a high half before each widened field
+static uint32_t Widened(uint32_t offset)
+{
+	uint32_t i, moved = offset;
+
+	for (i = 0; i < moov_widen_offsets; i++)
+		if (moov_byte_widen_offsets[i] <= offset)
+			moved += 4;
+
+	return moved;
+}
+
+// copies a moov laid out as the template with its mvhd, tkhd and mdhd made version 1, dst holds size + moov_widen_offsets*4
+static uint32_t WidenMoov(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+	uint32_t i, j, pos = 0, out = 0;
+	const uint32_t *boxes[2] = { moov_byte_version_box_offsets, moov_byte_size_offsets };
+	uint32_t box_count[2] = { moov_version_box_offsets, moov_size_offsets };
+
+	for (i = 0; i < moov_widen_offsets; i++)
+	{
+		uint32_t at = moov_byte_widen_offsets[i];
+		memcpy(dst + out, src + pos, at - pos);
+		out += at - pos, pos = at;
+		memset(dst + out, 0, 4), out += 4;
+	}
+	memcpy(dst + out, src + pos, size - pos);
+	out += size - pos;
 
+	for (i = 0; i < moov_version_box_offsets; i++)
+		dst[Widened(moov_byte_version_box_offsets[i]) + 8] = 1;
+
+	// the version 1 boxes and their containers grow by 4 for each widened field inside them
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < box_count[i]; j++)
+		{
+			uint32_t box = boxes[i][j], box_size = Read32(&src[box]), grow = 0, k;
+			for (k = 0; k < moov_widen_offsets; k++)
+				if (moov_byte_widen_offsets[k] > box && moov_byte_widen_offsets[k] < box + box_size)
+					grow += 4;
+			if (grow)
+				Write32(&dst[Widened(box)], box_size + grow);
+		}
+	}
+
+	return out;
+}
+
+
+#if ASYNC_EXPORT
+// A ring the calling thread fills and the I/O thread drains in as few fwrite()s as the wrap allows. The region between
+// written and queued belongs to the I/O thread, the rest to the caller, so neither copies under the other's feet.
+typedef struct mp4async
+{
+	LOCK lock;
+	CONDITION wake;				// for the I/O thread, bytes queued or closing
+	CONDITION room;				// for the caller, bytes written
+	WORKER worker;
+	FILE *fp;
+	uint8_t *queue;
+	uint64_t queued;			// bytes ever queued, the ring position is modulo stats.queue_size
+	uint64_t written;
+	uint64_t flush_at;			// fflush() once written reaches this, a fragment is complete
+	uint64_t flushed;			// flush_at of the last fflush(), also when AsyncFlush() came after the bytes were written
+	uint32_t closing;
+	mp4exportstats stats;
+} mp4async;
+
+static uint64_t Microseconds(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void AsyncWorker(void *arg)
+{
+	mp4async *async = (mp4async *)arg;
+
+	Lock(&async->lock);
+	for (;;)
+	{
+		uint32_t depth = (uint32_t)(async->queued - async->written);
+		uint32_t start = (uint32_t)(async->written % async->stats.queue_size);
+		uint64_t flush_at = async->flush_at;
+		uint32_t span, flush, done, us;
+		uint64_t begin;
+
+		if (depth == 0)
+		{
+			if (flush_at > async->flushed)
+			{
+				Unlock(&async->lock);
+				fflush(async->fp);
+				Lock(&async->lock);
+				async->flushed = flush_at;
+				continue;
+			}
+			if (async->closing)
+				break;
+			WaitCondition(&async->wake, &async->lock);
+			continue;
+		}
+
+		span = async->stats.queue_size - start;
+		if (span > depth) span = depth;
+		flush = flush_at > async->flushed && flush_at <= async->written + span;
+		Unlock(&async->lock);
+
+		begin = Microseconds();
+		done = (uint32_t)fwrite(async->queue + start, 1, span, async->fp);
+		if (flush)
+			fflush(async->fp);
+		us = (uint32_t)(Microseconds() - begin);
+
+		Lock(&async->lock);
+		async->written += span;
+		if (flush) async->flushed = flush_at;
+		async->stats.written += done;
+		async->stats.writes++;
+		async->stats.write_us_total += us;
+		if (us > async->stats.write_us_max) async->stats.write_us_max = us;
+		if (done != span) async->stats.errors++;
+		WakeAllCondition(&async->room);
+	}
+	Unlock(&async->lock);
+}
+
+static uint32_t AsyncWrite(mp4async *async, void *data, uint32_t size)
+{
+	uint8_t *src = (uint8_t *)data;
+	uint32_t remaining = size, stalled = 0;
+
+	Lock(&async->lock);
+	while (remaining && async->stats.errors == 0)
+	{
+		uint32_t depth = (uint32_t)(async->queued - async->written);
+		uint32_t start = (uint32_t)(async->queued % async->stats.queue_size);
+		uint32_t span = async->stats.queue_size - depth;
+
+		if (span == 0)
+		{
+			if (!stalled) async->stats.stalls++, stalled = 1;
+			WaitCondition(&async->room, &async->lock);
+			continue;
+		}
+		if (span > async->stats.queue_size - start) span = async->stats.queue_size - start;
+		if (span > remaining) span = remaining;
+
+		memcpy(async->queue + start, src, span);
+		src += span, remaining -= span;
+		async->queued += span;
+		if (depth + span > async->stats.queue_peak) async->stats.queue_peak = depth + span;
+		WakeAllCondition(&async->wake);
+	}
+	Unlock(&async->lock);
+
+	return remaining ? 0 : size;
+}
+
+static void AsyncFlush(mp4async *async)
+{
+	Lock(&async->lock);
+	async->flush_at = async->queued;
+	WakeAllCondition(&async->wake); // the bytes may already be written, with the I/O thread waiting
+	Unlock(&async->lock);
+}
+
+// drain-on-close, returns once everything queued is in the file and the I/O thread has gone
+static void StopAsync(mp4object *mp4)
+{
+	mp4async *async = mp4->async;
+
+	if (async == NULL) return;
+
+	Lock(&async->lock);
+	async->closing = 1;
+	WakeAllCondition(&async->wake);
+	Unlock(&async->lock);
+	JoinWorker(&async->worker);
+
+	DeleteCondition(&async->wake);
+	DeleteCondition(&async->room);
+	DeleteLock(&async->lock);
+	free(async->queue);
+	free(async);
+	mp4->async = NULL;
+}
+#endif
+
+// all payload and fragment bytes go through here, queued for the I/O thread after ExportAsync()
+static uint32_t WriteOut(mp4object *mp4, void *data, uint32_t size)
+{
+#if ASYNC_EXPORT
+	if (mp4->async)
+		return AsyncWrite(mp4->async, data, size);
+#endif
+	return (uint32_t)fwrite(data, 1, size, mp4->mediafp);
+}
+
+// leaves size bytes of the file unwritten, a hole once the file is sparse
+static uint32_t SkipOut(mp4object *mp4, uint32_t size)
+{
+#ifdef _WINDOWS
+	if (_fseeki64(mp4->mediafp, (__int64)size, SEEK_CUR) != 0)
+#else
+	if (fseeko(mp4->mediafp, (off_t)size, SEEK_CUR) != 0)
+#endif
+		return 0;
+	return size;
+}
+
+// NTFS only leaves holes in files marked sparse, other filesystems that support them do so for any file
+static uint32_t MakeSparse(mp4object *mp4)
+{
+#ifdef _WINDOWS
+	DWORD bytes;
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno(mp4->mediafp));
+
+	if (!mp4->sparse && file != INVALID_HANDLE_VALUE)
+	{
+		fflush(mp4->mediafp);
+		mp4->sparse = DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL) ? 1 : 0;
+	}
+#else
+	mp4->sparse = 1;
+#endif
+	return mp4->sparse;
+}
+
+static void FlushOut(mp4object *mp4)
+{
+#if ASYNC_EXPORT
+	if (mp4->async)
+	{
+		AsyncFlush(mp4->async);
+		return;
+	}
+#endif
+	fflush(mp4->mediafp);
+}
 
 
 size_t OpenMP4Export(char *filename, uint32_t file_time_base, uint32_t payload_duration)
@@ -49,31 +323,26 @@ size_t OpenMP4Export(char *filename, uint32_t file_time_base, uint32_t payload_d
 
 	mp4->metasizes = malloc(ALLOC_PAYLOADS*4);
 	mp4->metasize_alloc = ALLOC_PAYLOADS;
-	if (mp4->mediafp && mp4->metasizes)
+	mp4->moov = malloc(moov_size);
+	if (mp4->mediafp && mp4->metasizes && mp4->moov)
 	{
 		mp4->payload_duration = payload_duration;
+		mp4->time_base = file_time_base;
 
 		fwrite(hdr, 1, hdr_size, mp4->mediafp);
+		memcpy(mp4->moov, moov, moov_size);
 		for (uint32_t i = 0; i < moov_rate_offsets; i++)
-		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_rate_offsets[i]];
-			*lptr = BYTESWAP32(file_time_base);
-		}
+			Write32(&mp4->moov[moov_byte_rate_offsets[i]], file_time_base);
 		for (uint32_t i = 0; i < moov_duration_offsets; i++)
-		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_duration_offsets[i]];
-			*lptr = 0;
-		}
+			Write32(&mp4->moov[moov_byte_duration_offsets[i]], 0);
 		for (uint32_t i = 0; i < moov_payload_count_offsets; i++)
-		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_payload_count_offsets[i]];
-			*lptr = 0;
-		}
+			Write32(&mp4->moov[moov_byte_payload_count_offsets[i]], 0);
 	}
 	else
 	{
 		if (mp4->mediafp) fclose(mp4->mediafp);
 		if (mp4->metasizes) free(mp4->metasizes);
+		if (mp4->moov) free(mp4->moov);
 		free(mp4);
 		mp4 = NULL;
 	}
@@ -84,11 +353,330 @@ size_t OpenMP4Export(char *filename, uint32_t file_time_base, uint32_t payload_d
 
 
 
-uint32_t ExportPayload(size_t handle, uint32_t *payload, uint32_t payload_size)
+size_t OpenMP4ExportFragmented(char *filename, uint32_t file_time_base, uint32_t payload_duration, uint32_t fragment_payloads, uint32_t fragment_duration)
 {
-	mp4object *mp4 = (mp4object *)handle;
+	mp4object *mp4 = (mp4object *)malloc(sizeof(mp4object));
+	uint32_t size, stbl_change, i;
+	uint8_t *fmoov, *base;
+
 	if (mp4 == NULL) return 0;
 
+	memset(mp4, 0, sizeof(mp4object));
+
+	if (fragment_payloads == 0 && fragment_duration == 0)
+		fragment_payloads = 1;
+
+	// the template moov up to its sample tables, empty tables in their place, then mvex
+	size = moov_sample_tables_offset + sample_tables_empty_size + mvex_size;
+	stbl_change = (moov_size + stco_size) - (moov_sample_tables_offset + sample_tables_empty_size);
+
+	base = (uint8_t *)malloc(size);
+	mp4->fragmented_moov = fmoov = (uint8_t *)malloc(size + moov_widen_offsets * 4);
+	mp4->metasize_alloc = fragment_payloads ? fragment_payloads : ALLOC_PAYLOADS;
+	mp4->metasizes = malloc(mp4->metasize_alloc * 4);
+	mp4->durations = malloc(mp4->metasize_alloc * 4);
+
+#ifdef _WINDOWS
+	fopen_s(&mp4->mediafp, filename, "wb+");
+#else
+	mp4->mediafp = fopen(filename, "wb");
+#endif
+
+	if (mp4->mediafp && mp4->metasizes && mp4->durations && fmoov && base)
+	{
+		mp4->fragmented = 1;
+		mp4->payload_duration = payload_duration;
+		mp4->time_base = file_time_base;
+		mp4->fragment_payloads = fragment_payloads;
+		mp4->fragment_duration = fragment_duration;
+
+		memcpy(base, moov, moov_sample_tables_offset);
+		memcpy(base + moov_sample_tables_offset, sample_tables_empty, sample_tables_empty_size);
+		memcpy(base + moov_sample_tables_offset + sample_tables_empty_size, mvex, mvex_size);
+
+		for (i = 0; i < moov_fragmented_size_offsets; i++)
+			Write32(&base[moov_byte_size_offsets[i]], Read32(&base[moov_byte_size_offsets[i]]) - stbl_change);
+		Write32(&base[0], Read32(&base[0]) + mvex_size);
+
+		mp4->fragmented_moov_size = size = WidenMoov(fmoov, base, size);
+
+		for (i = 0; i < moov_rate_offsets; i++)
+			Write32(&fmoov[Widened(moov_byte_rate_offsets[i])], file_time_base);
+		for (i = 0; i < moov_duration_offsets; i++)
+			Write64(&fmoov[Widened(moov_byte_duration_offsets[i]) - 4], 0);
+		Write32(&fmoov[size - mvex_size + mvex_byte_payload_duration_offset], payload_duration);
+
+		// a crash leaves a file readable to its last complete fragment, the durations are only filled in at close
+		fwrite(ftyp_fragmented, 1, ftyp_fragmented_size, mp4->mediafp);
+		fwrite(fmoov, 1, size, mp4->mediafp);
+		fwrite(free_align, 1, free_align_size, mp4->mediafp);
+		fflush(mp4->mediafp);
+	}
+	else
+	{
+		if (mp4->mediafp) fclose(mp4->mediafp);
+		if (mp4->metasizes) free(mp4->metasizes);
+		if (mp4->durations) free(mp4->durations);
+		if (fmoov) free(fmoov);
+		free(mp4);
+		mp4 = NULL;
+	}
+	if (base) free(base);
+
+	return (size_t)mp4;
+}
+
+
+static uint32_t WriteFragment(mp4object *mp4)
+{
+	uint8_t header[128];
+	uint8_t mdat[8];
+	uint32_t i, ok = 1, entry = 4, *entries = mp4->metasizes;
+	uint32_t size;
+	uint64_t duration = 0;
+
+	if (mp4->fragment_count == 0)
+		return 1;
+
+	for (i = 0; i < mp4->fragment_count; i++)
+	{
+		duration += mp4->durations[i];
+		if (mp4->durations[i] != mp4->payload_duration)
+			entry = 8;
+	}
+	if (entry == 8) // the trex default doesn't fit every payload, so each trun entry is a duration and a size
+	{
+		entries = (uint32_t *)malloc(mp4->fragment_count * 8);
+		if (entries == NULL)
+			return 0;
+		for (i = 0; i < mp4->fragment_count; i++)
+			entries[i * 2] = BYTESWAP32(mp4->durations[i]), entries[i * 2 + 1] = mp4->metasizes[i];
+	}
+	size = moof_size + mp4->fragment_count * entry;
+
+	memcpy(header, moof, moof_size);
+	for (i = 0; i < moof_size_offsets; i++)
+		Write32(&header[moof_byte_size_offsets[i]], Read32(&header[moof_byte_size_offsets[i]]) + mp4->fragment_count * entry);
+	if (entry == 8)
+		Write32(&header[moof_byte_trun_flags_offset], Read32(&header[moof_byte_trun_flags_offset]) | 0x100);
+	Write32(&header[moof_byte_sequence_offset], ++mp4->sequence);
+	Write32(&header[moof_byte_decode_time_offset], (uint32_t)(mp4->decode_time >> 32));
+	Write32(&header[moof_byte_decode_time_offset + 4], (uint32_t)mp4->decode_time);
+	Write32(&header[moof_byte_payload_count_offset], mp4->fragment_count);
+	Write32(&header[moof_byte_data_offset], size + 8);
+
+	Write32(&mdat[0], mp4->fragment_size + 8);
+	Write32(&mdat[4], 0x6d646174); // "mdat"
+
+	if (moof_size != WriteOut(mp4, header, moof_size) ||
+		mp4->fragment_count * entry != WriteOut(mp4, entries, mp4->fragment_count * entry) ||
+		8 != WriteOut(mp4, mdat, 8) ||
+		mp4->fragment_size != WriteOut(mp4, mp4->fragment, mp4->fragment_size))
+		ok = 0;
+	FlushOut(mp4);
+	if (entries != mp4->metasizes)
+		free(entries);
+
+	mp4->decode_time += duration;
+	mp4->fragment_count = 0;
+	mp4->fragment_size = 0;
+
+	return ok;
+}
+
+
+static uint32_t ExportFragmentedPayload(mp4object *mp4, uint32_t *payload, uint32_t payload_size, uint64_t start, uint32_t duration)
+{
+	if (mp4->fragment_count + 1 > mp4->metasize_alloc)
+	{
+		uint32_t *sizes = realloc(mp4->metasizes, (mp4->metasize_alloc + ALLOC_PAYLOADS) * 4);
+		if (sizes == NULL) return 0;
+		mp4->metasizes = sizes;
+		sizes = realloc(mp4->durations, (mp4->metasize_alloc + ALLOC_PAYLOADS) * 4);
+		if (sizes == NULL) return 0;
+		mp4->durations = sizes;
+		mp4->metasize_alloc += ALLOC_PAYLOADS;
+	}
+	if (mp4->fragment_size + payload_size > mp4->fragment_alloc)
+	{
+		uint8_t *fragment = realloc(mp4->fragment, mp4->fragment_size + payload_size);
+		if (fragment == NULL) return 0;
+		mp4->fragment = fragment;
+		mp4->fragment_alloc = mp4->fragment_size + payload_size;
+	}
+
+	// the previous payload's duration is settled by this start while it's still in the fragment, otherwise a gap
+	// becomes a later tfdt and an overlap starts this payload where the last fragment ended
+	if (mp4->fragment_count)
+		mp4->durations[mp4->fragment_count - 1] = (uint32_t)(start - mp4->last_start);
+	else if (start < mp4->decode_time)
+		start = mp4->decode_time;
+	else
+		mp4->decode_time = start;
+
+	memcpy(mp4->fragment + mp4->fragment_size, payload, payload_size);
+	mp4->fragment_size += payload_size;
+	mp4->metasizes[mp4->fragment_count] = BYTESWAP32(payload_size);
+	mp4->durations[mp4->fragment_count] = duration;
+	mp4->fragment_count++;
+	mp4->metasize_count++;
+	mp4->last_start = start;
+	mp4->last_duration = duration;
+	mp4->total_duration = start + duration;
+	mp4->totalsize += payload_size;
+
+	if ((mp4->fragment_payloads && mp4->fragment_count >= mp4->fragment_payloads) ||
+		(mp4->fragment_duration && mp4->total_duration - mp4->decode_time >= mp4->fragment_duration))
+	{
+		if (!WriteFragment(mp4))
+			return 0;
+	}
+
+	return payload_size;
+}
+
+
+
+uint32_t ExportChunks(size_t handle, uint32_t chunk_payloads, uint32_t chunk_bytes)
+{
+	mp4object *mp4 = (mp4object *)handle;
+
+	if (mp4 == NULL || mp4->fragmented) return 0;
+
+	mp4->chunk_payloads = chunk_payloads;
+	mp4->chunk_bytes = chunk_bytes;
+	return 1;
+}
+
+uint32_t ExportAsync(size_t handle, uint32_t queue_size)
+{
+	mp4object *mp4 = (mp4object *)handle;
+#if ASYNC_EXPORT
+	mp4async *async;
+
+	if (mp4 == NULL || mp4->mediafp == NULL || mp4->async) return 0;
+	if (queue_size == 0) queue_size = EXPORT_QUEUE_SIZE;
+
+	async = (mp4async *)malloc(sizeof(mp4async));
+	if (async == NULL) return 0;
+	memset(async, 0, sizeof(mp4async));
+
+	async->queue = (uint8_t *)malloc(queue_size);
+	if (async->queue == NULL)
+	{
+		free(async);
+		return 0;
+	}
+	async->fp = mp4->mediafp;
+	async->stats.queue_size = queue_size;
+	fflush(mp4->mediafp); // the header is already buffered on this thread
+
+	CreateLock(&async->lock);
+	CreateCondition(&async->wake);
+	CreateCondition(&async->room);
+	if (THREAD_ERROR_OKAY != CreateWorker(&async->worker, AsyncWorker, async))
+	{
+		DeleteCondition(&async->wake);
+		DeleteCondition(&async->room);
+		DeleteLock(&async->lock);
+		free(async->queue);
+		free(async);
+		return 0;
+	}
+
+	mp4->async = async;
+	return 1;
+#else
+	(void)mp4, (void)queue_size;
+	return 0;
+#endif
+}
+
+void GetExportStats(size_t handle, mp4exportstats *stats)
+{
+	mp4object *mp4 = (mp4object *)handle;
+
+	if (stats == NULL) return;
+	memset(stats, 0, sizeof(mp4exportstats));
+
+#if ASYNC_EXPORT
+	if (mp4 && mp4->async)
+	{
+		Lock(&mp4->async->lock);
+		*stats = mp4->async->stats;
+		stats->queue_depth = (uint32_t)(mp4->async->queued - mp4->async->written);
+		Unlock(&mp4->async->lock);
+	}
+#else
+	(void)mp4;
+#endif
+}
+
+
+// appends to the run-length coded stts, a run of equal durations is a single entry
+static uint32_t AddDuration(mp4object *mp4, uint32_t duration)
+{
+	if (mp4->stts_count && mp4->stts[mp4->stts_count * 2 - 1] == duration)
+	{
+		mp4->stts[mp4->stts_count * 2 - 2]++;
+		return 1;
+	}
+	if (mp4->stts_count + 1 > mp4->stts_alloc)
+	{
+		uint32_t *stts = realloc(mp4->stts, (mp4->stts_alloc + ALLOC_PAYLOADS) * 8);
+		if (stts == NULL) return 0;
+		mp4->stts = stts;
+		mp4->stts_alloc += ALLOC_PAYLOADS;
+	}
+	mp4->stts[mp4->stts_count * 2] = 1;
+	mp4->stts[mp4->stts_count * 2 + 1] = duration;
+	mp4->stts_count++;
+	return 1;
+}
+
+// ends the open chunk, its stsc entry is only needed when it holds a different number of payloads to the last
+static uint32_t CloseChunk(mp4object *mp4)
+{
+	if (mp4->chunk_samples == 0)
+		return 1;
+
+	if (mp4->stsc_count == 0 || mp4->stsc[mp4->stsc_count * 2 - 1] != mp4->chunk_samples)
+	{
+		if (mp4->stsc_count + 1 > mp4->stsc_alloc)
+		{
+			uint32_t *stsc = realloc(mp4->stsc, (mp4->stsc_alloc + ALLOC_PAYLOADS) * 8);
+			if (stsc == NULL) return 0;
+			mp4->stsc = stsc;
+			mp4->stsc_alloc += ALLOC_PAYLOADS;
+		}
+		mp4->stsc[mp4->stsc_count * 2] = mp4->chunk_count;
+		mp4->stsc[mp4->stsc_count * 2 + 1] = mp4->chunk_samples;
+		mp4->stsc_count++;
+	}
+	mp4->chunk_samples = 0;
+	mp4->chunk_size = 0;
+	return 1;
+}
+
+static uint32_t OpenChunk(mp4object *mp4)
+{
+	if (mp4->chunk_count + 1 > mp4->chunk_alloc)
+	{
+		uint64_t *chunks = realloc(mp4->chunks, (mp4->chunk_alloc + ALLOC_PAYLOADS) * 8);
+		if (chunks == NULL) return 0;
+		mp4->chunks = chunks;
+		mp4->chunk_alloc += ALLOC_PAYLOADS;
+	}
+	mp4->chunks[mp4->chunk_count++] = hdr_size + mp4->totalsize; // the payloads are back to back in the one mdat
+	return 1;
+}
+
+// start and duration are in time base units, start is never before the last payload's
+static uint32_t ExportPayloadAt(mp4object *mp4, uint32_t *payload, uint32_t payload_size, uint64_t start, uint32_t duration)
+{
+	if (mp4->mediafp && mp4->fragmented)
+		return ExportFragmentedPayload(mp4, payload, payload_size, start, duration);
+
 	if (mp4->mediafp)
 	{
 		if (mp4->metasizes && mp4->metasize_count + 1 > mp4->metasize_alloc)
@@ -96,17 +684,77 @@ uint32_t ExportPayload(size_t handle, uint32_t *payload, uint32_t payload_size)
 			mp4->metasize_alloc += ALLOC_PAYLOADS;
 			mp4->metasizes = realloc(mp4->metasizes, mp4->metasize_alloc * 4);
 		}
+		if (mp4->metasize_count && !AddDuration(mp4, (uint32_t)(start - mp4->last_start)))
+			return 0;
+		if (mp4->chunk_samples == 0 && !OpenChunk(mp4))
+			return 0;
 		mp4->metasizes[mp4->metasize_count] = BYTESWAP32(payload_size);
 		mp4->metasize_count++;
-		mp4->total_duration += mp4->payload_duration;
+		mp4->last_start = start;
+		mp4->last_duration = duration;
+		mp4->total_duration = start + duration;
 		mp4->totalsize += payload_size;
+
+		mp4->chunk_samples++;
+		mp4->chunk_size += payload_size;
+		if ((mp4->chunk_payloads && mp4->chunk_samples >= mp4->chunk_payloads) ||
+			(mp4->chunk_bytes && mp4->chunk_size >= mp4->chunk_bytes))
+		{
+			if (!CloseChunk(mp4))
+				return 0;
+		}
 		
-		return (uint32_t)fwrite(payload, 1, payload_size, mp4->mediafp);
+		return payload ? WriteOut(mp4, payload, payload_size) : SkipOut(mp4, payload_size);
 	}
 
 	return 0;
 }
 
+uint32_t ExportPayload(size_t handle, uint32_t *payload, uint32_t payload_size)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return 0;
+
+	return ExportPayloadAt(mp4, payload, payload_size, mp4->total_duration, mp4->payload_duration);
+}
+
+uint32_t ExportPayloadReserved(size_t handle, uint32_t payload_size)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL || mp4->mediafp == NULL || mp4->fragmented) return 0;
+#if ASYNC_EXPORT
+	if (mp4->async) return 0; // the I/O thread owns the file position
+#endif
+	if (!MakeSparse(mp4)) return 0;
+
+	return ExportPayloadAt(mp4, NULL, payload_size, mp4->total_duration, mp4->payload_duration);
+}
+
+uint32_t ExportPayloadTimed(size_t handle, uint32_t *payload, uint32_t payload_size, uint64_t start_us, uint32_t duration_us)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	uint64_t start, end;
+	int64_t track_start;
+
+	if (mp4 == NULL || mp4->time_base == 0) return 0;
+
+	// rounding each end point rather than each duration keeps the track from drifting off the microsecond clock
+	start = start_us * mp4->time_base / 1000000;
+	end = (start_us + duration_us) * mp4->time_base / 1000000;
+
+	// the first timed payload starts where the track has got to, the rest keep their distance from it
+	if (!mp4->timed)
+	{
+		mp4->time_origin = (int64_t)start - (int64_t)mp4->total_duration;
+		mp4->timed = 1;
+	}
+	track_start = (int64_t)start - mp4->time_origin;
+	if (mp4->metasize_count && track_start < (int64_t)mp4->last_start)
+		track_start = (int64_t)mp4->last_start;
+
+	return ExportPayloadAt(mp4, payload, payload_size, (uint64_t)track_start, (uint32_t)(end - start));
+}
+
 
 
 void CloseExport(size_t handle)
@@ -114,39 +762,148 @@ void CloseExport(size_t handle)
 	mp4object *mp4 = (mp4object *)handle;
 	if (mp4 == NULL) return;
 
-	if (mp4->mediafp)
+	if (mp4->mediafp && mp4->fragmented)
 	{
+		uint8_t *fmoov = mp4->fragmented_moov;
+
+		WriteFragment(mp4);
+#if ASYNC_EXPORT
+		StopAsync(mp4);
+#endif
+
 		for (uint32_t i = 0; i < moov_duration_offsets; i++)
+			Write64(&fmoov[Widened(moov_byte_duration_offsets[i]) - 4], mp4->total_duration);
+		Write64(&fmoov[mp4->fragmented_moov_size - mvex_size + mvex_byte_duration_offset], mp4->total_duration);
+
+		fseek(mp4->mediafp, ftyp_fragmented_size, 0);
+		fwrite(fmoov, 1, mp4->fragmented_moov_size, mp4->mediafp);
+
+		fclose(mp4->mediafp);
+	}
+	else if (mp4->mediafp)
+	{
+		uint32_t stts_at = moov_sample_tables_offset, stts_size, stsc_size, size = moov_size;
+		uint32_t chunk_entry, chunk_size, i;
+		uint8_t stts[16], stsc[16], *chunks, *wide = NULL, *out = mp4->moov;
+
+#if ASYNC_EXPORT
+		StopAsync(mp4);
+#endif
+		if (mp4->metasize_count)
+			AddDuration(mp4, mp4->last_duration);
+		CloseChunk(mp4);
+
+		// the template's single entry stts and stsc are replaced by mp4->stts and mp4->stsc
+		stts_size = Read32(&out[stts_at]);
+		stsc_size = Read32(&out[stts_at + stts_size]);
+
+		// the chunk table only needs co64 when a chunk starts beyond 4GB
+		chunk_entry = mp4->chunk_count && mp4->chunks[mp4->chunk_count - 1] > 0xffffffff ? 8 : 4;
+		chunk_size = chunk_table_header_size + mp4->chunk_count * chunk_entry;
+		chunks = (uint8_t *)malloc(chunk_size);
+		if (chunks)
 		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_duration_offsets[i]];
-			*lptr = BYTESWAP32(mp4->total_duration);
+			memcpy(chunks, chunk_entry == 8 ? co64 : stco, chunk_table_header_size);
+			Write32(&chunks[0], chunk_size);
+			Write32(&chunks[12], mp4->chunk_count);
+			for (i = 0; i < mp4->chunk_count; i++)
+			{
+				if (chunk_entry == 8)
+					Write64(&chunks[chunk_table_header_size + i * 8], mp4->chunks[i]);
+				else
+					Write32(&chunks[chunk_table_header_size + i * 4], (uint32_t)mp4->chunks[i]);
+			}
 		}
-		for (uint32_t i = 0; i < moov_payload_count_offsets; i++)
+		else
+			chunk_size = 0;
+
+		for (i = 0; i < moov_duration_offsets; i++)
+			Write32(&out[moov_byte_duration_offsets[i]], (uint32_t)mp4->total_duration);
+		for (i = 0; i < moov_payload_count_offsets; i++)
+			Write32(&out[moov_byte_payload_count_offsets[i]], mp4->metasize_count);
+		for (i = 0; i < moov_size_offsets; i++)
 		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_payload_count_offsets[i]];
-			*lptr = BYTESWAP32(mp4->metasize_count);
+			uint32_t offset = Read32(&out[moov_byte_size_offsets[i]]) + mp4->metasize_count * 4;
+			if (moov_byte_size_offsets[i] < stts_at) // holds the stts, stsc and chunk table, not just the stsz
+				offset += mp4->stts_count * 8 + 16 - stts_size + mp4->stsc_count * 12 + 16 - stsc_size + chunk_size - stco_size;
+			Write32(&out[moov_byte_size_offsets[i]], offset);
 		}
-		for (uint32_t i = 0; i < moov_size_offsets; i++)
+
+		if (mp4->total_duration > 0xffffffff)
+			wide = (uint8_t *)malloc(moov_size + moov_widen_offsets * 4);
+		if (wide)
 		{
-			uint32_t *lptr = (uint32_t *)&moov[moov_byte_size_offsets[i]];
-			uint32_t offset = BYTESWAP32(*lptr) + mp4->metasize_count * 4;
-			*lptr = BYTESWAP32(offset);
+			size = WidenMoov(wide, out, moov_size);
+			for (i = 0; i < moov_duration_offsets; i++)
+				Write64(&wide[Widened(moov_byte_duration_offsets[i]) - 4], mp4->total_duration);
+			stts_at = Widened(stts_at);
+			out = wide;
 		}
 
-		fwrite(moov, 1, moov_size, mp4->mediafp);
+		Write32(&stts[0], mp4->stts_count * 8 + 16);
+		Write32(&stts[4], 0x73747473); // "stts"
+		Write32(&stts[8], 0);
+		Write32(&stts[12], mp4->stts_count);
+		for (i = 0; i < mp4->stts_count * 2; i++)
+			mp4->stts[i] = BYTESWAP32(mp4->stts[i]);
+
+		Write32(&stsc[0], mp4->stsc_count * 12 + 16);
+		Write32(&stsc[4], 0x73747363); // "stsc"
+		Write32(&stsc[8], 0);
+		Write32(&stsc[12], mp4->stsc_count);
+
+		fwrite(out, 1, stts_at, mp4->mediafp);
+		fwrite(stts, 1, 16, mp4->mediafp);
+		fwrite(mp4->stts, 1, mp4->stts_count * 8, mp4->mediafp);
+		fwrite(stsc, 1, 16, mp4->mediafp);
+		for (i = 0; i < mp4->stsc_count; i++)
+		{
+			uint8_t entry[12];
+			Write32(&entry[0], mp4->stsc[i * 2]);
+			Write32(&entry[4], mp4->stsc[i * 2 + 1]);
+			Write32(&entry[8], 1); // sample_description_index
+			fwrite(entry, 1, 12, mp4->mediafp);
+		}
+		fwrite(out + stts_at + stts_size + stsc_size, 1, size - stts_at - stts_size - stsc_size, mp4->mediafp);
+		if (wide) free(wide);
 		fwrite(mp4->metasizes, 1, mp4->metasize_count * 4, mp4->mediafp);
-		fwrite(stco, 1, stco_size, mp4->mediafp);
 
-		fseek(mp4->mediafp, mdat_byte_size_offsets, 0);
-		
-		uint32_t wtotal = mp4->totalsize + 8; // +8 mdat atom header size
-		wtotal = BYTESWAP32(wtotal);
-		fwrite(&wtotal, 1, 4, mp4->mediafp);
+		if (chunks)
+		{
+			fwrite(chunks, 1, chunk_size, mp4->mediafp);
+			free(chunks);
+		}
+
+		if (mp4->totalsize + 8 > 0xffffffff)
+		{
+			uint8_t largesize[16];
+
+			Write32(&largesize[0], 1);
+			Write32(&largesize[4], 0x6d646174); // "mdat"
+			Write64(&largesize[8], mp4->totalsize + 16); // +16 mdat atom header size with the largesize
+			fseek(mp4->mediafp, mdat_byte_largesize_offsets, 0);
+			fwrite(largesize, 1, 16, mp4->mediafp);
+		}
+		else
+		{
+			fseek(mp4->mediafp, mdat_byte_size_offsets, 0);
+
+			uint32_t wtotal = (uint32_t)mp4->totalsize + 8; // +8 mdat atom header size
+			wtotal = BYTESWAP32(wtotal);
+			fwrite(&wtotal, 1, 4, mp4->mediafp);
+		}
 
 		fclose(mp4->mediafp);
 	}
 
 	if (mp4->metasizes) free(mp4->metasizes), mp4->metasizes = 0;
+	if (mp4->stts) free(mp4->stts), mp4->stts = 0;
+	if (mp4->stsc) free(mp4->stsc), mp4->stsc = 0;
+	if (mp4->chunks) free(mp4->chunks), mp4->chunks = 0;
+	if (mp4->moov) free(mp4->moov), mp4->moov = 0;
+	if (mp4->durations) free(mp4->durations), mp4->durations = 0;
+	if (mp4->fragment) free(mp4->fragment), mp4->fragment = 0;
+	if (mp4->fragmented_moov) free(mp4->fragmented_moov), mp4->fragmented_moov = 0;
 
 	free(mp4);
 }
\ No newline at end of file
@@ -30,23 +30,81 @@ extern "C" {
 
 #define BYTESWAP32(a)			(((a&0xff)<<24)|((a&0xff00)<<8)|((a>>8)&0xff00)|((a>>24)&0xff))
 #define ALLOC_PAYLOADS			1024
+#define EXPORT_QUEUE_SIZE		(4<<20)		// default ExportAsync() queue in bytes
+
+typedef struct mp4exportstats
+{
+	uint32_t queue_size;		// bytes
+	uint32_t queue_depth;		// bytes waiting for the I/O thread
+	uint32_t queue_peak;		// the deepest queue_depth so far
+	uint32_t stalls;			// ExportPayload() calls that had to wait for room in the queue
+	uint32_t writes;			// fwrite()s by the I/O thread, each as much of the queue as is contiguous
+	uint32_t errors;			// short writes, ExportPayload() returns 0 once there are any
+	uint64_t written;			// bytes
+	uint64_t write_us_total;	// time in fwrite() and fflush()
+	uint32_t write_us_max;		// the slowest single write
+} mp4exportstats;
+
 typedef struct mp4object
 {
 	uint32_t *metasizes;
 	uint32_t metasize_alloc;
 	uint32_t metasize_count;
 	uint32_t payload_duration;
-	uint32_t total_duration;
-	uint32_t totalsize;
+	uint32_t time_base;
+	uint32_t *stts;					// classic output, sample_count and sample_delta pairs, equal durations run-length coded
+	uint32_t stts_count;
+	uint32_t stts_alloc;
+	uint64_t last_start;			// where the last payload starts in time base units, its duration is only settled by the next
+	uint32_t last_duration;
+	int64_t time_origin;			// start_us 0 in time base units minus the track time, set by the first ExportPayloadTimed()
+	uint32_t timed;
+	uint32_t chunk_payloads;		// classic output, payloads per chunk, with chunk_bytes 0 as well everything is one chunk
+	uint32_t chunk_bytes;			// bytes per chunk
+	uint64_t *chunks;				// file offset of each chunk
+	uint32_t chunk_count;
+	uint32_t chunk_alloc;
+	uint32_t chunk_samples;			// payloads in the open chunk
+	uint32_t chunk_size;
+	uint32_t *stsc;					// first_chunk and samples_per_chunk pairs, only where samples_per_chunk changes
+	uint32_t stsc_count;
+	uint32_t stsc_alloc;
+	uint64_t total_duration;		// in time base units, the mvhd, tkhd and mdhd become version 1 beyond 32-bits
+	uint64_t totalsize;				// the mdat gets a 64-bit largesize beyond 4GB
 	FILE *mediafp;
+	uint32_t sparse;				// holes left by ExportPayloadReserved() aren't written out, on Windows the file has been marked sparse
+	uint8_t *moov;					// classic output, this export's copy of the moov template, patched at close
+
+	// fragmented output only, metasizes holds the sizes of the fragment being gathered
+	uint32_t fragmented;
+	uint32_t fragment_payloads;		// payloads per moof+mdat, 0 for no limit
+	uint32_t fragment_duration;		// time base units per moof+mdat, 0 for no limit
+	uint32_t fragment_count;		// payloads gathered for the next fragment
+	uint32_t fragment_size;			// bytes gathered in fragment
+	uint32_t fragment_alloc;
+	uint8_t *fragment;
+	uint32_t *durations;			// of each payload in the fragment, a trun only carries them when some differ from payload_duration
+	uint32_t sequence;				// mfhd sequence_number of the last fragment written
+	uint64_t decode_time;			// start of the next fragment in time base units
+	uint8_t *fragmented_moov;		// written after the ftyp, rewritten with the durations at close
+	uint32_t fragmented_moov_size;
+
+	struct mp4async *async;			// the I/O thread and its queue after ExportAsync()
 } mp4object;
 
 
 size_t OpenMP4Export(char *filename, uint32_t file_time_base, uint32_t payload_duration);
+size_t OpenMP4ExportFragmented(char *filename, uint32_t file_time_base, uint32_t payload_duration, uint32_t fragment_payloads, uint32_t fragment_duration); // a moof+mdat every fragment_payloads or fragment_duration (time base units), whichever comes first
+
+uint32_t ExportChunks(size_t handle, uint32_t chunk_payloads, uint32_t chunk_bytes);		// classic output, a chunk every chunk_payloads or chunk_bytes, whichever comes first, returns 1 on success
+uint32_t ExportAsync(size_t handle, uint32_t queue_size);				// file writes move to an I/O thread fed by a queue of queue_size bytes (0 for EXPORT_QUEUE_SIZE), returns 1 on success
+void GetExportStats(size_t handle, mp4exportstats *stats);			// queue depth and write latency, all zero without ExportAsync()
 
 uint32_t ExportPayload(size_t handle, uint32_t *payload, uint32_t payload_size);
+uint32_t ExportPayloadTimed(size_t handle, uint32_t *payload, uint32_t payload_size, uint64_t start_us, uint32_t duration_us); // the payload's own timing, gaps and overlaps adjust the previous payload's duration
+uint32_t ExportPayloadReserved(size_t handle, uint32_t payload_size);	// classic output, a payload whose bytes are left as a hole in a sparse file, returns 0 after ExportAsync() or without sparse file support
 
-void CloseExport(size_t handle);
+void CloseExport(size_t handle);									// waits for the I/O thread to write everything queued
 
 
 
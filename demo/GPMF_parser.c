@@ -26,8 +26,18 @@
 
 #include "GPMF_parser.h"
 #include "../GPMF_bitstream.h"
+#include "../threadlock.h"
 
 
+#if _WINDOWS
+#include <windows.h>
+#define GPMF_LOAD_CODEBOOK(p)			((GPMF_codebook *)InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL))
+#define GPMF_PUBLISH_CODEBOOK(p, cb)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(cb), NULL) == NULL)
+#else
+#define GPMF_LOAD_CODEBOOK(p)			__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define GPMF_PUBLISH_CODEBOOK(p, cb)	__sync_bool_compare_and_swap((p), NULL, (cb))
+#endif
+
 #ifdef DBG
 #if _WINDOWS
 #define DBG_MSG printf
@@ -54,110 +64,52 @@ GPMF_ERR IsValidSize(GPMF_stream *ms, uint32_t size) // size is in longs not byt
 
 
 GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
+{
+	return GPMF_ValidateReport(ms, recurse, NULL);
+}
+
+
+GPMF_ERR GPMF_ValidateReport(GPMF_stream *ms, GPMF_LEVELS recurse, GPMF_validation *report)
 {
 	if (ms)
 	{
-		uint32_t currpos = ms->pos;
-		int32_t nestsize = (int32_t)ms->nest_size[ms->nest_level];
+		GPMF_validation local;
+		uint32_t flags = 0;
+		uint32_t nestsize = ms->nest_size[ms->nest_level];
+		GPMF_ERR ret;
+
+		if (report == NULL)
+			report = &local;
+
 		if (nestsize == 0 && ms->nest_level == 0)
 			nestsize = ms->buffer_size_longs;
-		
-		while (ms->pos+1 < ms->buffer_size_longs && nestsize > 0)
+		if (ms->pos >= ms->buffer_size_longs)
+			nestsize = 0;
+		else if (nestsize > ms->buffer_size_longs - ms->pos)
+			nestsize = ms->buffer_size_longs - ms->pos;
+
+		if (recurse == GPMF_RECURSE_LEVELS)
+			flags |= GPMF_VALIDATE_RECURSE;
+		if (ms->nest_level == 0)
 		{
-			uint32_t key = ms->buffer[ms->pos];
-
-			if (ms->nest_level == 0 && key != GPMF_KEY_DEVICE && ms->device_count == 0 && ms->pos == 0)
-			{
-				DBG_MSG("ERROR: uninitized -- GPMF_ERROR_BAD_STRUCTURE\n");
-				return GPMF_ERROR_BAD_STRUCTURE;
-			}
-
-			if (GPMF_VALID_FOURCC(key))
-			{
-				uint32_t type_size_repeat = ms->buffer[ms->pos + 1];
-				int32_t size = GPMF_DATA_SIZE(type_size_repeat) >> 2;
-				uint8_t type = GPMF_SAMPLE_TYPE(type_size_repeat);
-				if (size + 2 > nestsize)
-				{
-					DBG_MSG("ERROR: nest size too small within %c%c%c%c-- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-					return GPMF_ERROR_BAD_STRUCTURE;
-				}
-
-				if (!GPMF_VALID_FOURCC(key))
-				{
-					DBG_MSG("ERROR: invalid 4CC -- GPMF_ERROR_BAD_STRUCTURE\n");
-					return GPMF_ERROR_BAD_STRUCTURE;
-				}
-
-				if (type == GPMF_TYPE_NEST && recurse == GPMF_RECURSE_LEVELS)
-				{
-					uint32_t validnest;
-					ms->pos += 2;
-					ms->nest_level++;
-					if (ms->nest_level > GPMF_NEST_LIMIT)
-					{
-						DBG_MSG("ERROR: nest level within %c%c%c%c too deep -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-						return GPMF_ERROR_BAD_STRUCTURE;
-					}
-					ms->nest_size[ms->nest_level] = size;
-					validnest = GPMF_Validate(ms, recurse);
-					ms->nest_level--;
-					if (GPMF_OK != validnest)
-					{
-						DBG_MSG("ERROR: invalid nest within %c%c%c%c -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-						return GPMF_ERROR_BAD_STRUCTURE;
-					}
-					else
-					{
-						if (ms->nest_level == 0)
-							ms->device_count++;
-					}
-
-					ms->pos += size;
-					nestsize -= 2 + size;
+			flags |= GPMF_VALIDATE_TRAILING;
+			if (ms->pos == 0 && ms->device_count == 0)
+				flags |= GPMF_VALIDATE_DEVC_FIRST;
+		}
 
-					while (ms->pos < ms->buffer_size_longs && nestsize > 0 && ms->buffer[ms->pos] == GPMF_KEY_END)
-					{
-						ms->pos++;
-						nestsize--;
-					}
-				}
-				else
-				{
-					ms->pos += 2 + size;
-					nestsize -= 2 + size;
-				}
+		ret = GPMF_ValidateBuffer(&ms->buffer[ms->pos], nestsize, flags, report);
+		report->pos += ms->pos;
+		report->level += ms->nest_level;
 
-				if (ms->pos == ms->buffer_size_longs)
-				{
-					ms->pos = currpos;
-					return GPMF_OK;
-				}
-			}
-			else
-			{
-				if (key == GPMF_KEY_END)
-				{
-					do
-					{
-						ms->pos++;
-						nestsize--;
-					} while (ms->pos < ms->buffer_size_longs && nestsize > 0 && ms->buffer[ms->pos] == 0);
-				}
-				else if (ms->nest_level == 0 && ms->device_count > 0)
-				{
-					ms->pos = currpos;
-					return GPMF_OK;
-				}
-				else
-				{
-					DBG_MSG("ERROR: bad struct within %c%c%c%c -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-					return GPMF_ERROR_BAD_STRUCTURE;
-				}
-			}
+		if (ret != GPMF_OK)
+		{
+			DBG_MSG("ERROR: %c%c%c%c at %d within %c%c%c%c, reason %d -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(report->key), report->pos, PRINTF_4CC(report->nest_key), report->reason);
+			return GPMF_ERROR_BAD_STRUCTURE;
 		}
 
-		ms->pos = currpos;
+		if (recurse == GPMF_RECURSE_LEVELS && ms->nest_level == 0)
+			ms->device_count += report->devices;
+
 		return GPMF_OK;
 	}
 	else
@@ -248,9 +200,9 @@ GPMF_ERR GPMF_Next(GPMF_stream *ms, GPMF_LEVELS recurse)
 					ms->pos += 2;
 					ms->nest_size[ms->nest_level] -= size + 2;
 
-					ms->nest_level++;
-					if (ms->nest_level > GPMF_NEST_LIMIT)
+					if (ms->nest_level + 1 >= GPMF_NEST_LIMIT)
 						return GPMF_ERROR_BAD_STRUCTURE;
+					ms->nest_level++;
 
 					ms->nest_size[ms->nest_level] = size;
 				}
@@ -299,15 +251,20 @@ GPMF_ERR GPMF_Next(GPMF_stream *ms, GPMF_LEVELS recurse)
 					ms->nest_size[ms->nest_level]--;
 				}
 
+				if (ms->pos + 1 >= ms->buffer_size_longs) // padding ran to the end of a truncated buffer
+					return GPMF_ERROR_BUFFER_END;
+
 				key = ms->buffer[ms->pos];
 				if (!GPMF_VALID_FOURCC(key))
 					return GPMF_ERROR_BAD_STRUCTURE;
 
-				if (key == GPMF_KEY_DEVICE_ID)
+				if (key == GPMF_KEY_DEVICE_ID && ms->pos + 2 < ms->buffer_size_longs)
 					ms->device_id = BYTESWAP32(ms->buffer[ms->pos + 2]);
 				if (key == GPMF_KEY_DEVICE_NAME)
 				{
 					size = GPMF_DATA_SIZE(ms->buffer[ms->pos + 1]); // in bytes
+					if (size > (ms->buffer_size_longs - ms->pos - 2) * 4)
+						size = (ms->buffer_size_longs - ms->pos - 2) * 4;
 					if (size > sizeof(ms->device_name) - 1)
 						size = sizeof(ms->device_name) - 1;
 					memcpy(ms->device_name, &ms->buffer[ms->pos + 2], size);
@@ -532,6 +489,345 @@ GPMF_ERR GPMF_FindPrev(GPMF_stream *ms, uint32_t fourcc, GPMF_LEVELS recurse)
 }
 
 
+GPMF_ERR GPMF_BuildIndex(GPMF_stream *ms, GPMF_index *index)
+{
+	GPMF_stream walk;
+	uint32_t strm_pos = 0, name_pos = 0, scale_pos = 0, indexed = 0;
+
+	if (ms == NULL || index == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	index->count = 0;
+	GPMF_CopyState(ms, &walk);
+	GPMF_ResetState(&walk);
+
+	if (walk.buffer_size_longs < 2)
+		return GPMF_ERROR_BUFFER_END;
+
+	do
+	{
+		uint32_t key, typesize, size;
+
+		if (walk.pos + 1 >= walk.buffer_size_longs)
+			break;
+		key = walk.buffer[walk.pos];
+		typesize = walk.buffer[walk.pos + 1];
+		size = GPMF_DATA_SIZE(typesize) >> 2;
+
+		if (walk.nest_level == 0)
+		{
+			if (key == GPMF_KEY_DEVICE)
+				name_pos = 0;
+			else if (key == GPMF_KEY_DEVICE_NAME)
+				name_pos = walk.pos;
+			else if (key == GPMF_KEY_STREAM)
+				strm_pos = walk.pos, scale_pos = 0, indexed = 0;
+		}
+		else if (walk.nest_level == 1 && !indexed && strm_pos && walk.last_level_pos[0] == strm_pos)
+		{
+			// the same tests as GPMF_SeekToSamples(): a nest, a repeated key or the last KLV of the STRM
+			uint32_t last = (size + 2 == walk.nest_size[1]);
+			uint32_t samples = GPMF_SAMPLE_TYPE(typesize) == GPMF_TYPE_NEST ||
+				(last && GPMF_OK == GPMF_Reserved(key)) ||
+				(!last && size + 2 < walk.nest_size[1] && walk.buffer[walk.pos + size + 2] == key);
+
+			if (key == GPMF_KEY_SCALE)
+				scale_pos = walk.pos;
+
+			if (samples)
+			{
+				GPMF_index_entry *entry;
+
+				if (index->count >= GPMF_INDEX_STREAMS)
+					return GPMF_ERROR_MEMORY;
+
+				entry = &index->entry[index->count++];
+				entry->device_id = walk.device_id;
+				entry->fourcc = key;
+				entry->pos = walk.pos;
+				entry->strm_pos = strm_pos;
+				entry->devc_remaining = walk.nest_size[0];
+				entry->name_pos = name_pos;
+				entry->scale_pos = scale_pos;
+				entry->samples = GPMF_PayloadSampleCount(&walk);
+				entry->type = GPMF_SAMPLE_TYPE(typesize);
+				if (GPMF_IS_COMPRESSED(entry->type))
+					entry->type = GPMF_SAMPLE_TYPE(walk.buffer[walk.pos + 2]);
+				indexed = 1;
+			}
+		}
+	} while (GPMF_OK == GPMF_Next(&walk, GPMF_RECURSE_LEVELS));
+
+	return GPMF_OK;
+}
+
+
+GPMF_ERR GPMF_IndexSeek(GPMF_stream *ms, GPMF_index *index, uint32_t entry)
+{
+	if (ms && index && entry < index->count)
+	{
+		GPMF_index_entry *e = &index->entry[entry];
+		uint32_t strm_end;
+
+		if (e->strm_pos + 1 >= ms->buffer_size_longs || e->pos + 1 >= ms->buffer_size_longs)
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		strm_end = e->strm_pos + 2 + (GPMF_DATA_SIZE(ms->buffer[e->strm_pos + 1]) >> 2);
+		if (e->pos >= strm_end || strm_end > ms->buffer_size_longs)
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		// rebuild the state GPMF_Next() would have reached the KLV with
+		GPMF_ResetState(ms);
+		ms->pos = e->pos;
+		ms->nest_level = 1;
+		ms->last_level_pos[0] = e->strm_pos;
+		ms->nest_size[0] = e->devc_remaining;
+		ms->nest_size[1] = strm_end - e->pos;
+		ms->device_id = e->device_id;
+		if (e->name_pos)
+		{
+			uint32_t size = GPMF_DATA_SIZE(ms->buffer[e->name_pos + 1]); // in bytes
+			if (size > sizeof(ms->device_name) - 1)
+				size = sizeof(ms->device_name) - 1;
+			memcpy(ms->device_name, &ms->buffer[e->name_pos + 2], size);
+			ms->device_name[size] = 0;
+		}
+
+		return GPMF_OK;
+	}
+	return GPMF_ERROR_FIND;
+}
+
+
+GPMF_ERR GPMF_IndexLookup(GPMF_stream *ms, GPMF_index *index, uint32_t fourcc)
+{
+	if (ms && index)
+	{
+		uint32_t i;
+
+		for (i = 0; i < index->count; i++)
+			if (index->entry[i].fourcc == fourcc)
+				return GPMF_IndexSeek(ms, index, i);
+	}
+	return GPMF_ERROR_FIND;
+}
+
+
+#define PUSH_HEADER		0	// collecting the key and type-size-repeat
+#define PUSH_DATA		1
+#define PUSH_PADDING	2
+
+GPMF_ERR GPMF_PushInit(GPMF_push_parser *pp, GPMF_push_callback callback, void *user)
+{
+	if (pp == NULL || callback == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	memset(pp, 0, sizeof(GPMF_push_parser) - sizeof(pp->buffer));
+	pp->callback = callback;
+	pp->user = user;
+	pp->state = PUSH_HEADER;
+	return GPMF_OK;
+}
+
+static GPMF_ERR PushEvent(GPMF_push_parser *pp, uint32_t event, uint32_t key, uint32_t typesizerepeat, uint8_t *data, uint32_t bytes, uint32_t first_sample)
+{
+	GPMF_push_event ev;
+
+	ev.event = event;
+	ev.level = pp->level;
+	ev.key = key;
+	ev.typesizerepeat = typesizerepeat;
+	ev.data = data;
+	ev.bytes = bytes;
+	ev.first_sample = first_sample;
+
+	pp->error = pp->callback(pp->user, &ev);
+	return pp->error;
+}
+
+// Account for bytes taken from the stream against every open nest, which must hold them
+static GPMF_ERR PushConsume(GPMF_push_parser *pp, uint32_t bytes)
+{
+	uint32_t i;
+
+	if (pp->level && pp->nest_remaining[pp->level - 1] < bytes)
+		return pp->error = GPMF_ERROR_BAD_STRUCTURE;
+
+	for (i = 0; i < pp->level; i++)
+		pp->nest_remaining[i] -= bytes;
+	return GPMF_OK;
+}
+
+static GPMF_ERR PushCloseNests(GPMF_push_parser *pp)
+{
+	while (pp->level && pp->nest_remaining[pp->level - 1] == 0)
+	{
+		pp->level--;
+		if (GPMF_OK != PushEvent(pp, GPMF_PUSH_NEST_END, pp->nest_key[pp->level], 0, NULL, 0, 0))
+			return pp->error;
+	}
+	return GPMF_OK;
+}
+
+static GPMF_ERR PushHeader(GPMF_push_parser *pp)
+{
+	uint32_t padded;
+
+	memcpy(&pp->key, &pp->buffer[0], 4);
+	memcpy(&pp->typesizerepeat, &pp->buffer[4], 4);
+	pp->buffered = 0;
+
+	if (!GPMF_VALID_FOURCC(pp->key))
+		return pp->error = GPMF_ERROR_BAD_STRUCTURE;
+
+	padded = GPMF_DATA_SIZE(pp->typesizerepeat);
+	if (pp->level && pp->nest_remaining[pp->level - 1] < padded)
+		return pp->error = GPMF_ERROR_BAD_STRUCTURE;
+
+	if (GPMF_SAMPLE_TYPE(pp->typesizerepeat) == GPMF_TYPE_NEST)
+	{
+		if (pp->level >= GPMF_NEST_LIMIT)
+			return pp->error = GPMF_ERROR_BAD_STRUCTURE;
+
+		if (GPMF_OK != PushEvent(pp, GPMF_PUSH_NEST_BEGIN, pp->key, pp->typesizerepeat, NULL, 0, 0))
+			return pp->error;
+
+		pp->nest_key[pp->level] = pp->key;
+		pp->nest_remaining[pp->level] = padded;
+		pp->level++;
+		return PushCloseNests(pp); // an empty nest ends here
+	}
+
+	pp->data_remaining = GPMF_DATA_PACKEDSIZE(pp->typesizerepeat);
+	pp->pad_remaining = padded - pp->data_remaining;
+	pp->sample_index = 0;
+	pp->whole = pp->data_remaining <= GPMF_PUSH_BUFFER_SIZE;
+	pp->state = pp->data_remaining ? PUSH_DATA : PUSH_PADDING;
+	return GPMF_OK;
+}
+
+GPMF_ERR GPMF_PushFeed(GPMF_push_parser *pp, void *bytes, uint32_t size)
+{
+	uint8_t *src = (uint8_t *)bytes;
+
+	if (pp == NULL || (src == NULL && size))
+		return GPMF_ERROR_MEMORY;
+
+	while (size && pp->error == GPMF_OK)
+	{
+		uint32_t n;
+
+		switch (pp->state)
+		{
+		case PUSH_HEADER:
+			n = 8 - pp->buffered;
+			if (n > size) n = size;
+			if (GPMF_OK != PushConsume(pp, n))
+				break;
+			memcpy(&pp->buffer[pp->buffered], src, n);
+			pp->buffered += n;
+			src += n, size -= n;
+
+			while (pp->buffered >= 4 && pp->buffer[0] == 0 && pp->buffer[1] == 0 && pp->buffer[2] == 0 && pp->buffer[3] == 0)
+			{
+				// null padding between KLVs, skipped as GPMF_Next() does
+				memmove(pp->buffer, &pp->buffer[4], pp->buffered - 4);
+				pp->buffered -= 4;
+				PushCloseNests(pp);
+			}
+			if (pp->buffered == 8 && pp->error == GPMF_OK)
+				PushHeader(pp);
+			break;
+
+		case PUSH_DATA:
+			if ((pp->whole && size < pp->data_remaining) || pp->buffered) // collect the KLV, or complete the sample straddling the last feed
+			{
+				uint32_t sample_size = GPMF_SAMPLE_SIZE(pp->typesizerepeat);
+				uint32_t target = pp->whole ? GPMF_DATA_PACKEDSIZE(pp->typesizerepeat) : sample_size;
+
+				n = target - pp->buffered;
+				if (n > size) n = size;
+				if (GPMF_OK != PushConsume(pp, n))
+					break;
+				memcpy(&pp->buffer[pp->buffered], src, n);
+				pp->buffered += n;
+				pp->data_remaining -= n;
+				src += n, size -= n;
+
+				if (pp->buffered == target)
+				{
+					pp->buffered = 0;
+					if (GPMF_OK != PushEvent(pp, GPMF_PUSH_SAMPLES, pp->key, pp->typesizerepeat, pp->buffer, target, pp->sample_index))
+						break;
+					pp->sample_index += target / sample_size;
+				}
+			}
+			else
+			{
+				uint32_t sample_size = GPMF_SAMPLE_SIZE(pp->typesizerepeat);
+
+				n = pp->data_remaining < size ? pp->data_remaining : size;
+				n -= n % sample_size;
+				if (n) // whole samples straight from the caller's bytes
+				{
+					if (GPMF_OK != PushConsume(pp, n))
+						break;
+					pp->data_remaining -= n;
+					src += n, size -= n;
+					if (GPMF_OK != PushEvent(pp, GPMF_PUSH_SAMPLES, pp->key, pp->typesizerepeat, src - n, n, pp->sample_index))
+						break;
+					pp->sample_index += n / sample_size;
+				}
+				else // the start of a sample that continues in the next feed
+				{
+					if (GPMF_OK != PushConsume(pp, size))
+						break;
+					memcpy(pp->buffer, src, size);
+					pp->buffered = size;
+					pp->data_remaining -= size;
+					src += size, size = 0;
+				}
+			}
+
+			if (pp->data_remaining == 0 && pp->buffered == 0)
+				pp->state = PUSH_PADDING;
+			break;
+
+		case PUSH_PADDING:
+			break;
+		}
+
+		if (pp->state == PUSH_PADDING && pp->error == GPMF_OK)
+		{
+			n = pp->pad_remaining < size ? pp->pad_remaining : size;
+			if (GPMF_OK != PushConsume(pp, n))
+				break;
+			pp->pad_remaining -= n;
+			src += n, size -= n;
+
+			if (pp->pad_remaining == 0)
+			{
+				pp->state = PUSH_HEADER;
+				if (GPMF_OK == PushEvent(pp, GPMF_PUSH_KLV_END, pp->key, pp->typesizerepeat, NULL, 0, pp->sample_index))
+					PushCloseNests(pp);
+			}
+		}
+	}
+
+	return pp->error;
+}
+
+GPMF_ERR GPMF_PushEnd(GPMF_push_parser *pp)
+{
+	if (pp == NULL)
+		return GPMF_ERROR_MEMORY;
+	if (pp->error)
+		return pp->error;
+	if (pp->state != PUSH_HEADER || pp->buffered || pp->level)
+		return GPMF_ERROR_BUFFER_END;
+	return GPMF_OK;
+}
+
 
 
 
@@ -551,7 +847,7 @@ GPMF_SampleType GPMF_Type(GPMF_stream *ms)
 	if (ms && ms->pos+1 < ms->buffer_size_longs)
 	{
 		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos+1]);
-		if (type == GPMF_TYPE_COMPRESSED && ms->pos+2 < ms->buffer_size_longs)
+		if (GPMF_IS_COMPRESSED(type) && ms->pos+2 < ms->buffer_size_longs)
 		{
 			type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 2]);
 		}
@@ -567,7 +863,7 @@ uint32_t GPMF_StructSize(GPMF_stream *ms)
 	{
 		uint32_t ssize = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
 		uint32_t type = GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
-		if (type == GPMF_TYPE_COMPRESSED && ms->pos+2 < ms->buffer_size_longs)
+		if (GPMF_IS_COMPRESSED(type) && ms->pos+2 < ms->buffer_size_longs)
 		{
 			ssize = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 2]);
 		}
@@ -584,7 +880,7 @@ uint32_t GPMF_ElementsInStruct(GPMF_stream *ms)
 		uint32_t ssize = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
 		GPMF_SampleType type = (GPMF_SampleType) GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
 
-		if (type != GPMF_TYPE_NEST && type != GPMF_TYPE_COMPLEX && type != GPMF_TYPE_COMPRESSED)
+		if (type != GPMF_TYPE_NEST && type != GPMF_TYPE_COMPLEX && !GPMF_IS_COMPRESSED(type))
 		{
 			int32_t tsize = GPMF_SizeofType(type);
 			if (tsize > 0)
@@ -608,7 +904,7 @@ uint32_t GPMF_ElementsInStruct(GPMF_stream *ms)
 					return tmpsize;
 			}
 		}
-		if (type == GPMF_TYPE_COMPRESSED && ms->pos+2 < ms->buffer_size_longs)
+		if (GPMF_IS_COMPRESSED(type) && ms->pos+2 < ms->buffer_size_longs)
 		{
 			type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 2]);
 			ssize = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 2]);
@@ -629,7 +925,7 @@ uint32_t GPMF_Repeat(GPMF_stream *ms)
 	{
 		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
 		uint32_t repeat = GPMF_SAMPLES(ms->buffer[ms->pos + 1]);
-		if(type == GPMF_TYPE_COMPRESSED && ms->pos+2 < ms->buffer_size_longs)
+		if(GPMF_IS_COMPRESSED(type) && ms->pos+2 < ms->buffer_size_longs)
 		{
 			repeat = GPMF_SAMPLES(ms->buffer[ms->pos + 2]);
 		}
@@ -657,7 +953,7 @@ uint32_t GPMF_FormattedDataSize(GPMF_stream *ms)
 		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
 		uint32_t size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1])*GPMF_SAMPLES(ms->buffer[ms->pos + 1]);
 
-		if (type == GPMF_TYPE_COMPRESSED && ms->pos+2 < ms->buffer_size_longs)
+		if (GPMF_IS_COMPRESSED(type) && ms->pos+2 < ms->buffer_size_longs)
 		{
 			size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 2])*GPMF_SAMPLES(ms->buffer[ms->pos + 2]);
 		}
@@ -865,7 +1161,7 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 		if (GPMF_OK != IsValidSize(ms, remaining_sample_size>>2))
 			return GPMF_ERROR_BAD_STRUCTURE;
 
-		if (type == GPMF_TYPE_COMPRESSED)
+		if (GPMF_IS_COMPRESSED(type))
 		{
 			if (GPMF_OK == GPMF_Decompress(ms, (uint32_t *)output, buffersize))
 			{
@@ -975,8 +1271,9 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 				{
 					uint32_t *data32 = (uint32_t *)data;
 					uint32_t *output32 = (uint32_t *)output;
-					*(output32+1) = BYTESWAP32(*data32);
-					*(output32) = BYTESWAP32(*(data32+1));
+					uint32_t hi = data32[0], lo = data32[1]; // data and output are the same buffer for decompressed samples
+					*(output32+1) = BYTESWAP32(hi);
+					*(output32) = BYTESWAP32(lo);
 					data32 += 2;
 					output32 += 2;
 
@@ -1068,6 +1365,106 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 	data = (uint8_t *)datatemp;							\
 }
 
+#define MACRO_SCALE_BLOCK(swap, inputcast, tempcast, outputcast, divisor)	\
+{														\
+	tempcast *in = (tempcast *)data;					\
+	outputcast *out = (outputcast *)output;				\
+	for (i = 0; i < count; i++)							\
+	{													\
+		tempcast temp = swap(in[i]);					\
+		inputcast val;									\
+		memcpy(&val, &temp, sizeof(val));				\
+		out[i] = (outputcast)val / divisor[i];			\
+	}													\
+}
+
+#define MACRO_SCALE_TO_FLOAT(swap, inputcast, tempcast)										\
+	if (outputType == GPMF_TYPE_FLOAT)	MACRO_SCALE_BLOCK(swap, inputcast, tempcast, float, fscale)		\
+	else								MACRO_SCALE_BLOCK(swap, inputcast, tempcast, double, dscale)
+
+#define MACRO_SCALE_TO_FLOAT_ENDIAN(swap, inputcast, tempcast)		\
+	if (noswap)	{ MACRO_SCALE_TO_FLOAT(NOSWAP8, inputcast, tempcast) }	\
+	else		{ MACRO_SCALE_TO_FLOAT(swap, inputcast, tempcast) }
+
+// Scaling whole samples of a single basic type to float or double, the common case for IMU and GPS data. The
+// per element scales are repeated to span a block of whole samples, so each block is one flat loop without the
+// type switches of the general path, which the compiler can vectorize. Division is kept so the results match
+// the general path exactly. Returns GPMF_ERROR_TYPE_NOT_SUPPORTED for anything else.
+static GPMF_ERR GPMF_ScaleToFloat(uint8_t *data, uint8_t *output, GPMF_SampleType type, uint32_t noswap, uint32_t elements, uint32_t samples,
+	uint8_t *scaledata8, uint8_t scaletype, uint32_t scalecount, GPMF_SampleType outputType)
+{
+	float fscale[256];
+	double dscale[256];
+	uint32_t block, count, i;
+	uint32_t remaining = elements * samples;
+	uint32_t typesize = GPMF_SizeofType(type);
+	uint32_t outputsize = GPMF_SizeofType(outputType);
+	uint32_t scaletypesize = GPMF_SizeofType((GPMF_SampleType)scaletype);
+
+	if (elements == 0 || elements > 256 || (scalecount > 1 && scalecount != elements))
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	if (outputType != GPMF_TYPE_FLOAT && outputType != GPMF_TYPE_DOUBLE)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+	switch (type)
+	{
+	case GPMF_TYPE_SIGNED_BYTE:
+	case GPMF_TYPE_UNSIGNED_BYTE:
+	case GPMF_TYPE_SIGNED_SHORT:
+	case GPMF_TYPE_UNSIGNED_SHORT:
+	case GPMF_TYPE_SIGNED_LONG:
+	case GPMF_TYPE_UNSIGNED_LONG:
+	case GPMF_TYPE_FLOAT:
+		break;
+	default:
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	}
+
+	block = elements * (256 / elements);
+	for (i = 0; i < block; i++)
+	{
+		uint8_t *scale = scaledata8 + (scalecount > 1 ? i % elements : 0) * scaletypesize;
+		double value;
+
+		switch (scaletype)
+		{
+		case GPMF_TYPE_SIGNED_BYTE:		value = *((int8_t *)scale);		break;
+		case GPMF_TYPE_UNSIGNED_BYTE:	value = *((uint8_t *)scale);	break;
+		case GPMF_TYPE_SIGNED_SHORT:	value = *((int16_t *)scale);	break;
+		case GPMF_TYPE_UNSIGNED_SHORT:	value = *((uint16_t *)scale);	break;
+		case GPMF_TYPE_SIGNED_LONG:		value = *((int32_t *)scale);	break;
+		case GPMF_TYPE_UNSIGNED_LONG:	value = *((uint32_t *)scale);	break;
+		case GPMF_TYPE_FLOAT:			value = *((float *)scale);		break;
+		default: return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
+		fscale[i] = (float)value; // exact, as each scale type converts to float with a single rounding
+		dscale[i] = value;
+	}
+
+	while (remaining)
+	{
+		count = remaining < block ? remaining : block;
+
+		switch (type)
+		{
+		case GPMF_TYPE_SIGNED_BYTE:		MACRO_SCALE_TO_FLOAT(NOSWAP8, int8_t, uint8_t) break;
+		case GPMF_TYPE_UNSIGNED_BYTE:	MACRO_SCALE_TO_FLOAT(NOSWAP8, uint8_t, uint8_t) break;
+		case GPMF_TYPE_SIGNED_SHORT:	MACRO_SCALE_TO_FLOAT_ENDIAN(BYTESWAP16, int16_t, uint16_t) break;
+		case GPMF_TYPE_UNSIGNED_SHORT:	MACRO_SCALE_TO_FLOAT_ENDIAN(BYTESWAP16, uint16_t, uint16_t) break;
+		case GPMF_TYPE_SIGNED_LONG:		MACRO_SCALE_TO_FLOAT_ENDIAN(BYTESWAP32, int32_t, uint32_t) break;
+		case GPMF_TYPE_UNSIGNED_LONG:	MACRO_SCALE_TO_FLOAT_ENDIAN(BYTESWAP32, uint32_t, uint32_t) break;
+		case GPMF_TYPE_FLOAT:			MACRO_SCALE_TO_FLOAT_ENDIAN(BYTESWAP32, float, uint32_t) break;
+		default: break;
+		}
+
+		data += count * typesize;
+		output += count * outputsize;
+		remaining -= count;
+	}
+
+	return GPMF_OK;
+}
+
 GPMF_ERR GPMF_ScaledData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
 {
 	if (ms && buffer)
@@ -1097,7 +1494,7 @@ GPMF_ERR GPMF_ScaledData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uin
 		if (type == GPMF_TYPE_NEST)
 			return GPMF_ERROR_MEMORY;
 
-		if (type == GPMF_TYPE_COMPRESSED)
+		if (GPMF_IS_COMPRESSED(type))
 		{
 			int neededunc = GPMF_FormattedDataSize(ms);
 			int samples = GPMF_Repeat(ms);
@@ -1242,6 +1639,10 @@ GPMF_ERR GPMF_ScaledData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uin
 			}
 		}
 
+		if (inputtypeelements == 1 && GPMF_OK == GPMF_ScaleToFloat(data, output, (GPMF_SampleType)complextype[0], noswap, elements, read_samples,
+			(uint8_t *)scaledata, scaletype, scalecount, outputType))
+			break;
+
 		while (read_samples--)
 		{
 			uint32_t i;
@@ -1311,42 +1712,695 @@ cleanup:
 
 
 
-GPMF_ERR GPMF_DecompressedSize(GPMF_stream *ms, uint32_t *neededsize)
+#define COLUMN_BLOCK_BYTES		4096	// interleaved samples scaled at a time by GPMF_ScaledColumns(), small enough to stay in L1
+
+#define MACRO_COLUMN_SCATTER(type) \
+{ \
+	type *src = (type *)scaled + element; \
+	type *dst = (type *)column; \
+	for (n = 0; n < samples; n++, src += elements) \
+		dst[n] = *src; \
+}
+
+// de-interleave one element of 'samples' scaled samples into its column
+static void ColumnScatter(uint8_t *scaled, uint8_t *column, uint32_t element, uint32_t elements, uint32_t samples, uint32_t typesize)
 {
-	if (ms && neededsize)
+	uint32_t n;
+
+	switch (typesize)
 	{
-		*neededsize = GPMF_DATA_SIZE(ms->buffer[ms->pos + 2]); // The first 32-bit of data, is the uncomresseded type-size-repeat
-		return GPMF_OK;
+	case 1: MACRO_COLUMN_SCATTER(uint8_t) break;
+	case 2: MACRO_COLUMN_SCATTER(uint16_t) break;
+	case 4: MACRO_COLUMN_SCATTER(uint32_t) break;
+	case 8: MACRO_COLUMN_SCATTER(uint64_t) break;
 	}
-	
-	return GPMF_ERROR_MEMORY;
 }
 
-
-GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+static GPMF_ERR ScaledColumnsAt(GPMF_stream *ms, void **columns, uint32_t column_count, uint32_t row, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type)
 {
-	if (ms && localbuf && localbuf_size)
-	{
-		if (ms->cbhandle == 0)
-			if (GPMF_OK != GPMF_AllocCodebook(&ms->cbhandle))
-				return GPMF_ERROR_MEMORY;
+	uint64_t block[COLUMN_BLOCK_BYTES / sizeof(uint64_t)];
+	uint8_t *scaled = (uint8_t *)block;
+	uint8_t *uncompressed = NULL;
+	uint32_t typesize = GPMF_SizeofType(type);
+	uint32_t elements, samples, stride, block_samples, done = 0, e;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (ms == NULL || columns == NULL)
+		return GPMF_ERROR_MEMORY;
+	if (typesize == 0)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	if (GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_NEST)
+		return GPMF_ERROR_MEMORY;
+
+	elements = GPMF_ElementsInStruct(ms);
+	samples = GPMF_Repeat(ms);
+	if (elements == 0 || column_count > elements || sample_offset > samples || read_samples > samples - sample_offset)
+		return GPMF_ERROR_MEMORY;
+	if (read_samples == 0)
+		return GPMF_OK;
+
+	stride = elements * typesize;
+	block_samples = sizeof(block) / stride;
+
+	// GPMF_ScaledData() decodes a compressed KLV whole on every call, so decode it once and take the samples from that
+	if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1])) || block_samples == 0)
+	{
+		uint32_t start = sample_offset, count = read_samples;
+
+		if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1])))
+			start = 0, count = samples;
+
+		uncompressed = (uint8_t *)malloc(count * stride);
+		if (uncompressed == NULL)
+			return GPMF_ERROR_MEMORY;
+
+		ret = GPMF_ScaledData(ms, uncompressed, count * stride, start, count, type);
+		scaled = uncompressed + (sample_offset - start) * stride;
+		block_samples = read_samples;
+	}
+
+	while (ret == GPMF_OK && done < read_samples)
+	{
+		uint32_t n = read_samples - done;
+		if (n > block_samples)
+			n = block_samples;
+
+		if (uncompressed == NULL)
+			ret = GPMF_ScaledData(ms, block, sizeof(block), sample_offset + done, n, type);
+		if (ret != GPMF_OK)
+			break;
+
+		for (e = 0; e < column_count; e++)
+		{
+			if (columns[e])
+				ColumnScatter(scaled, (uint8_t *)columns[e] + (size_t)(row + done) * typesize, e, elements, n, typesize);
+		}
+
+		if (uncompressed)
+			scaled += n * stride;
+		done += n;
+	}
+
+	if (uncompressed)
+		free(uncompressed);
+
+	return ret;
+}
+
+GPMF_ERR GPMF_ScaledColumns(GPMF_stream *ms, void **columns, uint32_t column_count, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type)
+{
+	return ScaledColumnsAt(ms, columns, column_count, 0, sample_offset, read_samples, type);
+}
+
+
+#if defined(THREADLOCK_WORKERS)
+#define EXTRACT_MAX_THREADS		32		// workers used by GPMF_ExtractPayloads(), besides the calling thread
+#else
+#define EXTRACT_MAX_THREADS		0
+#endif
+
+typedef struct extract_batch
+{
+	LOCK lock;
+	GPMF_extract_slot *slots;
+	uint32_t count;
+	uint32_t next;				// next slot to be taken by a thread
+	uint32_t fourcc;
+	GPMF_SampleType type;
+	uint32_t size_only;			// only fill in the slots
+	void **columns;				// GPMF_ExtractColumns() output, at each slot's row
+	uint32_t column_count;
+} extract_batch;
+
+static void ExtractSlot(GPMF_extract_slot *slot, extract_batch *batch)
+{
+	GPMF_stream gs, ts;
+	uint32_t fourcc = batch->fourcc;
+	GPMF_SampleType type = batch->type;
+
+	slot->needed = slot->samples = slot->elements = slot->total_samples = slot->stamped = 0;
+	slot->time_stamp = 0;
+
+	slot->error = GPMF_Init(&gs, slot->payload, slot->payload_size);
+	if (slot->error != GPMF_OK)
+		return;
+
+	if (GPMF_OK != GPMF_FindNext(&gs, fourcc, GPMF_RECURSE_LEVELS))
+	{
+		slot->error = GPMF_ERROR_FIND;
+		return;
+	}
+
+	GPMF_CopyState(&gs, &ts);
+	if (GPMF_OK == GPMF_FindPrev(&ts, GPMF_KEY_TOTAL_SAMPLES, GPMF_CURRENT_LEVEL) && GPMF_RawDataSize(&ts) >= 4)
+	{
+		uint32_t tsmp = *(uint32_t *)GPMF_RawData(&ts);
+		slot->total_samples = BYTESWAP32(tsmp);
+	}
+
+	GPMF_CopyState(&gs, &ts);
+	if (GPMF_OK == GPMF_FindPrev(&ts, GPMF_KEY_TIME_STAMP, GPMF_CURRENT_LEVEL) && GPMF_Type(&ts) == GPMF_TYPE_UNSIGNED_64BIT_INT &&
+		GPMF_OK == GPMF_FormattedData(&ts, &slot->time_stamp, sizeof(slot->time_stamp), 0, 1))
+		slot->stamped = 1;
+
+	slot->samples = GPMF_Repeat(&gs);
+	slot->elements = GPMF_ElementsInStruct(&gs);
+	if (type)
+		slot->needed = slot->samples * slot->elements * GPMF_SizeofType(type);
+	else
+		slot->needed = GPMF_FormattedDataSize(&gs);
+
+	if (batch->size_only || slot->samples == 0)
+		return;
+
+	if (batch->columns)
+		slot->error = ScaledColumnsAt(&gs, batch->columns, batch->column_count, slot->row, 0, slot->samples, type);
+	else if (slot->output == NULL)
+		return;
+	else if (slot->needed > slot->output_size)
+		slot->error = GPMF_ERROR_MEMORY;
+	else if (type)
+		slot->error = GPMF_ScaledData(&gs, slot->output, slot->output_size, 0, slot->samples, type);
+	else
+		slot->error = GPMF_FormattedData(&gs, slot->output, slot->output_size, 0, slot->samples);
+}
 
-		memset(localbuf, 0, localbuf_size); 
+static void ExtractWorker(void *arg)
+{
+	extract_batch *batch = (extract_batch *)arg;
+	uint32_t i;
+
+	for (;;)
+	{
+		Lock(&batch->lock);
+		i = batch->next < batch->count ? batch->next++ : batch->count;
+		Unlock(&batch->lock);
+
+		if (i == batch->count)
+			break;
+
+		ExtractSlot(&batch->slots[i], batch);
+	}
+}
+
+static GPMF_ERR ExtractBatch(extract_batch *batch, uint32_t threads)
+{
+	GPMF_ERR ret = GPMF_OK;
+	uint32_t i, next_sample = 0;
+#if EXTRACT_MAX_THREADS
+	WORKER workers[EXTRACT_MAX_THREADS];
+	uint32_t workercount = 0;
+#endif
+
+	batch->next = 0;
+	CreateLock(&batch->lock);
+
+#if EXTRACT_MAX_THREADS
+	// the calling thread is one of the threads, any worker that fails to start just leaves it more slots
+	while (workercount + 1 < threads && workercount < EXTRACT_MAX_THREADS && workercount + 1 < batch->count)
+	{
+		if (THREAD_ERROR_OKAY != CreateWorker(&workers[workercount], ExtractWorker, batch))
+			break;
+		workercount++;
+	}
+#else
+	(void)threads;
+#endif
+
+	ExtractWorker(batch);
+
+#if EXTRACT_MAX_THREADS
+	for (i = 0; i < workercount; i++)
+		JoinWorker(&workers[i]);
+#endif
+	DeleteLock(&batch->lock);
+
+	// Sample numbering runs across payloads, so it is settled here in payload order
+	for (i = 0; i < batch->count; i++)
+	{
+		GPMF_extract_slot *slot = &batch->slots[i];
+
+		if (slot->error != GPMF_OK && ret == GPMF_OK)
+			ret = slot->error;
+
+		if (slot->total_samples >= slot->samples && slot->total_samples)
+			slot->first_sample = slot->total_samples - slot->samples;
+		else
+			slot->first_sample = next_sample;
+		next_sample = slot->first_sample + slot->samples;
+	}
+
+	return ret;
+}
+
+GPMF_ERR GPMF_ExtractPayloads(GPMF_extract_slot *slots, uint32_t count, uint32_t fourCC, GPMF_SampleType type, uint32_t threads)
+{
+	extract_batch batch;
+
+	if (slots == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.slots = slots;
+	batch.count = count;
+	batch.fourcc = fourCC;
+	batch.type = type;
+
+	return ExtractBatch(&batch, threads);
+}
+
+// microseconds per sample from STMP anchor a to the next anchor with later samples, rate is unchanged if there is none
+static uint32_t ColumnRate(GPMF_extract_slot *slots, uint32_t count, uint32_t a, double *rate)
+{
+	uint32_t i;
+
+	for (i = a + 1; i < count; i++)
+	{
+		if (slots[i].stamped && slots[i].first_sample > slots[a].first_sample)
+		{
+			*rate = (double)(int64_t)(slots[i].time_stamp - slots[a].time_stamp) / (double)(slots[i].first_sample - slots[a].first_sample);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+GPMF_ERR GPMF_ExtractColumns(GPMF_extract_slot *slots, uint32_t count, uint32_t fourCC, GPMF_SampleType type, void **columns, uint32_t column_count,
+	double *timestamps, uint32_t capacity, uint32_t threads)
+{
+	extract_batch batch;
+	GPMF_ERR ret, sized;
+	uint32_t i, rows = 0;
+
+	if (slots == NULL)
+		return GPMF_ERROR_MEMORY;
+	if (GPMF_SizeofType(type) == 0)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.slots = slots;
+	batch.count = count;
+	batch.fourcc = fourCC;
+	batch.type = type;
+	batch.size_only = 1;
+
+	// rows follow payload order, so every payload's place is known before any are extracted
+	sized = ExtractBatch(&batch, threads);
+	for (i = 0; i < count; i++)
+	{
+		slots[i].row = rows;
+		rows += slots[i].samples;
+	}
+
+	if (columns == NULL && timestamps == NULL)
+		return sized;
+	if (rows > capacity)
+		return GPMF_ERROR_MEMORY;
+
+	ret = sized;
+	if (columns)
+	{
+		batch.size_only = 0;
+		batch.columns = columns;
+		batch.column_count = column_count;
+		ret = ExtractBatch(&batch, threads);
+	}
+
+	if (timestamps)
+	{
+		uint32_t a, j;
+		double rate = 0.0;
+
+		// sample times are linear between the STMPs, by the recording sample index from TSMP, and extrapolated past the ends
+		for (a = 0; a < count && !slots[a].stamped; a++);
+		if (a == count || !ColumnRate(slots, count, a, &rate))
+			return ret != GPMF_OK ? ret : GPMF_ERROR_FIND;
+
+		for (i = 0; i < count; i++)
+		{
+			GPMF_extract_slot *slot = &slots[i];
+			double base;
+
+			if (slot->stamped && i > a)
+			{
+				a = i;
+				ColumnRate(slots, count, a, &rate);
+			}
+
+			base = (double)slots[a].time_stamp + ((double)slot->first_sample - (double)slots[a].first_sample) * rate;
+			for (j = 0; j < slot->samples; j++)
+				timestamps[slot->row + j] = (base + j * rate) * 0.000001;
+		}
+	}
+
+	return ret;
+}
+
+
+GPMF_ERR GPMF_DecompressedSize(GPMF_stream *ms, uint32_t *neededsize)
+{
+	if (ms && neededsize)
+	{
+		*neededsize = GPMF_DATA_SIZE(ms->buffer[ms->pos + 2]); // The first 32-bit of data, is the uncomresseded type-size-repeat
+		return GPMF_OK;
+	}
+	
+	return GPMF_ERROR_MEMORY;
+}
+
+
+// Reads the big-endian 16-bit word bitstreams used by the float, wide and adaptive (Rice) coded channels
+typedef struct gpmf_bitreader
+{
+	uint16_t *compressed_data;	// next big-endian 16-bit word
+	uint16_t *compressed_end;
+	uint64_t buffer;			// bits read but not yet used, right justified
+	int bits;					// number of valid bits in buffer
+	int error;
+	int padding;				// zero bits appended past compressed_end by GPMF_FillBits
+} gpmf_bitreader;
+
+static uint32_t GPMF_GetBits(gpmf_bitreader *br, int n) // n <= 32
+{
+	while (br->bits < n)
+	{
+		if (br->compressed_data >= br->compressed_end)
+		{
+			br->error = 1;
+			return 0;
+		}
+		br->buffer = (br->buffer << 16) | BYTESWAP16(*br->compressed_data);
+		br->compressed_data++;
+		br->bits += 16;
+	}
+	br->bits -= n;
+	return (uint32_t)(br->buffer >> br->bits) & (uint32_t)(((uint64_t)1 << n) - 1);
+}
+
+static uint64_t GPMF_GetBits64(gpmf_bitreader *br, int n) // n <= 64
+{
+	uint64_t hi = 0;
+	if (n > 32)
+	{
+		hi = (uint64_t)GPMF_GetBits(br, n - 32) << 32;
+		n = 32;
+	}
+	return hi | GPMF_GetBits(br, n);
+}
+
+static void GPMF_InitBits(gpmf_bitreader *br, uint8_t *data, uint8_t *end)
+{
+	br->compressed_data = (uint16_t *)data;
+	br->compressed_end = (uint16_t *)end;
+	br->buffer = 0;
+	br->bits = 0;
+	br->error = 0;
+	br->padding = 0;
+}
+
+// Tops up the buffer with 32 bits at a time, so a 16-bit table lookup never has to refill. Past the end of the
+// data zeros are appended, GPMF_EndBits reports whether any of them were used.
+static void GPMF_FillBits(gpmf_bitreader *br)
+{
+	if (br->bits <= 32)
+	{
+		uint32_t word = 0;
+
+		if (br->compressed_data + 2 <= br->compressed_end)
+		{
+			memcpy(&word, br->compressed_data, 4);
+			word = BYTESWAP32(word);
+			br->compressed_data += 2;
+		}
+		else if (br->compressed_data < br->compressed_end)
+		{
+			word = (uint32_t)BYTESWAP16(*br->compressed_data) << 16;
+			br->compressed_data++;
+			br->padding += 16;
+		}
+		else
+			br->padding += 32;
+
+		br->buffer = (br->buffer << 32) | word;
+		br->bits += 32;
+	}
+}
+
+static uint32_t GPMF_PeekBits16(gpmf_bitreader *br) // call GPMF_FillBits first
+{
+	return (uint32_t)(br->buffer >> (br->bits - 16)) & 0xffff;
+}
+
+// Returns the offset of the next 16-bit word after the channel, bits left in the buffer belong to the next channel.
+static GPMF_ERR GPMF_EndBits(gpmf_bitreader *br, uint8_t *start, size_t *offset)
+{
+	if (br->error || br->padding > br->bits)
+		return GPMF_ERROR_BAD_STRUCTURE;
+
+	*offset = (size_t)((uint8_t *)(br->compressed_data - ((br->bits - br->padding) >> 4)) - start);
+	return GPMF_OK;
+}
+
+// XOR compressed floats: the first sample is stored as is, then per channel a 16-bit aligned stream of
+// '0' same value, '10'<bits> XOR within the previous window, '11'<5-bit leading zeros><5-bit length-1><bits> new window.
+static GPMF_ERR GPMF_DecompressFloat(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+{
+	uint32_t typesize = ms->buffer[ms->pos + 2];
+	uint32_t channels = GPMF_SAMPLE_SIZE(typesize) / 4;
+	uint32_t repeat = GPMF_SAMPLES(typesize);
+	uint32_t compressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+	uint8_t *start = (uint8_t *)&ms->buffer[ms->pos + 3];
+	uint8_t *end = (uint8_t *)&ms->buffer[ms->pos + 2] + compressed_size;
+	uint32_t chn, i;
+	gpmf_bitreader br;
+
+	if (GPMF_SAMPLE_TYPE(typesize) != GPMF_TYPE_FLOAT || channels == 0 || repeat == 0)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	if (GPMF_OK != IsValidSize(ms, compressed_size >> 2))
+		return GPMF_ERROR_BAD_STRUCTURE;
+	if (channels * repeat * 4 > localbuf_size || compressed_size < 4 + channels * 4)
+		return GPMF_ERROR_MEMORY;
+
+	memcpy(localbuf, start, channels * 4);
+	br.compressed_data = (uint16_t *)(start + channels * 4);
+	br.compressed_end = (uint16_t *)end;
+
+	for (chn = 0; chn < channels; chn++)
+	{
+		uint32_t last = BYTESWAP32(localbuf[chn]);
+		int lead = -1, trail = 0;
+
+		br.buffer = 0;
+		br.bits = 0;
+		br.error = 0;
+
+		for (i = 1; i < repeat; i++)
+		{
+			if (GPMF_GetBits(&br, 1))
+			{
+				int len;
+				if (GPMF_GetBits(&br, 1))
+				{
+					lead = GPMF_GetBits(&br, 5);
+					len = GPMF_GetBits(&br, 5) + 1;
+					if (lead + len > 32)
+						return GPMF_ERROR_BAD_STRUCTURE;
+					trail = 32 - lead - len;
+				}
+				else
+				{
+					if (lead < 0)
+						return GPMF_ERROR_BAD_STRUCTURE;
+					len = 32 - lead - trail;
+				}
+				last ^= (uint32_t)((uint64_t)GPMF_GetBits(&br, len) << trail);
+			}
+			if (br.error)
+				return GPMF_ERROR_BAD_STRUCTURE;
+
+			localbuf[i * channels + chn] = BYTESWAP32(last);
+		}
+		// the unused bits of the last word are padding, the next channel starts on the next 16-bit word
+	}
+
+	return GPMF_OK;
+}
+
+
+// Wide integer deltas: the first sample is stored as is, then per channel {32-bit quant}{8-bit predictor}{8-bit k} and
+// a 16-bit aligned stream of zigzag values, <q ones>'0'<k bits> for q < 16, else <16 ones><6-bit length-1><length bits>.
+static GPMF_ERR GPMF_DecompressWide(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+{
+	uint32_t typesize = ms->buffer[ms->pos + 2];
+	uint8_t type = GPMF_SAMPLE_TYPE(typesize);
+	uint32_t bytesize = (type == GPMF_TYPE_SIGNED_LONG || type == GPMF_TYPE_UNSIGNED_LONG) ? 4 : 8;
+	uint32_t channels = GPMF_SAMPLE_SIZE(typesize) / bytesize;
+	uint32_t repeat = GPMF_SAMPLES(typesize);
+	uint32_t compressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+	uint8_t *start = (uint8_t *)&ms->buffer[ms->pos + 3];
+	uint8_t *end = (uint8_t *)&ms->buffer[ms->pos + 2] + compressed_size;
+	uint8_t *out = (uint8_t *)localbuf;
+	uint8_t *ptr;
+	uint32_t chn, i, j;
+	gpmf_bitreader br;
+
+	if ((type != GPMF_TYPE_SIGNED_LONG && type != GPMF_TYPE_UNSIGNED_LONG && type != GPMF_TYPE_SIGNED_64BIT_INT && type != GPMF_TYPE_UNSIGNED_64BIT_INT) || 
+		channels == 0 || repeat == 0)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	if (GPMF_OK != IsValidSize(ms, compressed_size >> 2))
+		return GPMF_ERROR_BAD_STRUCTURE;
+	if (channels * repeat * bytesize > localbuf_size || compressed_size < 4 + channels * bytesize)
+		return GPMF_ERROR_MEMORY;
+
+	memcpy(out, start, channels * bytesize);
+	ptr = start + channels * bytesize;
+
+	for (chn = 0; chn < channels; chn++)
+	{
+		uint64_t last = 0, delta = 0;
+		uint32_t quant, predictor, k;
+
+		if (ptr + 6 > end)
+			return GPMF_ERROR_BAD_STRUCTURE;
+		quant = ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+		predictor = ptr[4];
+		k = ptr[5];
+		ptr += 6;
+		if (predictor > 1 || k >= bytesize * 8)
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		for (j = 0; j < bytesize; j++)
+			last = (last << 8) | out[chn * bytesize + j];
+
+		br.compressed_data = (uint16_t *)ptr;
+		br.compressed_end = (uint16_t *)end;
+		br.buffer = 0;
+		br.bits = 0;
+		br.error = 0;
+
+		for (i = 1; i < repeat; i++)
+		{
+			uint32_t q = 0;
+			uint64_t zigzag;
+			uint8_t *dst = &out[(i * channels + chn) * bytesize];
+
+			while (q < 16 && GPMF_GetBits(&br, 1))
+				q++;
+			if (q == 16)
+				zigzag = GPMF_GetBits64(&br, GPMF_GetBits(&br, 6) + 1);
+			else
+				zigzag = ((uint64_t)q << k) | GPMF_GetBits64(&br, k);
+			if (br.error)
+				return GPMF_ERROR_BAD_STRUCTURE;
+
+			if (predictor)
+				delta += (zigzag >> 1) ^ (0 - (zigzag & 1));
+			else
+				delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+			last += delta * quant;
+
+			for (j = 0; j < bytesize; j++)
+				dst[j] = (uint8_t)(last >> (8 * (bytesize - 1 - j)));
+		}
+		ptr = (uint8_t *)br.compressed_data; // the next channel starts on the next 16-bit word
+	}
+
+	return GPMF_OK;
+}
+
+
+// Blocks compressed within the writer's stream buffer: the total <type><size><rpt>, then each block's KLV without its
+// 4-CC, compressed or stored as is, decoded one after the other.
+static GPMF_ERR GPMF_DecompressSegments(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+{
+	uint32_t typesize = ms->buffer[ms->pos + 2];
+	uint32_t sample_size = GPMF_SAMPLE_SIZE(typesize);
+	uint32_t repeat = GPMF_SAMPLES(typesize);
+	uint32_t size_longs = GPMF_DATA_SIZE(ms->buffer[ms->pos + 1]) >> 2;
+	uint32_t pos = ms->pos + 3, end = ms->pos + 2 + size_longs;
+	uint32_t samples = 0;
+	uint8_t *output = (uint8_t *)localbuf;
+	GPMF_stream segment;
+
+	if (GPMF_OK != IsValidSize(ms, size_longs) || size_longs == 0)
+		return GPMF_ERROR_BAD_STRUCTURE;
+	if (sample_size * repeat > localbuf_size)
+		return GPMF_ERROR_MEMORY;
+
+	GPMF_CopyState(ms, &segment);
+	while (samples < repeat)
+	{
+		uint32_t segment_typesize, data_typesize, segment_longs, count;
+
+		if (pos + 1 >= end)
+			return GPMF_ERROR_BAD_STRUCTURE;
+		segment_typesize = ms->buffer[pos];
+		data_typesize = GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(segment_typesize)) ? ms->buffer[pos + 1] : segment_typesize;
+		segment_longs = 1 + (GPMF_DATA_SIZE(segment_typesize) >> 2);
+		count = GPMF_SAMPLES(data_typesize);
+
+		if (pos + segment_longs > end || GPMF_SAMPLE_TYPE(segment_typesize) == GPMF_TYPE_COMPRESSED_SEGMENTS || count == 0 ||
+			GPMF_SAMPLE_TYPE(data_typesize) != GPMF_SAMPLE_TYPE(typesize) || GPMF_SAMPLE_SIZE(data_typesize) != sample_size || 
+			samples + count > repeat)
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		if (GPMF_IS_COMPRESSED(GPMF_SAMPLE_TYPE(segment_typesize)))
+		{
+			GPMF_ERR ret;
+
+			segment.pos = pos - 1; // the decoders start from the type-size-repeat following a 4-CC
+			ret = GPMF_Decompress(&segment, (uint32_t *)(output + samples * sample_size), localbuf_size - samples * sample_size);
+			ms->cbhandle = segment.cbhandle; // a codebook allocated for the first Huffman segment is freed with ms
+			if (ret != GPMF_OK)
+				return ret;
+		}
+		else
+			memcpy(output + samples * sample_size, &ms->buffer[pos + 1], count * sample_size);
+
+		samples += count;
+		pos += segment_longs;
+	}
+
+	return GPMF_OK;
+}
+
+
+GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+{
+	if (ms && localbuf && localbuf_size && GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPRESSED_FLOAT)
+		return GPMF_DecompressFloat(ms, localbuf, localbuf_size);
+	if (ms && localbuf && localbuf_size && GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPRESSED_WIDE)
+		return GPMF_DecompressWide(ms, localbuf, localbuf_size);
+	if (ms && localbuf && localbuf_size && GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPRESSED_SEGMENTS)
+		return GPMF_DecompressSegments(ms, localbuf, localbuf_size);
+
+
+	if (ms && localbuf && localbuf_size)
+	{
+		if (ms->cbhandle == 0)
+			if (GPMF_OK != GPMF_AllocCodebook(&ms->cbhandle))
+				return GPMF_ERROR_MEMORY;
 
 		// unpack here
 		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 2]);// The first 32-bit of data, is the uncomresseded type-size-repeat
 		uint8_t *start = (uint8_t *)&ms->buffer[ms->pos + 3];
+		uint8_t *end_data = (uint8_t *)&ms->buffer[ms->pos + 2] + GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
 		uint16_t quant;
 		size_t sOffset = 0;
-		uint16_t *compressed_data;
 		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 2]);
 		uint32_t sizeoftype = GPMF_SizeofType(type);
-		uint32_t chn = 0, channels = sample_size / sizeoftype;
-		//uint32_t compressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+		uint32_t chn = 0, channels;
 		uint32_t uncompressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 2]);
-		uint32_t maxsamples = uncompressed_size / sample_size;
+		uint32_t maxsamples;
+		uint32_t adaptive = GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPRESSED_ADAPTIVE;
 		int signed_type = 1;
 
+		if (sample_size == 0 || sizeoftype == 0 || uncompressed_size > localbuf_size)
+			return GPMF_ERROR_MEMORY;
+
+		channels = sample_size / sizeoftype;
+		maxsamples = uncompressed_size / sample_size;
+
 		memset(localbuf, 0, localbuf_size);
 
 		GPMF_codebook *cb = (GPMF_codebook *)ms->cbhandle;
@@ -1359,7 +2413,7 @@ GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_
 			if (type == 'l')
 				type = GPMF_TYPE_SIGNED_SHORT;
 			else
-				type = GPMF_TYPE_UNSIGNED_SHORT; 
+				type = GPMF_TYPE_UNSIGNED_SHORT;
 		}
 
 
@@ -1372,7 +2426,7 @@ GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_
 		uint8_t *buf_u8 = (uint8_t *)localbuf;
 		int8_t *buf_s8 = (int8_t *)localbuf;
 		int last;
-		int pos, end = 0;
+		uint32_t pos;
 
 		memcpy(&buf_u8[0], start, sample_size);
 
@@ -1380,7 +2434,7 @@ GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_
 
 		for (chn = 0; chn<channels; chn++)
 		{
-			pos = 1;
+			gpmf_bitreader br;
 
 			switch (sizeoftype*signed_type)
 			{
@@ -1390,164 +2444,150 @@ GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_
 			case 1: last = buf_u8[chn]; quant = *((uint8_t *)&start[sOffset]); sOffset++; break;
 			case 2: last = BYTESWAP16(buf_u16[chn]); quant = *((uint16_t *)&start[sOffset]); quant = BYTESWAP16(quant); sOffset += 2;  break;
 			}
-						
-			sOffset = ((sOffset + 1) & ~1); //16-bit aligned compressed data
-			compressed_data = (uint16_t *)&start[sOffset];
 
-			uint16_t currWord = BYTESWAP16(*compressed_data); compressed_data++;
-			uint16_t nextWord = BYTESWAP16(*compressed_data); compressed_data++;
-			int currBits = 16;
-			int nextBits = 16;
+			sOffset = ((sOffset + 1) & ~1); //16-bit aligned compressed data
 
-			do
+			if (adaptive && (quant & (sizeoftype == 2 ? COMPRESS_CODING_FLAG16 : COMPRESS_CODING_FLAG8))) // adaptive Rice coded channel
 			{
-				switch (cb[currWord].command)
-				{
-				case 0:  // store zeros and/or a value
-					{
-						int usedbits = cb[currWord].bits_used;
-						int zeros = cb[currWord].offset;
-						int delta = (int)cb[currWord].value * quant;
+				uint32_t predictor, k, bits_per_src_word = sizeoftype * 8;
+				int32_t delta = 0;
 
-						last += delta * cb[currWord].bytes_stored;
+				quant &= ~(sizeoftype == 2 ? COMPRESS_CODING_FLAG16 : COMPRESS_CODING_FLAG8);
+				if ((uint8_t *)&start[sOffset + 2] > end_data)
+					return GPMF_ERROR_BAD_STRUCTURE;
+				predictor = start[sOffset];
+				k = start[sOffset + 1];
+				sOffset += 2;
+				if (predictor > COMPRESS_PREDICT_DELTA_DELTA || k > bits_per_src_word)
+					return GPMF_ERROR_BAD_STRUCTURE;
 
-						if (pos + zeros >= (int)maxsamples)
-						{
-							end = 1;
-							return GPMF_ERROR_MEMORY;
-						}
-						switch (sizeoftype*signed_type)
-						{
-						default:
-						case -2:
-							while (zeros) { buf_s16[channels*pos++ + chn] = BYTESWAP16(last); zeros--; }
-							buf_s16[channels*pos + chn] = BYTESWAP16(last);
-							break;
-						case -1:
-							while (zeros) { buf_s8[channels*pos++ + chn] = (int8_t)last; zeros--; }
-							buf_s8[channels*pos + chn] = (int8_t)last;
-							break;
-						case 1:
-							while (zeros) { buf_u8[channels*pos++ + chn] = (uint8_t)last; zeros--; }
-							buf_u8[channels*pos + chn] = (uint8_t)last;
-							break;
-						case 2:
-							while (zeros) { buf_u16[channels*pos++ + chn] = BYTESWAP16(last); zeros--; }
-							buf_u16[channels*pos + chn] = BYTESWAP16(last);
-							break;
-						}
-										
-						pos += cb[currWord].bytes_stored;
-						currWord <<= usedbits;
-						currBits -= usedbits;
-					}
-					break;
+				GPMF_InitBits(&br, &start[sOffset], end_data);
+
+				for (pos = 1; pos < maxsamples; pos++)
+				{
+					uint32_t q = 0, ones, zigzag;
+					int32_t value;
+
+					GPMF_FillBits(&br);
+					ones = GPMF_PeekBits16(&br);
+					while (q < RICE_ESCAPE_ONES && (ones & (0x8000 >> q)))
+						q++;
+					br.bits -= (q < RICE_ESCAPE_ONES) ? q + 1 : q; // the ones and the terminating '0'
+					if (q == RICE_ESCAPE_ONES)
+						zigzag = GPMF_GetBits(&br, bits_per_src_word + 2);
+					else
+						zigzag = (q << k) | GPMF_GetBits(&br, k);
 
-				case 1: //channel END code detected, store the remaining zero deltas
+					value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+					if (predictor == COMPRESS_PREDICT_DELTA_DELTA)
+						delta += value;
+					else
+						delta = value;
+					last += delta * quant;
+
+					switch (sizeoftype*signed_type)
 					{
-						int zeros = ((int)uncompressed_size/(channels*sizeoftype) - pos);
-						switch (sizeoftype*signed_type)
-						{
-						default:
-						case -2:
-							while (zeros) { buf_s16[channels*pos++ + chn] = BYTESWAP16(last); zeros--; }
-							break;
-						case -1:
-							while (zeros) { buf_s8[channels*pos++ + chn] = (int8_t)last; zeros--; }
-							break;
-						case 1:
-							while (zeros) { buf_u8[channels*pos++ + chn] = (uint8_t)last; zeros--; }
-							break;
-						case 2:
-							while (zeros) { buf_u16[channels*pos++ + chn] = BYTESWAP16(last); zeros--; }
-							break;
-						}
+					default:
+					case -2: buf_s16[channels*pos + chn] = BYTESWAP16(last); break;
+					case -1: buf_s8[channels*pos + chn] = (int8_t)last; break;
+					case 1: buf_u8[channels*pos + chn] = (uint8_t)last; break;
+					case 2: buf_u16[channels*pos + chn] = BYTESWAP16(last); break;
 					}
-					end = 1;
-					break;
+				}
 
-				case 2: //ESC code, next byte or short contains the delta.
-					{
-						int usedbits = cb[currWord].bits_used;
-						int delta;
-						currWord <<= usedbits;
-						currBits -= usedbits;
+				if (GPMF_OK != GPMF_EndBits(&br, start, &sOffset))
+					return GPMF_ERROR_BAD_STRUCTURE;
+				continue;
+			}
+
+			// Huffman coded deltas. Signed and unsigned samples only differ in how the first value was read,
+			// the deltas wrap identically, so only the sample width matters from here.
+			GPMF_InitBits(&br, &start[sOffset], end_data);
+			pos = 1;
+
+			for (;;)
+			{
+				GPMF_codebook *code;
+				uint32_t zeros;
+
+				GPMF_FillBits(&br);
+				code = &cb[GPMF_PeekBits16(&br)];
+
+				if (code->command == 0) // zeros and up to two values
+				{
+					zeros = code->offset;
+					if (pos + zeros + code->offset2 + code->bytes_stored > maxsamples)
+						return GPMF_ERROR_BAD_STRUCTURE;
+					br.bits -= code->bits_used;
 
-						//Get more bits
-						while (currBits < 16)
+					if (sizeoftype == 2)
+					{
+						while (zeros--) buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
+						if (code->bytes_stored)
 						{
-							int needed = 16 - currBits;
-							currWord |= nextWord >> currBits;
-							if (nextBits >= needed) currBits = 16; else currBits += nextBits;	
-							nextWord <<= needed;
-							nextBits -= needed;
-							if (nextBits <= 0)
+							last += code->value * quant;
+							buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
+							if (code->bytes_stored == 2)
 							{
-								nextWord = BYTESWAP16(*compressed_data);
-								compressed_data++;
-								nextBits = 16;
+								for (zeros = code->offset2; zeros; zeros--) buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
+								last += code->value2 * quant;
+								buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
 							}
 						}
-						
-						switch (sizeoftype*signed_type)
+					}
+					else
+					{
+						while (zeros--) buf_u8[channels*pos++ + chn] = (uint8_t)last;
+						if (code->bytes_stored)
 						{
-						default:
-						case -2:
-							delta = (int16_t)(currWord);
-							delta *= quant;
-							last += delta;
-							buf_s16[channels*pos++ + chn] = BYTESWAP16(last);
-							break;
-						case -1:
-							delta = (int8_t)(currWord >> 8);
-							delta *= quant;
-							last += delta;
-							buf_s8[channels*pos++ + chn] = (int8_t)last;
-							break;
-						case 1: 
-							delta = (int8_t)(currWord >> 8);
-							delta *= quant;
-							last += delta;
+							last += code->value * quant;
 							buf_u8[channels*pos++ + chn] = (uint8_t)last;
-							break;
-						case 2:
-							delta = (int16_t)(currWord);
-							delta *= quant;
-							last += delta;
-							buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
-							break;
+							if (code->bytes_stored == 2)
+							{
+								for (zeros = code->offset2; zeros; zeros--) buf_u8[channels*pos++ + chn] = (uint8_t)last;
+								last += code->value2 * quant;
+								buf_u8[channels*pos++ + chn] = (uint8_t)last;
+							}
 						}
-						currWord <<= 8 * sizeoftype;
-						currBits -= 8 * sizeoftype;
 					}
-					break;
-
-				default: //Invalid codeword read
-					end = 1; 
-					return GPMF_ERROR_MEMORY;
-					break;
 				}
-
-				//Get more bits
-				while (currBits < 16)
+				else if (code->command == 2) //ESC code, next byte or short contains the delta.
 				{
-					int needed = 16 - currBits;
-					currWord |= nextWord >> currBits;
-					if (nextBits >= needed) currBits = 16; else currBits += nextBits;
-					nextWord <<= needed;
-					nextBits -= needed;
-					if (nextBits <= 0)
+					int delta;
+
+					if (pos >= maxsamples)
+						return GPMF_ERROR_BAD_STRUCTURE;
+					br.bits -= code->bits_used;
+
+					if (sizeoftype == 2)
 					{
-						nextWord = BYTESWAP16(*compressed_data);
-						compressed_data++;
-						nextBits = 16;
+						delta = (int16_t)GPMF_GetBits(&br, 16);
+						last += delta * quant;
+						buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
+					}
+					else
+					{
+						delta = (int8_t)GPMF_GetBits(&br, 8);
+						last += delta * quant;
+						buf_u8[channels*pos++ + chn] = (uint8_t)last;
 					}
 				}
-			} while (!end);
-			
-			if (nextBits == 16) compressed_data--;
-			sOffset = (size_t)compressed_data - (size_t)start;
-			end = 0;
+				else if (code->command == 1) //channel END code detected, store the remaining zero deltas
+				{
+					br.bits -= code->bits_used;
+
+					if (sizeoftype == 2)
+						while (pos < maxsamples) buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
+					else
+						while (pos < maxsamples) buf_u8[channels*pos++ + chn] = (uint8_t)last;
+					break;
+				}
+				else //Invalid codeword read
+					return GPMF_ERROR_BAD_STRUCTURE;
+			}
+
+			if (GPMF_OK != GPMF_EndBits(&br, start, &sOffset))
+				return GPMF_ERROR_BAD_STRUCTURE;
 		}
 
 		return GPMF_OK;
@@ -1557,97 +2597,128 @@ GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_
 }
 
 
-GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle)
+// Huffman decode table for a 16-bit window: an optional zero run code, single zeros, a value, then single zeros and
+// a second value when they also fit. The table is read-only, built by the first stream that needs it and shared.
+static GPMF_codebook *gpmf_shared_codebook = NULL;
+
+static void GPMF_MatchValue(uint16_t code, int used, int *size, int *value)
 {
-	*cbhandle = (size_t)malloc(65536 * sizeof(GPMF_codebook));
-	if (*cbhandle)
-	{
-		int i,v,z;
-		GPMF_codebook *cb = (GPMF_codebook *)*cbhandle;
+	int v;
 
-		for (i = 0; i <= 0xffff; i++)
+	code <<= used;
+	*size = 0;
+	for (v = enchuftable.length - 1; v > 0; v--)
+	{
+		if (16 - used >= enchuftable.entries[v].size + 1) // codeword + sign bit
 		{
-			uint16_t code = (uint16_t)i;
-			uint16_t mask = 0x8000;
-			int zeros = 0, used = 0;
-
-			cb->command = 0;
-			
-			// all commands are 16-bits long
-			if (code == enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits)
-			{
-				cb->command = 2;
-				cb->bytes_stored = 1;
-				cb->bits_used = 16;
-				cb->offset = 0;
-				cb++;
-				continue;
-			}
-			if (code == enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].bits)
+			if ((code >> (16 - enchuftable.entries[v].size)) == enchuftable.entries[v].bits)
 			{
-				cb->command = 1;
-				cb->bytes_stored = 0;
-				cb->bits_used = 16;
-				cb->offset = 0;
-				cb++;
-				continue;
-			}
-			
-			for (z = enczerorunstable.length-1; z >= 0; z--)
-			{
-				if (16 - used >= enczerorunstable.entries[z].size)
-				{
-					if ((code >> (16 - enczerorunstable.entries[z].size)) == enczerorunstable.entries[z].bits)
-					{
-						zeros += enczerorunstable.entries[z].count;
-						used  += enczerorunstable.entries[z].size;
-						mask >>= enczerorunstable.entries[z].size;
-						break;
-					}
-				}
-				else break;
+				int sign = 1 - (((code >> (16 - (enchuftable.entries[v].size + 1))) & 1) << 1); // last bit is the sign.
+				*value = enchuftable.entries[v].value * sign;
+				*size = enchuftable.entries[v].size + 1;
+				return;
 			}
+		}
+	}
+}
 
-			// count single zeros.
-			while (!(code & mask) && mask)
-			{
-				zeros++;
-				used++;
-				mask >>= 1;
-			}
+static GPMF_codebook *GPMF_BuildCodebook(void)
+{
+	GPMF_codebook *table = (GPMF_codebook *)malloc(65536 * sizeof(GPMF_codebook));
+	GPMF_codebook *cb = table;
+	int i, z;
+
+	if (table == NULL)
+		return NULL;
+
+	for (i = 0; i <= 0xffff; i++, cb++)
+	{
+		uint16_t code = (uint16_t)i;
+		int zeros = 0, used = 0, size, value;
 
-			//move the code word up to see if is a complete code for a value following the zeros.  
-			code <<= used;
+		memset(cb, 0, sizeof(GPMF_codebook));
 
-			cb->bytes_stored = 0;
-			for (v=enchuftable.length-1; v>0; v--)
+		// all commands are 16-bits long
+		if (code == enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits)
+		{
+			cb->command = 2;
+			cb->bits_used = 16;
+			continue;
+		}
+		if (code == enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].bits)
+		{
+			cb->command = 1;
+			cb->bits_used = 16;
+			continue;
+		}
+
+		for (z = enczerorunstable.length - 1; z >= 0; z--)
+		{
+			if ((code >> (16 - enczerorunstable.entries[z].size)) == enczerorunstable.entries[z].bits)
 			{
-				if (16-used >= enchuftable.entries[v].size+1) // codeword + sign bit
-				{
-					if ((code >> (16 - enchuftable.entries[v].size)) == enchuftable.entries[v].bits)
-					{
-						int sign = 1-(((code >> (16 - (enchuftable.entries[v].size + 1))) & 1)<<1); // last bit is the sign.
-						cb->value = enchuftable.entries[v].value * (int16_t)sign;
-						used += enchuftable.entries[v].size+1;
-						cb->bytes_stored = 1;
-						break;
-					}
-				}
+				zeros += enczerorunstable.entries[z].count;
+				used += enczerorunstable.entries[z].size;
+				break;
 			}
-			
-			if (used == 0)
+		}
+
+		// count single zeros.
+		while (used < 16 && !(code & (0x8000 >> used)))
+		{
+			zeros++;
+			used++;
+		}
+		cb->offset = (uint8_t)zeros;
+
+		//see if there is a complete code for a value following the zeros.
+		GPMF_MatchValue(code, used, &size, &value);
+		if (size)
+		{
+			used += size;
+			cb->value = (int16_t)value;
+			cb->bytes_stored = 1;
+
+			// a second value, only single zeros between them
+			for (zeros = 0; used + zeros < 16 && !(code & (0x8000 >> (used + zeros))); zeros++);
+			GPMF_MatchValue(code, used + zeros, &size, &value);
+			if (size)
 			{
-				used = 16;
-				cb->command = -1; // ERROR invalid code
+				used += zeros + size;
+				cb->value2 = (int8_t)value;
+				cb->offset2 = (uint8_t)zeros;
+				cb->bytes_stored = 2;
 			}
-			cb->bits_used = (uint8_t)used;
-			cb->offset = (uint8_t)zeros;
-			cb++;
 		}
 
-		return GPMF_OK;
+		if (used == 0)
+		{
+			used = 16;
+			cb->command = -1; // ERROR invalid code
+		}
+		cb->bits_used = (uint8_t)used;
 	}
 
+	return table;
+}
+
+GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle)
+{
+	GPMF_codebook *cb = GPMF_LOAD_CODEBOOK(&gpmf_shared_codebook);
+
+	if (cb == NULL)
+	{
+		cb = GPMF_BuildCodebook();
+		if (cb && !GPMF_PUBLISH_CODEBOOK(&gpmf_shared_codebook, cb))
+		{
+			free(cb); // another stream published first
+			cb = GPMF_LOAD_CODEBOOK(&gpmf_shared_codebook);
+		}
+	}
+
+	*cbhandle = (size_t)cb;
+	if (*cbhandle)
+		return GPMF_OK;
+
 	return GPMF_ERROR_MEMORY;
 }
 
@@ -1657,7 +2728,8 @@ GPMF_ERR GPMF_FreeCodebook(size_t cbhandle)
 
 	if (cb)
 	{
-		free(cb);
+		if (cb != GPMF_LOAD_CODEBOOK(&gpmf_shared_codebook))
+			free(cb);
 
 		return GPMF_OK;
 	}
@@ -28,8 +28,6 @@
 extern "C" {
 #endif
 
-#define GPMF_NEST_LIMIT 16
-
 typedef struct GPMF_stream
 {
 	uint32_t *buffer;
@@ -60,6 +58,7 @@ GPMF_ERR GPMF_Init(GPMF_stream *gs, uint32_t *buffer, int datasize);							//Ini
 GPMF_ERR GPMF_ResetState(GPMF_stream *gs);														//Read from beginning of the buffer again
 GPMF_ERR GPMF_CopyState(GPMF_stream *src, GPMF_stream *dst);									//Copy state, 
 GPMF_ERR GPMF_Validate(GPMF_stream *gs, GPMF_LEVELS recurse);									//Is the nest structure valid GPMF? 
+GPMF_ERR GPMF_ValidateReport(GPMF_stream *gs, GPMF_LEVELS recurse, GPMF_validation *report);	//As above, report holds the position, level, key and reason of a failure
 
 // Navigate through GPMF data 
 GPMF_ERR GPMF_Next(GPMF_stream *gs, GPMF_LEVELS recurse);										//Step to the next GPMF KLV entrance, optionally recurse up or down nesting levels.
@@ -67,6 +66,79 @@ GPMF_ERR GPMF_FindPrev(GPMF_stream *gs, uint32_t fourCC, GPMF_LEVELS recurse);
 GPMF_ERR GPMF_FindNext(GPMF_stream *gs, uint32_t fourCC, GPMF_LEVELS recurse);					//find a particular FourCC upcoming -- at the current level only if recurse is false
 GPMF_ERR GPMF_SeekToSamples(GPMF_stream *gs);													//find the last FourCC in the current level, this is raw data for any STRM
 
+// Random access to the sample KLVs of a payload, one GPMF_BuildIndex() pass then direct seeks
+#define GPMF_INDEX_STREAMS	64
+
+typedef struct GPMF_index_entry
+{
+	uint32_t device_id;		// DVID of the enclosing DEVC
+	uint32_t fourcc;		// key of the sample KLV, e.g. ACCL
+	uint32_t pos;			// offset in longs of the sample KLV
+	uint32_t strm_pos;		// offset in longs of the enclosing STRM
+	uint32_t devc_remaining;// longs left in the DEVC after the STRM
+	uint32_t name_pos;		// offset in longs of the DVNM, 0 if none
+	uint32_t scale_pos;		// offset in longs of the STRM's SCAL, 0 if none
+	uint32_t samples;		// GPMF_PayloadSampleCount() of the sample KLV
+	uint32_t type;			// GPMF_SampleType of the samples, the uncompressed type for compressed KLVs
+} GPMF_index_entry;
+
+typedef struct GPMF_index
+{
+	uint32_t count;
+	GPMF_index_entry entry[GPMF_INDEX_STREAMS];
+} GPMF_index;
+
+GPMF_ERR GPMF_BuildIndex(GPMF_stream *gs, GPMF_index *index);									//one pass over the payload recording each STRM's samples, the read position is not changed
+GPMF_ERR GPMF_IndexSeek(GPMF_stream *gs, GPMF_index *index, uint32_t entry);					//position at an indexed sample KLV, as GPMF_SeekToSamples() would
+GPMF_ERR GPMF_IndexLookup(GPMF_stream *gs, GPMF_index *index, uint32_t fourCC);				//position at the first indexed sample KLV with this FourCC
+
+// Incremental parsing of GPMF arriving in pieces (e.g. from an external device), events are delivered as the bytes complete them
+#define GPMF_PUSH_BUFFER_SIZE	1024	// KLVs with up to this many bytes of data arrive whole in one GPMF_PUSH_SAMPLES event
+
+typedef enum GPMF_PUSH_EVENT
+{
+	GPMF_PUSH_NEST_BEGIN = 0,	// a nest (DEVC, STRM, ...) header, its contents follow
+	GPMF_PUSH_NEST_END,			// the last byte of a nest
+	GPMF_PUSH_SAMPLES,			// whole samples of the current KLV, stored big endian as in the stream
+	GPMF_PUSH_KLV_END			// the current KLV is complete, including its padding
+} GPMF_PUSH_EVENT;
+
+typedef struct GPMF_push_event
+{
+	uint32_t event;				// GPMF_PUSH_EVENT
+	uint32_t level;				// nest level of the KLV, 0 for a DEVC
+	uint32_t key;				// FourCC
+	uint32_t typesizerepeat;	// the KLV's second word, as for GPMF_SAMPLE_TYPE() etc.
+	uint8_t *data;				// GPMF_PUSH_SAMPLES only, not aligned, valid during the callback
+	uint32_t bytes;
+	uint32_t first_sample;		// index of the first sample in data within the KLV
+} GPMF_push_event;
+
+typedef GPMF_ERR (*GPMF_push_callback)(void *user, GPMF_push_event *event);	// anything but GPMF_OK stops the parser with that error
+
+typedef struct GPMF_push_parser
+{
+	GPMF_push_callback callback;
+	void *user;
+	uint32_t state;
+	uint32_t level;
+	uint32_t nest_key[GPMF_NEST_LIMIT];
+	uint32_t nest_remaining[GPMF_NEST_LIMIT];	// bytes left in each open nest
+	uint32_t key;
+	uint32_t typesizerepeat;
+	uint32_t data_remaining;	// bytes of samples still to come for the current KLV
+	uint32_t pad_remaining;
+	uint32_t sample_index;
+	uint32_t whole;				// the current KLV is collected in buffer and delivered in one piece
+	uint32_t buffered;			// bytes held in buffer
+	GPMF_ERR error;
+	uint8_t buffer[GPMF_PUSH_BUFFER_SIZE];		// a straddling header or sample, or a whole small KLV
+} GPMF_push_parser;
+
+GPMF_ERR GPMF_PushInit(GPMF_push_parser *pp, GPMF_push_callback callback, void *user);		//start (or restart) parsing a new byte stream of GPMF
+GPMF_ERR GPMF_PushFeed(GPMF_push_parser *pp, void *bytes, uint32_t size);					//parse the next bytes, any size, calling back for each event they complete
+GPMF_ERR GPMF_PushEnd(GPMF_push_parser *pp);													//GPMF_OK if the bytes so far ended between top level KLVs
+
 // Get information about the current GPMF KLV
 uint32_t GPMF_Key(GPMF_stream *gs);																//return the current Key (FourCC)
 GPMF_SampleType GPMF_Type(GPMF_stream *gs);														//return the current Type (GPMF_Type)
@@ -93,6 +165,29 @@ uint32_t GPMF_FormattedDataSize(GPMF_stream *gs);												//return the decomp
 uint32_t GPMF_ScaledDataSize(GPMF_stream *gs, GPMF_SampleType type);												//return the decompressed data size for the current GPMF KLV
 GPMF_ERR GPMF_FormattedData(GPMF_stream *gs, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples);  // extract 'n' samples into local endian memory format.
 GPMF_ERR GPMF_ScaledData(GPMF_stream *gs, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // extract 'n' samples into local endian memory format										// return a point the KLV data.
+GPMF_ERR GPMF_ScaledColumns(GPMF_stream *gs, void **columns, uint32_t column_count, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // as GPMF_ScaledData(), but element e of sample n goes to ((type *)columns[e])[n]. NULL columns are skipped, column_count <= elements
+
+// Extracting one stream from many payloads, each payload is self-contained so they are decoded in parallel
+typedef struct GPMF_extract_slot
+{
+	uint32_t *payload;		// payload to extract from
+	uint32_t payload_size;	// in bytes
+	void *output;			// this payload's samples, NULL to only fill in needed
+	uint32_t output_size;	// bytes available at output
+	uint32_t needed;		// bytes required at output
+	uint32_t samples;		// samples of the stream in this payload
+	uint32_t elements;		// elements per sample
+	uint32_t total_samples;	// the stream's TSMP in this payload, 0 if none
+	uint32_t first_sample;	// index of the first sample in the recording from TSMP, otherwise following on from the previous slot
+	uint64_t time_stamp;	// the stream's STMP in microseconds
+	uint32_t stamped;		// 1 if the payload has an STMP for the stream
+	uint32_t row;			// GPMF_ExtractColumns() only, the column row of this payload's first sample
+	GPMF_ERR error;			// GPMF_ERROR_FIND if the payload doesn't carry the stream
+} GPMF_extract_slot;
+
+GPMF_ERR GPMF_ExtractPayloads(GPMF_extract_slot *slots, uint32_t count, uint32_t fourCC, GPMF_SampleType type, uint32_t threads); // type 0 for GPMF_FormattedData() output, otherwise as GPMF_ScaledData(). threads 0 or 1 extracts on the calling thread. Returns the first slot error
+GPMF_ERR GPMF_ExtractColumns(GPMF_extract_slot *slots, uint32_t count, uint32_t fourCC, GPMF_SampleType type, void **columns, uint32_t column_count, // as GPMF_ScaledColumns(), payloads follow on in rows. columns NULL to only fill in the slots,
+	double *timestamps, uint32_t capacity, uint32_t threads);									// timestamps (optional) in seconds interpolated from STMP between payloads. capacity is rows available per column
 
 //Tools for Compressed datatypes
 
@@ -101,13 +196,15 @@ typedef struct GPMF_codebook
 	int16_t value;			//value to store
 	uint8_t offset;			//0 to 128+ bytes to skip before store (leading zeros)
 	uint8_t bits_used;		//1 to 16,32 (if escape code > 16 then read from bit-steam), 
-	int8_t bytes_stored;	//bytes stored in value: 0, 1 or 2
-	int8_t command;		//0 - OKAY,  -1 valid code, 1 - end
+	int8_t bytes_stored;	//values stored: 0, 1 or 2 (value, then offset2 zeros and value2)
+	int8_t command;		//0 - OKAY,  -1 valid code, 1 - end, 2 - escape
+	int8_t value2;			//second value to store
+	uint8_t offset2;		//zeros between value and value2
 } GPMF_codebook;
 
 
-GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle);
-GPMF_ERR GPMF_FreeCodebook(size_t cbhandle);
+GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle);	// returns the decode table shared by all streams, built on first use
+GPMF_ERR GPMF_FreeCodebook(size_t cbhandle);	// the shared table is kept, only a private table is freed
 GPMF_ERR GPMF_DecompressedSize(GPMF_stream *gs, uint32_t *neededsize);
 GPMF_ERR GPMF_Decompress(GPMF_stream *gs, uint32_t *localbuf, uint32_t localbuf_size);
 
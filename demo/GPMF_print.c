@@ -828,7 +828,7 @@ void PrintGPMF(GPMF_stream *ms)
 				uint32_t *outputbuf = NULL;
 				uint32_t buffersize;
 
-				if (type == GPMF_TYPE_COMPRESSED)
+				if (GPMF_IS_COMPRESSED(type))
 				{
 					type = GPMF_Type(ms);
 					structsize = GPMF_StructSize(ms);
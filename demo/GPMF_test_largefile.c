@@ -0,0 +1,145 @@
+/*! @file GPMF_test_largefile.c
+ *
+ *  @brief Test of MP4 export beyond 4GB and 32-bit durations, read back with the demo reader
+ *
+ *  @version 1.0.0
+ *
+ *  (C) Copyright 2017 GoPro Inc (http://gopro.com/).
+ *
+ *  Licensed under either:
+ *  - Apache License, Version 2.0, http://www.apache.org/licenses/LICENSE-2.0  
+ *  - MIT license, http://opensource.org/licenses/MIT
+ *  at your option.
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../GPMF_common.h"
+#include "../GPMF_writer.h"
+#include "GPMF_mp4writer.h"
+#include "GPMF_mp4reader.h"
+
+#define TEST_PAYLOADS		200
+#define TEST_HOLES			50			// payloads reserved with ExportPayloadReserved(), so the file is sparse
+#define TEST_HOLE_SIZE		(100<<20)	// 50 x 100MB takes the mdat past 4GB
+#define TEST_DURATION		100000000	// per payload in 1/1000s, so the total duration passes 32-bits too
+#define TEST_CHUNK			20			// payloads per chunk, so most chunk offsets need a co64
+#define TEST_SKIPPED		77			// the classic test needs sparse files, see SKIP_RETURN_CODE in CMakeLists.txt
+
+
+int main(int argc, char *argv[])
+{
+	char *filename = argc > 1 ? argv[1] : "GPMF_test_largefile.mp4";
+	uint32_t fragmented = argc > 2 && atoi(argv[2]);
+	uint32_t *payloads[TEST_PAYLOADS];
+	uint32_t sizes[TEST_PAYLOADS];
+	uint32_t buffer[4096], *payload, payload_size, i, n, k = 0, holes = 0, errors = 0;
+	int16_t samples[100 * 3];
+	char sensor[16384];
+	size_t gpmfhandle, handle, mp4_handle;
+	double in, out = 0.0;
+
+	gpmfhandle = GPMFWriteServiceInit();
+	if (gpmfhandle == 0) return -1;
+	handle = GPMFWriteStreamOpen(gpmfhandle, GPMF_CHANNEL_TIMED, GPMF_DEVICE_ID_CAMERA, "Test", sensor, sizeof(sensor));
+	if (handle == 0) return -1;
+
+	for (i = 0; i < TEST_PAYLOADS; i++)
+	{
+		for (n = 0; n < 100 * 3; n++)
+			samples[n] = (int16_t)(i * 300 + n);
+		GPMFWriteStreamStore(handle, STR2FOURCC("ACCL"), GPMF_TYPE_SIGNED_SHORT, 6, 100, samples, GPMF_FLAGS_NONE);
+		GPMFWriteGetPayload(gpmfhandle, GPMF_CHANNEL_TIMED, buffer, sizeof(buffer), &payload, &payload_size);
+
+		sizes[i] = payload_size;
+		payloads[i] = (uint32_t *)malloc(payload_size);
+		if (payloads[i] == NULL) return -1;
+		memcpy(payloads[i], payload, payload_size);
+	}
+	GPMFWriteStreamClose(handle);
+	GPMFWriteServiceClose(gpmfhandle);
+
+
+	if (fragmented) // no holes, only the durations pass 32-bits
+		mp4_handle = OpenMP4ExportFragmented(filename, 1000, TEST_DURATION, 4, 0);
+	else
+	{
+		mp4_handle = OpenMP4Export(filename, 1000, TEST_DURATION);
+		if (mp4_handle)
+			ExportChunks(mp4_handle, TEST_CHUNK, 0);
+	}
+	if (mp4_handle == 0)
+	{
+		printf("error: can't create %s\n", filename);
+		return -1;
+	}
+
+	for (i = 0; i < TEST_PAYLOADS; i++)
+	{
+		if (!ExportPayload(mp4_handle, payloads[i], sizes[i]))
+		{
+			printf("error: export of payload %d failed\n", i);
+			return -1;
+		}
+		if (!fragmented && i < TEST_HOLES && !ExportPayloadReserved(mp4_handle, TEST_HOLE_SIZE))
+		{
+			CloseExport(mp4_handle);
+			remove(filename);
+			if (i == 0) // without sparse files this would write 5GB
+			{
+				printf("skipped: %s can't be made sparse\n", filename);
+				return TEST_SKIPPED;
+			}
+			printf("error: export of hole %d failed\n", i);
+			return -1;
+		}
+	}
+	CloseExport(mp4_handle);
+
+
+	mp4_handle = OpenMP4Source(filename);
+	if (mp4_handle == 0)
+	{
+		printf("error: can't read back %s\n", filename);
+		remove(filename);
+		return -1;
+	}
+
+	n = GetNumberPayloads(mp4_handle);
+	for (i = 0; i < n; i++)
+	{
+		GetPayloadTime(mp4_handle, i, &in, &out);
+		if (GetPayloadSize(mp4_handle, i) == TEST_HOLE_SIZE)
+		{
+			holes++;
+			continue;
+		}
+		if (k >= TEST_PAYLOADS || GetPayloadSize(mp4_handle, i) != sizes[k] || memcmp(GetPayload(mp4_handle, i), payloads[k], sizes[k]))
+			errors++;
+		k++;
+	}
+	CloseSource(mp4_handle);
+	remove(filename);
+
+	if (k != TEST_PAYLOADS || holes != (fragmented ? 0 : TEST_HOLES))
+		errors++;
+	if (out != (double)n * TEST_DURATION / 1000.0) // the final out time only survives with 64-bit durations
+		errors++;
+
+	printf("%s: %d payloads, %d holes, last out %.0fs, %d errors\n", fragmented ? "fragmented" : "classic", n, holes, out, errors);
+
+	for (i = 0; i < TEST_PAYLOADS; i++)
+		free(payloads[i]);
+
+	return errors ? -1 : 0;
+}
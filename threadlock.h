@@ -88,6 +88,72 @@ THREAD_API(GetTick)(uint32_t *tick)
 	return THREAD_ERROR_OKAY;
 }
 
+#define THREADLOCK_WORKERS	1	// CONDITION and WORKER are available
+
+typedef struct
+{
+	CONDITION_VARIABLE cond;
+} CONDITION;
+
+typedef void (*WORKER_PROC)(void *arg);
+
+typedef struct
+{
+	HANDLE handle;
+	WORKER_PROC proc;
+	void *arg;
+} WORKER;
+
+THREAD_API(CreateCondition)(CONDITION *cond)
+{
+	InitializeConditionVariable(&cond->cond);
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(DeleteCondition)(CONDITION *cond)
+{
+	(void)cond;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(WaitCondition)(CONDITION *cond, LOCK *lock) // call with the lock held
+{
+	if (!SleepConditionVariableCS(&cond->cond, &lock->mutex, INFINITE))
+		return THREAD_ERROR_WAIT_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(WakeAllCondition)(CONDITION *cond)
+{
+	WakeAllConditionVariable(&cond->cond);
+	return THREAD_ERROR_OKAY;
+}
+
+static DWORD WINAPI WorkerEntry(LPVOID param)
+{
+	WORKER *worker = (WORKER *)param;
+	worker->proc(worker->arg);
+	return 0;
+}
+
+THREAD_API(CreateWorker)(WORKER *worker, WORKER_PROC proc, void *arg)
+{
+	worker->proc = proc;
+	worker->arg = arg;
+	worker->handle = CreateThread(NULL, 0, WorkerEntry, worker, 0, NULL);
+	if (worker->handle == NULL)
+		return THREAD_ERROR_CREATE_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(JoinWorker)(WORKER *worker)
+{
+	if (WaitForSingleObject(worker->handle, INFINITE) != WAIT_OBJECT_0)
+		return THREAD_ERROR_JOIN_FAILED;
+	CloseHandle(worker->handle);
+	return THREAD_ERROR_OKAY;
+}
+
 #elif BUILD_CAMERA_RTOS
 
 #include "rtos_mutex.h"
@@ -189,6 +255,71 @@ THREAD_API(GetTick)(uint32_t *tick)
 	return THREAD_ERROR_OKAY;
 }
 
+#define THREADLOCK_WORKERS	1	// CONDITION and WORKER are available
+
+typedef struct
+{
+	pthread_cond_t cond;
+} CONDITION;
+
+typedef void (*WORKER_PROC)(void *arg);
+
+typedef struct
+{
+	pthread_t thread;
+	WORKER_PROC proc;
+	void *arg;
+} WORKER;
+
+THREAD_API(CreateCondition)(CONDITION *cond)
+{
+	if (pthread_cond_init(&cond->cond, NULL) != 0)
+		return THREAD_ERROR_CREATE_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(DeleteCondition)(CONDITION *cond)
+{
+	pthread_cond_destroy(&cond->cond);
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(WaitCondition)(CONDITION *cond, LOCK *lock) // call with the lock held
+{
+	if (pthread_cond_wait(&cond->cond, &lock->mutex) != 0)
+		return THREAD_ERROR_WAIT_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(WakeAllCondition)(CONDITION *cond)
+{
+	pthread_cond_broadcast(&cond->cond);
+	return THREAD_ERROR_OKAY;
+}
+
+static inline void *WorkerEntry(void *param)
+{
+	WORKER *worker = (WORKER *)param;
+	worker->proc(worker->arg);
+	return NULL;
+}
+
+THREAD_API(CreateWorker)(WORKER *worker, WORKER_PROC proc, void *arg)
+{
+	worker->proc = proc;
+	worker->arg = arg;
+	if (pthread_create(&worker->thread, NULL, WorkerEntry, worker) != 0)
+		return THREAD_ERROR_CREATE_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
+THREAD_API(JoinWorker)(WORKER *worker)
+{
+	if (pthread_join(worker->thread, NULL) != 0)
+		return THREAD_ERROR_JOIN_FAILED;
+	return THREAD_ERROR_OKAY;
+}
+
 
 #endif
 